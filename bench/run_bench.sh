@@ -0,0 +1,21 @@
+#!/bin/sh
+# Generate synthetic $J of each size and benchmark every stage on it
+# usage: bench/run_bench.sh [size...]   (default: 100M 1G 10G 50G)
+# BENCH_DIR: work directory, keeps usn_bench_<size>.json (default: /tmp)
+# GEN_OPTS: extra usn_gen options, e.g. "--v3 0.1 --rate 1000"
+# BENCH_OPTS: extra usn_bench options
+cd "$(dirname "$0")/.." || exit 1
+make bench >/dev/null || exit 1
+
+dir=${BENCH_DIR:-/tmp}
+[ $# -eq 0 ] && set -- 100M 1G 10G 50G
+for size in "$@"; do
+  input="$dir/usn_bench_$size.bin"
+  output="$dir/usn_bench_$size"
+  ./usn_gen --size "$size" $GEN_OPTS "$input" || exit 1
+  rm -rf "$output"
+  ./usn_bench $BENCH_OPTS -o "$output" "$input" || exit 1
+  cp "$output/metrics.json" "$dir/usn_bench_$size.json"
+  rm -rf "$input" "$output"
+  echo
+done
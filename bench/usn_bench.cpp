@@ -0,0 +1,128 @@
+// Stage-level benchmark of usn_analytics
+// Runs each stage of process() on one input separately and reports records/sec
+// and MB/s (input bytes per second of the stage) for each, and heap allocations
+// per record counted by replacing global operator new.
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <new>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "usnjrnl.h"
+#include "utils.h"
+
+using namespace std;
+
+static atomic<uint64_t> heap_allocations(0);
+
+static uint64_t count_allocations() {
+  return heap_allocations.load(memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+  heap_allocations.fetch_add(1, memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == NULL)
+    throw bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+void usage(void) {
+  printf("Stage-level benchmark of usn_analytics\n\n");
+  printf("Usage  : usn_bench [-t threads] -o output input\n");
+  printf("     -t: number of worker threads for scanning (default: number of cores)\n");
+  printf(" -o out: output directory for stage outputs and metrics.json\n");
+  printf("     in: $J, e.g. written by usn_gen\n\n");
+}
+
+int main(int argc, char **argv) {
+  char *odname = NULL;
+  uint32_t threads = 0;
+  int opt;
+
+  // globals of lib/utils.cpp
+  lt = false;
+  quiet = true;
+  while ((opt = getopt(argc, argv, "ho:t:")) != -1) {
+    switch (opt) {
+      case 'o':
+        odname = optarg;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (odname == NULL || optind != argc - 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  char *ifname = argv[optind];
+  if (!is_dir(odname) && mkdir(odname, 0775) != 0) {
+    perror("Output Directory Error");
+    exit(EXIT_FAILURE);
+  }
+  if (threads == 0)
+    threads = thread::hardware_concurrency();
+  WorkStealingPool pool(threads);
+
+  Metrics metrics;
+  UsnJrnl usnjrnl(ifname, odname);
+  usnjrnl.pool = &pool;
+  usnjrnl.metrics = &metrics;
+  metrics.allocations = &count_allocations;
+  usnjrnl.LoadIocRules(NULL);
+
+  // same order and stage names as process()
+  metrics.Begin("scan", 0);
+  usnjrnl.GetAllUsnOffset();
+  metrics.End(usnjrnl.usn_set.size());
+  metrics.Begin("sort_dedup", usnjrnl.usn_set.size());
+  usnjrnl.PreProcess();
+  metrics.End(usnjrnl.usn_set.size());
+  metrics.Begin("pack", usnjrnl.usn_set.size());
+  usnjrnl.CheckRecords();
+  metrics.End(usnjrnl.usnmain_set.size());
+  usnjrnl.PostProcess(); // directory_build, path_resolution, usn_range
+  uint64_t packed = usnjrnl.usnmain_set.size();
+  metrics.Begin("write_bundled", packed);
+  metrics.End(usnjrnl.WriteBundledRecords(odname, lt));
+  metrics.Begin("write_executed", packed);
+  metrics.End(usnjrnl.WriteExecutedRecords(odname, lt));
+  metrics.Begin("write_opened", packed);
+  metrics.End(usnjrnl.WriteOpenedRecords(odname, lt));
+  metrics.Begin("write_suspicious", packed);
+  metrics.End(usnjrnl.WriteSuspiciousInfo(odname, lt));
+  metrics.Begin("write_burst", packed);
+  metrics.End(usnjrnl.WriteBurstInfo(lt));
+  metrics.Begin("write_all", usnjrnl.usn_set.size());
+  usnjrnl.WriteAllRecords(odname, lt);
+  metrics.End(usnjrnl.usn_set.size());
+  metrics.Write(odname, ifname, usnjrnl.file_size, threads);
+
+  double mb = usnjrnl.file_size / 1048576.0;
+  printf("%llu bytes, %lu records, %lu packed, %u threads (%s)\n", usnjrnl.file_size, usnjrnl.usn_set.size(),
+    usnjrnl.usnmain_set.size(), threads, ifname);
+  printf("stage            |   wall(s) |  records/s |     MB/s | allocs/rec | records in/out\n");
+  for (auto &s: metrics.stages) {
+    double wall = s.wall > 0 ? s.wall : 1e-9;
+    uint64_t n = s.records_in > s.records_out ? s.records_in : s.records_out; // scan has no input records
+    printf("%-16s | %9.3f | %10.0f | %8.1f | %10.3f | %llu/%llu\n", s.name.c_str(), s.wall,
+      n / wall, mb / wall, n > 0 ? double(s.allocations) / n : 0.0, s.records_in, s.records_out);
+  }
+  return 0;
+}
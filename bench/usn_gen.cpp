@@ -0,0 +1,381 @@
+// Synthetic $J generator for benchmarking
+// Writes a deterministic stream of USN_RECORD_V2 (optionally mixed with V3)
+// records with the layout of a real $J: sparse lead, records packed in 4KB
+// pages, usn equal to file offset.
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "usnrecord.h"
+
+using namespace std;
+
+bool raw = false;
+bool lt = false;
+
+#define GEN_PAGE 4096
+#define GEN_BUFFER (4*1024*1024)
+#define GEN_ROOT 5
+#define GEN_TS_BEGIN 132000000000000000ULL // 2019-04
+
+struct USN_RECORD_V3_HEADER {
+  uint32_t RecordLength;
+  uint16_t MajorVersion;
+  uint16_t MinorVersion;
+  uint64_t FileReferenceNumber[2];
+  uint64_t ParentFileReferenceNumber[2];
+  uint64_t Usn;
+  uint64_t TimeStamp;
+  uint32_t Reason;
+  uint32_t SourceInfo;
+  uint32_t SecurityId;
+  uint32_t FileAttributes;
+  uint16_t FileNameLength;
+  uint16_t FileNameOffset;
+};
+
+struct gen_file {
+  uint32_t id;
+  uint32_t pid;
+  uint16_t seq;
+  string name;
+};
+
+// Generation parameters, every ratio is 0.0 - 1.0
+struct gen_config {
+  uint64_t size;       // output bytes
+  uint64_t seed;
+  double sparse;       // leading hole as part of size
+  double garbage;      // random bytes between records as part of size
+  uint32_t dirs;       // initial directories
+  double churn;        // operations creating new files/directories instead of touching existing ones
+  double rename;       // operations which are renames
+  double del;          // operations which are deletions
+  double v3;           // records written as USN_RECORD_V3
+  uint32_t rate;       // records per second on average
+};
+
+class Generator {
+private:
+  gen_config cfg;
+  FILE *fp;
+  vector<unsigned char> buf;
+  uint64_t offset;   // of buf[0] in output
+  uint64_t ts;
+  uint64_t state;    // xorshift64*
+  uint32_t next_id;
+  vector<gen_file> dirs;
+  vector<gen_file> files;
+  uint32_t prefetch_dir;
+  uint32_t recent_dir;
+
+public:
+  uint64_t records;
+  uint64_t v3_records;
+  uint64_t garbage_bytes;
+
+private:
+  uint64_t Rand() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+  }
+  double Uniform() {
+    return (Rand() >> 11) * (1.0 / 9007199254740992.0);
+  }
+  uint64_t Pos() {
+    return offset + buf.size();
+  }
+  void Flush() {
+    if (fwrite(buf.data(), 1, buf.size(), fp) != buf.size()) {
+      perror("Output File Error");
+      exit(EXIT_FAILURE);
+    }
+    offset += buf.size();
+    buf.clear();
+  }
+  // zero fill up to next page if len bytes do not fit in the current one
+  void Align(uint64_t len) {
+    uint64_t used = Pos() % GEN_PAGE;
+    if (used + len > GEN_PAGE)
+      buf.resize(buf.size() + GEN_PAGE - used, 0);
+  }
+  void Record(const gen_file &f, uint32_t reason, uint32_t attr);
+  void Garbage();
+  gen_file NewEntry(uint32_t pid, const string &name);
+  void Operation();
+
+public:
+  Generator(const gen_config&, FILE*);
+  void Run();
+};
+
+Generator::Generator(const gen_config &c, FILE *out) {
+  cfg = c;
+  fp = out;
+  offset = 0;
+  ts = GEN_TS_BEGIN;
+  state = c.seed * 0x9E3779B97F4A7C15ULL + 1;
+  next_id = 64;
+  records = v3_records = garbage_bytes = 0;
+  buf.reserve(GEN_BUFFER + GEN_PAGE);
+}
+
+// Append one record of f, as V3 for cfg.v3 of records
+void Generator::Record(const gen_file &f, uint32_t reason, uint32_t attr) {
+  u16string name16(f.name.begin(), f.name.end());
+  uint16_t name_len = name16.size() * 2;
+  bool v3 = cfg.v3 > 0 && Uniform() < cfg.v3;
+  uint32_t header = v3 ? sizeof(USN_RECORD_V3_HEADER) : sizeof(USN_RECORD_V2);
+  uint32_t len = (header + name_len + 7) / 8 * 8;
+
+  Align(len);
+  ts += 1 + Rand() % (20000000 / cfg.rate);
+  size_t p = buf.size();
+  buf.resize(p + len, 0);
+  if (v3) {
+    USN_RECORD_V3_HEADER r;
+    memset(&r, 0, sizeof(r));
+    r.RecordLength = len;
+    r.MajorVersion = 3;
+    r.FileReferenceNumber[0] = f.id | (uint64_t(f.seq) << 48);
+    r.ParentFileReferenceNumber[0] = f.pid | (1ULL << 48);
+    r.Usn = Pos() - len;
+    r.TimeStamp = ts;
+    r.Reason = reason;
+    r.FileAttributes = attr;
+    r.FileNameLength = name_len;
+    r.FileNameOffset = header;
+    memcpy(&buf[p], &r, sizeof(r));
+    v3_records++;
+  } else {
+    USN_RECORD_V2 r;
+    memset(&r, 0, sizeof(r));
+    r.RecordLength = len;
+    r.MajorVersion = 2;
+    r.FileReferenceNumber = f.id | (uint64_t(f.seq) << 48);
+    r.ParentFileReferenceNumber = f.pid | (1ULL << 48);
+    r.Usn = Pos() - len;
+    r.TimeStamp = ts;
+    r.Reason = reason;
+    r.FileAttributes = attr;
+    r.FileNameLength = name_len;
+    r.FileNameOffset = header;
+    memcpy(&buf[p], &r, sizeof(r));
+  }
+  memcpy(&buf[p + header], name16.data(), name_len);
+  records++;
+}
+
+// Random bytes looking like nothing (unallocated space carved with $J)
+void Generator::Garbage() {
+  uint64_t len = 64 + (Rand() % 57) * 8;
+  for (uint64_t i = 0; i < len; i += 8) {
+    uint64_t v = Rand();
+    buf.insert(buf.end(), (unsigned char*)&v, (unsigned char*)&v + 8);
+  }
+  garbage_bytes += len;
+}
+
+gen_file Generator::NewEntry(uint32_t pid, const string &name) {
+  gen_file f;
+  f.id = next_id++;
+  f.pid = pid;
+  f.seq = 1 + Rand() % 8;
+  f.name = name;
+  return f;
+}
+
+// One file system operation as the sequence of records Windows writes for it
+void Generator::Operation() {
+  static const char *exts[] = {"txt", "docx", "xlsx", "exe", "dll", "ps1", "tmp", "log", "jpg", "zip"};
+  double k = Uniform();
+
+  if (files.empty() || k < cfg.churn) {
+    double c = Uniform();
+    if (c < 0.05) { // new directory
+      gen_file d = NewEntry(dirs[Rand() % dirs.size()].id, "d" + to_string(next_id));
+      Record(d, CREATE, FOLDER);
+      Record(d, CREATE | CLOSE, FOLDER);
+      dirs.push_back(d);
+    } else if (c < 0.15) { // program executed
+      gen_file f = NewEntry(prefetch_dir, "PROG" + to_string(Rand() % 200) + ".EXE-1A2B3C4D.pf");
+      Record(f, CREATE, ARCHIVE);
+      Record(f, CREATE | EXTEND, ARCHIVE);
+      Record(f, CREATE | EXTEND | CLOSE, ARCHIVE);
+    } else if (c < 0.25) { // file opened
+      gen_file f = NewEntry(recent_dir, "doc" + to_string(Rand() % 500) + ".lnk");
+      Record(f, CREATE, ARCHIVE);
+      Record(f, CREATE | CLOSE, ARCHIVE);
+    } else {
+      gen_file f = NewEntry(dirs[Rand() % dirs.size()].id, "f" + to_string(next_id) + "." + exts[Rand() % 10]);
+      Record(f, CREATE, ARCHIVE);
+      Record(f, CREATE | EXTEND, ARCHIVE);
+      Record(f, CREATE | EXTEND | CLOSE, ARCHIVE);
+      files.push_back(f);
+    }
+    return;
+  }
+
+  size_t i = Rand() % files.size();
+  gen_file &f = files[i];
+  k = Uniform();
+  if (k < cfg.rename) {
+    Record(f, OLDNAME, ARCHIVE);
+    f.name = "r" + to_string(Rand() % 100000) + "." + exts[Rand() % 10];
+    Record(f, NEWNAME, ARCHIVE);
+    Record(f, NEWNAME | CLOSE, ARCHIVE);
+  } else if (k < cfg.rename + cfg.del) {
+    Record(f, DELETE | CLOSE, ARCHIVE);
+    files[i] = files.back();
+    files.pop_back();
+  } else if (k < cfg.rename + cfg.del + 0.1) {
+    Record(f, SECURITY, ARCHIVE);
+    Record(f, SECURITY | CLOSE, ARCHIVE);
+  } else {
+    Record(f, OVERWRITE, ARCHIVE);
+    Record(f, OVERWRITE | EXTEND, ARCHIVE);
+    Record(f, OVERWRITE | EXTEND | CLOSE, ARCHIVE);
+  }
+}
+
+void Generator::Run() {
+  uint64_t lead = uint64_t(cfg.size * cfg.sparse) / GEN_PAGE * GEN_PAGE;
+
+  // sparse lead as a hole (journal data already deallocated by NTFS)
+  if (lead > 0 && fseeko(fp, lead, SEEK_SET) != 0) {
+    perror("Output File Error");
+    exit(EXIT_FAILURE);
+  }
+  offset = lead;
+
+  gen_file d = NewEntry(GEN_ROOT, "Windows");
+  dirs.push_back(d);
+  d = NewEntry(d.id, "Prefetch");
+  prefetch_dir = d.id;
+  dirs.push_back(d);
+  d = NewEntry(GEN_ROOT, "Users");
+  dirs.push_back(d);
+  d = NewEntry(d.id, "Recent");
+  recent_dir = d.id;
+  dirs.push_back(d);
+  while (dirs.size() < cfg.dirs)
+    dirs.push_back(NewEntry(dirs[Rand() % dirs.size()].id, "d" + to_string(next_id)));
+  for (auto &x: dirs) {
+    Record(x, CREATE, FOLDER);
+    Record(x, CREATE | CLOSE, FOLDER);
+  }
+
+  // keep the live file set bounded, as files of a volume are not unlimited
+  while (Pos() + 576 < cfg.size) {
+    if (garbage_bytes < cfg.garbage * (Pos() - lead))
+      Garbage();
+    else
+      Operation();
+    if (files.size() > 100000)
+      files.erase(files.begin(), files.begin() + 50000);
+    if (buf.size() >= GEN_BUFFER)
+      Flush();
+  }
+  buf.resize(buf.size() + (cfg.size - Pos()), 0);
+  Flush();
+}
+
+// Parse size with K/M/G/T suffix
+static uint64_t parse_size(const char *s) {
+  char *end;
+  uint64_t v = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'T': case 't': v <<= 10;
+    case 'G': case 'g': v <<= 10;
+    case 'M': case 'm': v <<= 10;
+    case 'K': case 'k': v <<= 10;
+  }
+  return v;
+}
+
+void usage(void) {
+  printf("Synthetic $J generator for usn_analytics benchmark\n\n");
+  printf("Usage  : usn_gen [options] output\n");
+  printf("  --size n[KMGT]  : output size (default: 100M)\n");
+  printf("  --seed n        : random seed, same seed and options give same output (default: 1)\n");
+  printf("  --sparse ratio  : leading hole as part of size (default: 0.5)\n");
+  printf("  --garbage ratio : random bytes between records as part of size (default: 0.01)\n");
+  printf("  --dirs n        : initial directories (default: 1000)\n");
+  printf("  --churn ratio   : operations creating files/directories (default: 0.3)\n");
+  printf("  --rename ratio  : operations renaming a file (default: 0.1)\n");
+  printf("  --delete ratio  : operations deleting a file (default: 0.1)\n");
+  printf("  --v3 ratio      : records written as USN_RECORD_V3 (default: 0)\n");
+  printf("  --rate n        : records per second, packing reads every record within 1s\n");
+  printf("                    of a record so high rates make it slow (default: 100)\n\n");
+}
+
+int main(int argc, char **argv) {
+  gen_config cfg;
+  cfg.size = 100ULL << 20;
+  cfg.seed = 1;
+  cfg.sparse = 0.5;
+  cfg.garbage = 0.01;
+  cfg.dirs = 1000;
+  cfg.churn = 0.3;
+  cfg.rename = 0.1;
+  cfg.del = 0.1;
+  cfg.v3 = 0;
+  cfg.rate = 100;
+
+  struct option longopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"size", required_argument, NULL, 1},
+    {"seed", required_argument, NULL, 2},
+    {"sparse", required_argument, NULL, 3},
+    {"garbage", required_argument, NULL, 4},
+    {"dirs", required_argument, NULL, 5},
+    {"churn", required_argument, NULL, 6},
+    {"rename", required_argument, NULL, 7},
+    {"delete", required_argument, NULL, 8},
+    {"v3", required_argument, NULL, 9},
+    {"rate", required_argument, NULL, 10},
+    {0, 0, 0, 0},
+  };
+  int opt, longindex;
+  while ((opt = getopt_long(argc, argv, "h", longopts, &longindex)) != -1) {
+    switch (opt) {
+      case 1: cfg.size = parse_size(optarg); break;
+      case 2: cfg.seed = strtoull(optarg, NULL, 10); break;
+      case 3: cfg.sparse = atof(optarg); break;
+      case 4: cfg.garbage = atof(optarg); break;
+      case 5: cfg.dirs = atoi(optarg); break;
+      case 6: cfg.churn = atof(optarg); break;
+      case 7: cfg.rename = atof(optarg); break;
+      case 8: cfg.del = atof(optarg); break;
+      case 9: cfg.v3 = atof(optarg); break;
+      case 10: cfg.rate = atoi(optarg); break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || cfg.sparse < 0 || cfg.sparse >= 1 || cfg.garbage < 0 || cfg.garbage >= 1
+    || cfg.rename + cfg.del > 0.9 || cfg.dirs < 4 || cfg.rate == 0 || cfg.rate > 10000000) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *fp;
+  if ((fp = fopen(argv[optind], "wb")) == NULL) {
+    perror("Output File Error");
+    exit(EXIT_FAILURE);
+  }
+  Generator gen(cfg, fp);
+  gen.Run();
+  fclose(fp);
+  printf("%llu bytes, %llu records (%llu V3), %llu garbage bytes (%s)\n", cfg.size,
+    gen.records, gen.v3_records, gen.garbage_bytes, argv[optind]);
+  return 0;
+}
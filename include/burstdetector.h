@@ -0,0 +1,78 @@
+#ifndef _INCLUDE_BURSTDETECTOR_H
+#define _INCLUDE_BURSTDETECTOR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+using namespace std;
+
+#define BURST_GLOBAL 0xFFFFFFFF // pid used for volume wide counters
+
+enum BURST_KIND {
+  BURST_RENAME    = 0,
+  BURST_EXTCHANGE = 1, // rename which changes file extension
+  BURST_OVERWRITE = 2,
+  BURST_DELETE    = 3,
+  BURST_KINDS     = 4
+};
+
+struct burst_event {
+  uint64_t usn;
+  uint64_t ts;
+};
+
+// Sliding window for one (directory, kind)
+struct burst_window {
+  deque<burst_event> events;
+  bool active;
+  burst_event start;
+  burst_event last;
+  uint64_t count;  // events while active
+  uint64_t peak;   // max events in a window while active
+};
+
+// Detected burst
+struct burst_info {
+  uint32_t pid; // BURST_GLOBAL for volume wide
+  uint8_t kind;
+  uint64_t start_usn;
+  uint64_t end_usn;
+  uint64_t start_ts;
+  uint64_t end_ts;
+  uint64_t count;
+  uint64_t peak;
+};
+
+// Streaming mass-modification detector over packed records
+// Every event is pushed once and expired once, so work per record is O(1) amortized
+// and memory is proportional to the events inside the current window.
+class BurstDetector {
+private:
+  unordered_map<uint64_t, burst_window> windows; // key: pid << 8 | kind
+  deque<uint64_t> expiry;                        // keys in arrival order
+  deque<uint64_t> expiry_ts;
+
+private:
+  void Push(uint32_t, uint8_t, uint64_t, uint64_t);
+  void Expire(uint64_t);
+  void Close(uint64_t, burst_window*);
+
+public:
+  uint64_t window_ts;        // window length in FILETIME unit (100ns)
+  uint32_t dir_threshold;    // events in window to flag a directory
+  uint32_t global_threshold; // events in window to flag the volume
+  vector<burst_info> bursts;
+
+public:
+  BurstDetector();
+  void Feed(uint64_t, uint64_t, uint32_t, uint32_t, const string&);
+  void Finish();
+  void Save(FILE*);
+  void Load(FILE*);
+};
+
+#endif // _INCLUDE_BURSTDETECTOR_H
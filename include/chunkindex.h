@@ -0,0 +1,37 @@
+#ifndef _INCLUDE_CHUNKINDEX_H
+#define _INCLUDE_CHUNKINDEX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+#define CDC_MIN_SIZE (16*1024)
+#define CDC_MAX_SIZE (256*1024)
+#define CDC_MASK (0x1FFFULL << 51) // cut checked every 8 bytes, 64KB chunk on average
+#define CDC_READ_SIZE (4*1024*1024)
+
+// Content-defined chunk of input
+struct cdc_chunk {
+  uint64_t offset;
+  uint64_t len;
+  uint64_t hash; // content hash (including length)
+};
+
+// Content-defined chunking with a gear rolling hash
+// Boundaries depend only on preceding bytes, so an inserted or removed region
+// shifts the chunks around it without changing them. Cuts are 8-byte aligned
+// like records, so a chunk never starts in the middle of a record header
+// alignment.
+class ChunkIndex {
+private:
+  uint64_t gear[256];
+
+public:
+  ChunkIndex();
+  void Split(FILE*, uint64_t, uint64_t, vector<cdc_chunk>*);
+  static uint64_t Hash(const unsigned char*, uint64_t);
+};
+
+#endif // _INCLUDE_CHUNKINDEX_H
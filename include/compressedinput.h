@@ -0,0 +1,37 @@
+#ifndef _INCLUDE_COMPRESSEDINPUT_H
+#define _INCLUDE_COMPRESSEDINPUT_H
+
+#include <cstdint>
+#include <cstdio>
+
+using namespace std;
+
+// Input formats, found by magic bytes
+enum INPUT_FORMAT {
+  PLAIN_INPUT,
+  GZIP_INPUT,  // gzip, concatenated members allowed (HAVE_ZLIB)
+  ZSTD_INPUT   // zstd seekable format (HAVE_ZSTD)
+};
+
+#define GZIP_SPAN   (1024 * 1024)         // uncompressed bytes between gzip access points
+#define GZIP_WINDOW 32768                 // deflate window kept (compressed) per access point
+#define INPUT_CHUNK (256 * 1024)          // compressed read / decompressed block
+#define INPUT_BLOCKS 8                    // decompressed blocks cached per handle
+
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1U   // last 4 bytes of a seekable zstd file
+
+class NtfsImage;
+
+int input_format(const char*);
+NtfsImage *open_ntfs_image(const char*);
+// Open input for reading, a compressed input is decompressed on the fly
+// behind a seekable FILE, so every handle (e.g. one per scan chunk)
+// decompresses its own range and nothing is written to disk. An input
+// registered by open_ntfs_image reads as its $UsnJrnl:$J.
+FILE *open_input(const char*);
+// Uncompressed size, a gzip input is inflated to its end unless some handle
+// already did (the scan, which then needs no pass of its own for the size)
+uint64_t get_input_size(FILE*);
+bool input_size_known(const char*);
+
+#endif // _INCLUDE_COMPRESSEDINPUT_H
@@ -0,0 +1,88 @@
+#ifndef _INCLUDE_DIRTREE_H
+#define _INCLUDE_DIRTREE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+
+#define DTREE_MAGIC   "USNDTRE1"
+#define DTREE_VERSION 1
+#define DTREE_NAME    "usn_analytics.dtree"
+#define DTREE_ROOT    5 // FileID of root directory
+#define DTREE_DELETED 1 // dtree_node.flags
+
+// On-disk layout: header, nodes, versions, strings
+struct dtree_header {
+  char magic[8];
+  uint64_t version;
+  uint64_t nodes;
+  uint64_t versions;
+  uint64_t strings; // bytes
+};
+
+// Directory state, node of a treap keyed by id (node 0 is nil)
+// Nodes are never changed once a version refers to them, a change copies the
+// path from the root, so every version is a complete tree.
+struct dtree_node {
+  uint64_t usn;   // record which set this state
+  uint32_t id;
+  uint32_t pid;
+  uint32_t left;
+  uint32_t right;
+  uint32_t str;   // name in strings, ends with '\'
+  uint16_t len;
+  uint16_t flags;
+};
+
+// Tree after the last record of usn
+struct dtree_version {
+  uint64_t usn;
+  uint64_t ts;    // latest timestamp up to this record (timestamps are not strictly in usn order)
+  uint32_t root;
+  uint32_t pad;
+};
+
+// Persistent directory tree, one version per directory change in usn order
+// Built by GetAllDirName with --dir-tree and memory-mapped by the query
+// subcommand, which resolves paths and lists the tree at any usn or time.
+class DirTree {
+private:
+  // building
+  vector<dtree_node> node_set;
+  vector<dtree_version> version_set;
+  string string_set;
+  unordered_map<string, uint32_t> string_table; // name, offset in string_set
+  // reading
+  void *map;
+  uint64_t map_size;
+  vector<unsigned char> body; // whole file where mmap is not available
+  const dtree_header *header;
+  const dtree_node *nodes;
+  const dtree_version *versions;
+  const char *strings;
+
+private:
+  uint32_t NewNode(const dtree_node&);
+  uint32_t Insert(uint32_t, const dtree_node&);
+
+public:
+  DirTree();
+  ~DirTree();
+  void Set(uint64_t, uint64_t, uint32_t, const string&, uint32_t, bool);
+  int Write(const char*);
+  int Open(const char*);
+  uint64_t Versions();
+  const dtree_version &Version(uint64_t);
+  int64_t FindUsn(uint64_t);
+  int64_t FindTime(uint64_t);
+  const dtree_node *Get(uint64_t, uint32_t);
+  string Path(uint64_t, uint32_t);
+  void Walk(uint64_t, const function<void(const dtree_node&)>&);
+};
+
+#endif // _INCLUDE_DIRTREE_H
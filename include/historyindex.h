@@ -0,0 +1,106 @@
+#ifndef _INCLUDE_HISTORYINDEX_H
+#define _INCLUDE_HISTORYINDEX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+#define HIDX_MAGIC   "USNHIDX1"
+#define HIDX_VERSION 3 // 2: rows keyed by file reference, 3: ids ordered by FileID then sequence
+#define HIDX_NAME    "usn_analytics.hidx"
+
+// On-disk layout, every section is an array of these in file order:
+// header, files, rows, ids, names, postings (uint32_t row index), strings
+struct hidx_header {
+  char magic[8];
+  uint64_t version;
+  uint64_t files;
+  uint64_t rows;
+  uint64_t ids;
+  uint64_t names;
+  uint64_t postings;
+  uint64_t strings; // bytes
+};
+
+// Records csv, name in strings (relative to output directory)
+struct hidx_file {
+  uint64_t str;
+  uint64_t len;
+};
+
+// Bundled record row, in usn order
+struct hidx_row {
+  uint64_t offset; // in its csv
+  uint32_t len;    // including newline
+  uint32_t file;
+  uint64_t id;     // file reference, FileID | sequence << 48
+};
+
+// Rows of a file reference, sorted by FileID then sequence (hidx_id_order)
+struct hidx_id {
+  uint64_t id;
+  uint64_t begin; // in postings
+  uint64_t count;
+};
+
+// Sort key of a file reference: every sequence of a FileID is adjacent
+inline uint64_t hidx_id_order(uint64_t id) {
+  return (id << 16) | (id >> 48);
+}
+
+// Rows of a lower case file name (both names of a rename), sorted by name
+struct hidx_name {
+  uint64_t str;
+  uint64_t len;
+  uint64_t begin;
+  uint64_t count;
+};
+
+// Inverted index from file reference and interned file name to bundled record rows
+// Written next to the records csv files by --history-index and memory-mapped
+// by the query subcommand, which reads matching rows from the csv files.
+class HistoryIndex {
+private:
+  // building
+  vector<string> file_names;
+  vector<hidx_row> row_set;
+  vector<pair<uint64_t, uint32_t> > id_rows;   // id, row
+  vector<pair<uint32_t, uint32_t> > name_rows; // name, row
+  unordered_map<string, uint32_t> name_table;  // name, index in name_list
+  vector<string> name_list;
+  // reading
+  void *map;
+  uint64_t map_size;
+  vector<unsigned char> body; // whole file where mmap is not available
+  const hidx_header *header;
+  const hidx_file *files;
+  const hidx_row *rows;
+  const hidx_id *ids;
+  const hidx_name *names;
+  const uint32_t *postings;
+  const char *strings;
+
+private:
+  void AddName(const string&, uint32_t);
+  bool Valid();
+
+public:
+  HistoryIndex();
+  ~HistoryIndex();
+  uint32_t AddFile(const string&);
+  void AddRow(uint32_t, uint64_t, uint32_t, uint64_t, const string&);
+  int Write(const char*);
+  int Open(const char*);
+  uint64_t Rows();
+  const hidx_row &Row(uint64_t);
+  string FileName(uint32_t);
+  uint64_t FindId(uint64_t, vector<uint32_t>*);
+  uint64_t FindFileId(uint64_t, vector<uint32_t>*);
+  uint64_t FindName(const string&, vector<uint32_t>*);
+};
+
+#endif // _INCLUDE_HISTORYINDEX_H
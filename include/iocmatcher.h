@@ -0,0 +1,61 @@
+#ifndef _INCLUDE_IOCMATCHER_H
+#define _INCLUDE_IOCMATCHER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// Where a rule pattern is searched
+enum IOC_KIND {
+  IOC_NAME   = 0, // whole file name
+  IOC_EXT    = 1, // end of file name
+  IOC_SUBSTR = 2, // anywhere in file name
+  IOC_PATH   = 3  // anywhere in file path
+};
+
+struct ioc_rule {
+  uint8_t kind;
+  string pattern; // lower case
+  string group;   // report section
+};
+
+// Case-insensitive multi-pattern matcher (Aho-Corasick)
+// All rules are compiled into one automaton so each field is scanned once
+// regardless of the number of rules.
+class IocMatcher {
+private:
+  vector<uint32_t> edge_begin;   // per node, index into edge_char/edge_next
+  vector<uint32_t> edge_end;
+  vector<uint8_t> edge_char;
+  vector<uint32_t> edge_next;
+  vector<uint32_t> fail;         // failure link
+  vector<int32_t> dict;          // next node on failure chain with output, -1 if none
+  vector<uint32_t> out_begin;    // per node, index into out_rule
+  vector<uint32_t> out_end;
+  vector<uint32_t> out_rule;
+  vector<map<uint8_t, uint32_t> > trie;   // used while loading rules
+  vector<vector<uint32_t> > trie_rules;
+  map<string, uint32_t> group_index;
+
+private:
+  uint32_t Next(uint32_t, uint8_t);
+  int AddRule(uint8_t, string, string);
+  void Compile();
+  void Scan(const string&, bool, vector<uint32_t>*);
+
+public:
+  vector<ioc_rule> rules;
+  vector<string> groups;          // in first appearance order
+  vector<uint32_t> rule_group;    // rule index -> groups index
+
+public:
+  IocMatcher();
+  int LoadDefaultRules();
+  int LoadRuleFile(const char*);
+  int Match(const string&, const string&, vector<uint32_t>*);
+};
+
+#endif // _INCLUDE_IOCMATCHER_H
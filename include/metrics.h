@@ -0,0 +1,56 @@
+#ifndef _INCLUDE_METRICS_H
+#define _INCLUDE_METRICS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "perfcounters.h"
+#include "progress.h"
+
+using namespace std;
+
+// Resource usage of one processing stage
+struct stage_metric {
+  string name;
+  double wall;      // seconds
+  double cpu;       // seconds, user + system of the process
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t records_in;
+  uint64_t records_out;
+  uint64_t peak_rss; // bytes, high-water mark of the process at end of stage
+  uint64_t counters[PERF_COUNTERS]; // hardware counters, if measured
+  uint64_t allocations; // heap allocations, if counted
+};
+
+// Per-stage wall/CPU time, I/O and memory, written as metrics.json
+// CPU time, I/O bytes and RSS are process wide, so stages of inputs processed
+// concurrently in batch mode include each other's work.
+class Metrics {
+private:
+  stage_metric current;
+  double wall_begin;
+  double cpu_begin;
+  uint64_t read_begin;
+  uint64_t written_begin;
+  double wall_start; // of first stage
+  uint64_t counters_begin[PERF_COUNTERS];
+  uint64_t allocations_begin;
+
+public:
+  vector<stage_metric> stages;
+  PerfCounters *perf; // NULL: no hardware counters
+  progress_task *status; // NULL: stages are not reported to progress channel
+  uint64_t (*allocations)(); // NULL: heap allocations are not counted
+
+public:
+  Metrics();
+  void Begin(const char*, uint64_t);
+  void End(uint64_t);
+  int Write(const char*, const char*, uint64_t, uint32_t);
+  void WriteReport(FILE*);
+};
+
+#endif // _INCLUDE_METRICS_H
@@ -0,0 +1,65 @@
+#ifndef _INCLUDE_MFTINDEX_H
+#define _INCLUDE_MFTINDEX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+using namespace std;
+
+#define MFT_ROOT 5 // record number of root directory
+#define MFT_READ_SIZE (4*1024*1024)
+
+enum MFT_FLAG {
+  MFT_IN_USE    = 0x01,
+  MFT_DIRECTORY = 0x02
+};
+
+// One FILE record, names are kept in a shared pool
+struct mft_entry {
+  uint32_t parent;     // actually should be uint48_t, same as UsnRecord pid
+  uint16_t parent_seq;
+  uint16_t seq;
+  uint32_t name;       // offset in name pool
+  uint16_t name_len;
+  uint8_t flags;       // MFT_FLAG
+  uint8_t name_space;  // $FILE_NAME namespace of name, 0xFF: no name
+};
+
+// Compact index of $MFT: record number -> parent, name, sequence
+// Built once, then paths of directories are resolved by direct lookups
+// and cached.
+class MftIndex {
+private:
+  vector<mft_entry> entries; // index: record number
+  string names;
+  unordered_map<uint32_t, string> path_cache;
+
+private:
+  void SetName(uint64_t, uint64_t, uint16_t, const unsigned char*, uint8_t);
+
+public:
+  uint32_t record_size;
+  uint64_t records;     // FILE records parsed
+  uint64_t directories; // directories in use
+  // called with owner (base record), base reference of the record holding the
+  // attribute (0: a base record), whether that record is in use and attribute
+  // of every non-resident $DATA
+  function<void(uint64_t, uint64_t, bool, const unsigned char*, uint32_t)> on_data;
+
+public:
+  MftIndex();
+  int Load(const char*);
+  int LoadRecords(unsigned char*, uint64_t, uint64_t);
+  int ParseRecord(unsigned char*, uint64_t);
+  bool IsDirectory(uint32_t);
+  bool InUse(uint32_t);
+  bool InUse(uint32_t, uint16_t);
+  bool GetPath(uint32_t, string*);
+  bool GetPath(uint32_t, uint16_t, string*);
+};
+
+#endif // _INCLUDE_MFTINDEX_H
@@ -0,0 +1,51 @@
+#ifndef _INCLUDE_NTFSIMAGE_H
+#define _INCLUDE_NTFSIMAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "mftindex.h"
+
+using namespace std;
+
+#define NTFS_SPARSE  UINT64_MAX // ntfs_run.lcn of a run without clusters
+#define NTFS_EXTEND  11         // record number of $Extend
+#define USNJRNL_PATH "\\$Extend\\$UsnJrnl\\"
+
+// Extent of a non-resident attribute, in clusters
+struct ntfs_run {
+  uint64_t vcn;  // first cluster in the stream
+  uint64_t lcn;  // first cluster in the volume, NTFS_SPARSE: not allocated
+  uint64_t len;
+};
+
+// $UsnJrnl:$J of a raw NTFS volume image
+// Open reads the boot sector and the whole $MFT through its data runs (the
+// MftIndex is kept to resolve paths), then finds $Extend\$UsnJrnl and
+// decodes the runs of $J from its base and extension records. ReadAt
+// reads $J offsets from the allocated extents, sparse runs are zeros.
+class NtfsImage {
+private:
+  vector<ntfs_run> mft_runs;
+  uint64_t mft_size;
+
+private:
+  int64_t ReadStream(FILE*, const vector<ntfs_run>&, uint64_t, uint64_t, char*, size_t) const;
+
+public:
+  uint32_t cluster_size;
+  MftIndex mft;
+  vector<ntfs_run> runs;  // of $J
+  uint64_t size;          // $J data size
+  uint64_t valid_size;    // $J initialized size, zeros after it
+  uint64_t data_begin;    // first allocated offset of $J, the sparse head is not scanned
+  uint64_t allocated;     // bytes in allocated runs of $J
+
+public:
+  NtfsImage();
+  int Open(const char*);
+  int64_t ReadAt(FILE*, uint64_t, char*, size_t) const;
+};
+
+#endif // _INCLUDE_NTFSIMAGE_H
@@ -0,0 +1,35 @@
+#ifndef _INCLUDE_PERFCOUNTERS_H
+#define _INCLUDE_PERFCOUNTERS_H
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+enum PERF_COUNTER {
+  PERF_CYCLES        = 0,
+  PERF_INSTRUCTIONS  = 1,
+  PERF_CACHE_MISSES  = 2,
+  PERF_BRANCH_MISSES = 3,
+  PERF_COUNTERS      = 4
+};
+
+// Hardware counters of this process (and threads created after Open) via perf_event_open
+// Counters which cannot be opened (no PMU in containers/VMs, perf_event_paranoid)
+// are left out and read as 0; Linux only.
+class PerfCounters {
+private:
+  int fd[PERF_COUNTERS];
+
+public:
+  bool available[PERF_COUNTERS];
+  string error; // why no counter could be opened
+
+public:
+  PerfCounters();
+  ~PerfCounters();
+  bool Open();
+  void Read(uint64_t*);
+};
+
+#endif // _INCLUDE_PERFCOUNTERS_H
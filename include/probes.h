@@ -0,0 +1,33 @@
+#ifndef _INCLUDE_PROBES_H
+#define _INCLUDE_PROBES_H
+
+// USDT tracepoints (provider usn_analytics) for perf/bpftrace, e.g.
+//   bpftrace -e 'usdt:./usn_analytics:usn_analytics:stage__end { @[str(arg0)] = sum(arg2); }'
+// A disabled probe is a single nop, arguments are values already in registers.
+// Built only where <sys/sdt.h> is available (systemtap-sdt-dev(el)), unless NO_SDT.
+//
+// stage__begin       (name, records_in)
+// stage__end         (name, records_out, wall_ns)
+// scan__block__begin (offset, len)
+// scan__block__end   (offset, records)
+// pack__bundle       (usn, records, file_id)
+// dir__lookup        (parent_id, usn, candidates)
+// shard__flush__begin(bytes, closed)
+// shard__flush__end  (bytes, closed)
+
+#if !defined(NO_SDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define USN_SDT 1
+#  endif
+#endif
+
+#ifdef USN_SDT
+#  define USN_PROBE2(name, a1, a2) DTRACE_PROBE2(usn_analytics, name, a1, a2)
+#  define USN_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(usn_analytics, name, a1, a2, a3)
+#else
+#  define USN_PROBE2(name, a1, a2) do {} while (0)
+#  define USN_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+#endif // _INCLUDE_PROBES_H
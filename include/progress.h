@@ -0,0 +1,63 @@
+#ifndef _INCLUDE_PROGRESS_H
+#define _INCLUDE_PROGRESS_H
+
+#include <cstdint>
+#include <string>
+#include <list>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+using namespace std;
+
+#define PROGRESS_MASK 0xFFF // loops publish their position every 4096 records
+
+class Progress;
+
+// Progress of one input, counters are published by processing loops
+struct progress_task {
+  Progress *owner;
+  string input;
+  string stage;            // guarded by owner
+  double task_begin;
+  double stage_begin;
+  atomic<uint64_t> bytes;  // scanned in this stage
+  uint64_t bytes_total;
+  atomic<uint64_t> records;
+  atomic<uint64_t> records_total;
+};
+
+// JSON lines progress channel (file descriptor or Unix domain socket)
+// A reporter thread writes one line per running input every interval with
+// stage, bytes/records done, throughput and ETA; processing threads only store
+// counters, so reporting costs nothing in per-record loops. Only the reporter
+// writes, outside the lock, so a slow reader never blocks processing threads.
+class Progress {
+private:
+  int fd;
+  bool is_socket;
+  uint32_t interval_ms;
+  list<progress_task*> tasks;
+  string finished; // lines of removed inputs, written with the next report
+  mutex m;
+  condition_variable cv;
+  bool stop;
+  thread reporter;
+
+private:
+  void Report();
+  string Format(progress_task*, double);
+  void WriteLine(const string&);
+
+public:
+  Progress();
+  ~Progress();
+  int Open(const char*, uint32_t);
+  progress_task *Add(const string&, uint64_t);
+  void Remove(progress_task*);
+  void Stage(progress_task*, const char*, uint64_t);
+  void Close();
+};
+
+#endif // _INCLUDE_PROGRESS_H
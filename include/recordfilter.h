@@ -0,0 +1,54 @@
+#ifndef _INCLUDE_RECORDFILTER_H
+#define _INCLUDE_RECORDFILTER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// With a filter, packing never merges records of different zones (aligned time and usn
+// ranges), so the scanner keeps every record of the zones a window touches
+// and rows of those zones do not depend on the window (unfiltered runs
+// pack across zones)
+#define PACK_ZONE_TS  (3600ULL * 10000000) // 1h in FILETIME unit
+#define PACK_ZONE_USN (16ULL * 1024 * 1024)
+
+inline bool same_pack_zone(uint64_t usn_a, uint64_t ts_a, uint64_t usn_b, uint64_t ts_b) {
+  return usn_a / PACK_ZONE_USN == usn_b / PACK_ZONE_USN && ts_a / PACK_ZONE_TS == ts_b / PACK_ZONE_TS;
+}
+
+// Record predicates of --from/--to/--usn-range/--reason-mask/--name
+// Header predicates (time, usn) are checked by the scanner before a name is
+// decoded; directory records always pass there because paths of matching
+// records are built from them. Every predicate is checked again exactly on
+// packed records before path resolution and output.
+class RecordFilter {
+private:
+  vector<string> names; // lower case globs, any of them
+
+private:
+  bool MatchName(const string&) const;
+
+public:
+  uint64_t ts_from;  // FILETIME, inclusive
+  uint64_t ts_to;
+  uint64_t usn_from; // inclusive
+  uint64_t usn_to;
+  uint32_t reason_mask; // any of these reasons, 0: every record
+  bool margin;          // true: whole pack zones pass the scanner, false: exact (raw output)
+  string description;
+
+public:
+  RecordFilter();
+  int SetFrom(const char*, bool);
+  int SetTo(const char*, bool);
+  int SetUsnRange(const char*);
+  int SetReasonMask(const char*);
+  void AddName(const char*);
+  bool Active() const;
+  bool MatchHeader(uint64_t, uint64_t, uint32_t, uint32_t) const;
+  bool Match(uint64_t, uint64_t, uint32_t, const string&) const;
+};
+
+#endif // _INCLUDE_RECORDFILTER_H
@@ -0,0 +1,109 @@
+#ifndef _INCLUDE_RINGBUFFER_H
+#define _INCLUDE_RINGBUFFER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <functional>
+
+using namespace std;
+
+// Bounded lock-free single producer / single consumer queue
+// Used to connect pipeline stages; a full queue blocks the producer so
+// memory stays bounded and the slowest stage sets the throughput.
+template <typename T>
+class SpscRing {
+private:
+  vector<T> buf;
+  size_t mask;
+  alignas(64) atomic<size_t> head; // next slot to pop, written by consumer
+  alignas(64) atomic<size_t> tail; // next slot to push, written by producer
+  alignas(64) atomic<bool> closed;
+  atomic<bool> cancelled;
+
+public:
+  // capacity is rounded up to power of 2
+  explicit SpscRing(size_t capacity) : head(0), tail(0), closed(false), cancelled(false) {
+    size_t n = 2;
+    while (n < capacity)
+      n <<= 1;
+    buf.resize(n);
+    mask = n - 1;
+  }
+
+  bool TryPush(T &v) {
+    size_t t = tail.load(memory_order_relaxed);
+    if (t - head.load(memory_order_acquire) > mask)
+      return false;
+    buf[t & mask] = std::move(v);
+    tail.store(t + 1, memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T &v) {
+    size_t h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire))
+      return false;
+    v = std::move(buf[h & mask]);
+    head.store(h + 1, memory_order_release);
+    return true;
+  }
+
+  // block while queue is full, v is dropped if queue is cancelled
+  void Push(T &v) {
+    while (!TryPush(v)) {
+      if (cancelled.load(memory_order_acquire))
+        return;
+      this_thread::yield();
+    }
+  }
+
+  // block while queue is empty
+  // return: false if queue is closed and drained, or cancelled
+  bool Pop(T &v) {
+    if (cancelled.load(memory_order_acquire))
+      return false;
+    while (!TryPop(v)) {
+      if (closed.load(memory_order_acquire))
+        return TryPop(v);
+      if (cancelled.load(memory_order_acquire))
+        return false;
+      this_thread::yield();
+    }
+    return true;
+  }
+
+  // producer has finished
+  void Close() {
+    closed.store(true, memory_order_release);
+  }
+
+  // other side has failed, release a stage blocked in Push or Pop
+  void Cancel() {
+    cancelled.store(true, memory_order_release);
+    closed.store(true, memory_order_release);
+  }
+};
+
+// Joins the thread of a pipeline stage when leaving scope without joining it,
+// i.e. when an error is thrown by the other stage (a joinable thread would
+// terminate the process). stop releases the thread first, e.g. cancels queues.
+class StageGuard {
+private:
+  thread &t;
+  function<void()> stop;
+
+public:
+  StageGuard(thread &_t, function<void()> _stop) : t(_t), stop(_stop) {}
+  ~StageGuard() {
+    if (t.joinable()) {
+      stop();
+      t.join();
+    }
+  }
+};
+
+#endif // _INCLUDE_RINGBUFFER_H
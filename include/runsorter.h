@@ -0,0 +1,54 @@
+#ifndef _INCLUDE_RUNSORTER_H
+#define _INCLUDE_RUNSORTER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define RUN_PAIR_SIZE 16        // usn, offset
+#define RUN_READ_PAIRS 65536    // read buffer of a run while merging
+
+struct usn_pair {
+  uint64_t usn;
+  uint64_t offset;
+};
+
+// External sort of usn/offset pairs for memory budget mode
+// Pairs are collected up to the budget, sorted and written as runs, then a k-way
+// merge writes one sorted file of unique usns which is memory-mapped, so its pages
+// are file backed and dropped by the kernel under memory pressure.
+// As with usn_table, the last added offset of a usn wins.
+class RunSorter {
+private:
+  string prefix;
+  uint64_t run_limit; // pairs in memory before spilling
+  vector<usn_pair> buf;
+  vector<string> runs;
+  string merged_fname;
+  const uint64_t *pairs; // merged usn/offset pairs
+  uint64_t num;
+  void *map;
+  uint64_t map_size;
+  vector<uint64_t> body; // merged pairs without mmap
+
+private:
+  void Spill();
+
+public:
+  uint64_t hits; // pairs added, duplicates included
+
+public:
+  RunSorter(const string&, uint64_t);
+  ~RunSorter();
+  void Add(uint64_t, uint64_t);
+  int Merge();
+  uint64_t Runs() { return runs.size(); }
+  uint64_t Size() { return num; }
+  uint64_t Usn(uint64_t i) { return pairs[i*2]; }
+  uint64_t Offset(uint64_t i) { return pairs[i*2+1]; }
+};
+
+#endif // _INCLUDE_RUNSORTER_H
@@ -0,0 +1,85 @@
+#ifndef _INCLUDE_SLOTSKETCH_H
+#define _INCLUDE_SLOTSKETCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define CMS_DEPTH 4
+#define CMS_WIDTH 2048
+#define HLL_BITS 12
+#define TOPK_SIZE 10
+#define SLOT_USN_GAP 1048576 // same as USN range breakdown in PostProcess
+
+struct topk_entry {
+  uint64_t key;
+  uint64_t count;
+  uint64_t usn;  // last usn seen, used for path lookup
+  string name;
+};
+
+// Count-min sketch with top-K min-heap of heavy hitters
+class CountMinTopK {
+private:
+  uint32_t table[CMS_DEPTH][CMS_WIDTH];
+  vector<topk_entry> heap; // min-heap on count
+
+public:
+  CountMinTopK();
+  void Clear();
+  void Add(uint64_t, uint32_t, uint64_t, const string&);
+  vector<topk_entry> Top();
+};
+
+// HyperLogLog distinct counter
+class HyperLogLog {
+private:
+  uint8_t reg[1 << HLL_BITS];
+
+public:
+  HyperLogLog();
+  void Clear();
+  void Add(uint64_t);
+  uint64_t Estimate();
+};
+
+struct slot_summary {
+  uint64_t usn_begin;
+  uint64_t usn_end;
+  uint64_t ts_begin;
+  uint64_t ts_end;
+  uint64_t records;        // raw records in slot
+  uint64_t distinct_files; // approximate
+  vector<topk_entry> top_files;
+  vector<topk_entry> top_dirs;
+};
+
+// Per USN range / time slot summaries computed in bounded memory
+// Only the current slot keeps sketches, closed slots keep their summary.
+class SlotSketch {
+private:
+  CountMinTopK files;
+  CountMinTopK dirs;
+  HyperLogLog file_ids;
+  slot_summary cur;
+  uint64_t last_usn;
+  bool open;
+
+private:
+  void Close();
+
+public:
+  vector<slot_summary> slots;
+
+public:
+  SlotSketch();
+  void Feed(uint64_t, uint64_t, uint32_t, uint32_t, uint16_t, const string&);
+  void Count(uint64_t, uint32_t, uint32_t, uint16_t, const string&);
+  void Finish();
+};
+
+uint64_t hash64(uint64_t);
+
+#endif // _INCLUDE_SLOTSKETCH_H
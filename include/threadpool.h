@@ -0,0 +1,53 @@
+#ifndef _INCLUDE_THREADPOOL_H
+#define _INCLUDE_THREADPOOL_H
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// Tasks submitted together, waited together
+class TaskGroup {
+public:
+  atomic<uint64_t> pending;
+  TaskGroup() : pending(0) {}
+};
+
+// Work-stealing thread pool
+// Each worker pushes/pops its own deque at the back (newest first) and steals
+// from the front of other deques (oldest first) when idle. A thread waiting on
+// a TaskGroup runs queued tasks meanwhile, so tasks may submit and wait on
+// subtasks without blocking workers.
+class WorkStealingPool {
+private:
+  struct worker_queue {
+    mutex m;
+    deque<pair<TaskGroup*, function<void()> > > tasks;
+  };
+  vector<worker_queue*> queues;
+  vector<thread> workers;
+  atomic<bool> stop;
+  atomic<uint64_t> queued;
+  atomic<uint64_t> next_queue;
+  mutex sleep_m;
+  condition_variable sleep_cv;
+
+private:
+  void WorkerLoop(uint32_t);
+  bool RunOne(int32_t);
+
+public:
+  WorkStealingPool(uint32_t);
+  ~WorkStealingPool();
+  uint32_t Size();
+  void Submit(TaskGroup*, function<void()>);
+  void Wait(TaskGroup*);
+};
+
+#endif // _INCLUDE_THREADPOOL_H
@@ -0,0 +1,47 @@
+#ifndef _INCLUDE_TIMELINEMERGE_H
+#define _INCLUDE_TIMELINEMERGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define RECORDS_CSV_PREFIX "usn_analytics_records-"
+
+// Records csv files of one output directory, read one row at a time
+struct merge_source {
+  string name;            // Source column
+  vector<string> files;   // in name (usn) order
+  size_t file;            // open one
+  FILE *fp;
+  string header;
+  string row;             // current row, without newline
+  size_t ts_begin;        // TimeStamp field in row
+  size_t ts_end;
+  uint64_t ts;            // FILETIME (UTC) of row
+  bool parsed;            // TimeStamp of row was parsed, else ts is of the previous row
+  int64_t tz_offset;      // of TimeStamp column, FILETIME ticks
+  uint64_t rows;
+};
+
+// Streaming k-way merge of records csv files of several output directories
+// into one timeline ordered by TimeStamp, with a Source column. A source
+// keeps its usn order, a min-heap of one row per source picks the next
+// one, so memory depends on the number of sources only.
+class TimelineMerge {
+private:
+  vector<merge_source> sources;
+
+private:
+  bool NextRow(merge_source&);
+
+public:
+  ~TimelineMerge();
+  int AddSource(const string&, const string&);
+  uint64_t Write(FILE*, bool);
+  size_t Sources();
+};
+
+#endif // _INCLUDE_TIMELINEMERGE_H
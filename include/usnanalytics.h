@@ -0,0 +1,79 @@
+#ifndef _INCLUDE_USNANALYTICS_H
+#define _INCLUDE_USNANALYTICS_H
+
+// libusnanalytics: scan/decode/pack/resolve pipeline of usn_analytics as a
+// library (make lib). Records are pushed to callbacks or read by index as
+// views into the pipeline's own buffers, nothing is written to csv files.
+// Functions return USN_ANALYTICS_OK or a negative error code, they never exit.
+// A handle must not be used by two threads at once.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USN_ANALYTICS_OK        0
+#define USN_ANALYTICS_STOPPED   1  // a callback returned nonzero
+#define USN_ANALYTICS_E_ARG    -1  // invalid argument or option
+#define USN_ANALYTICS_E_INPUT  -2  // input or $MFT can not be opened/read
+#define USN_ANALYTICS_E_OUTPUT -3  // work directory (report, spill files) can not be written
+#define USN_ANALYTICS_E_MEMORY -4  // out of memory
+
+typedef struct usn_analytics usn_analytics;
+
+typedef struct usn_analytics_options {
+  const char *work_dir;   // report and spill files, NULL: no report (memory_budget must be 0)
+  const char *mft;        // $MFT of the volume to resolve paths, NULL: journal only
+  uint32_t threads;       // scanner threads, 0: number of cores
+  uint64_t memory_budget; // bytes of scanned and packed records and directories kept in memory, 0: no limit
+  int utc;                // nonzero: format times in UTC (process-wide)
+  // record filters as the command line options, NULL: not used
+  const char *from;
+  const char *to;
+  const char *usn_range;
+  const char *reason_mask;
+  const char *name;
+  int ntfs_image;         // nonzero: input is an NTFS volume image, $J and $MFT are read from it
+} usn_analytics_options;
+
+// A decoded or bundled record, valid until the callback returns (decoded)
+// or until usn_analytics_close (bundled). With memory_budget a bundled record
+// read back from a spill file is valid until the callback returns or the next
+// usn_analytics_bundled_get. Strings are UTF-8 and NUL terminated.
+typedef struct usn_analytics_record {
+  uint64_t usn;
+  uint64_t timestamp;  // FILETIME
+  uint32_t reasons;    // USN_REASON_* (bundled: or-ed, plus RENAME/MOVE of usnrecord.h)
+  uint32_t attributes;
+  uint32_t file_id;    // FileReferenceNumber without sequence
+  uint32_t parent_id;
+  uint32_t records;    // raw records packed into this one (decoded: 1)
+  double time_taken;   // seconds from first to last packed record
+  const char *file_name;
+  uint32_t file_name_len;
+  const char *path;    // parent directory (decoded: "")
+  uint32_t path_len;
+} usn_analytics_record;
+
+typedef int (*usn_analytics_callback)(const usn_analytics_record *record, void *ctx);
+
+void usn_analytics_options_init(usn_analytics_options *options);
+int usn_analytics_open(const char *input, const usn_analytics_options *options, usn_analytics **handle);
+void usn_analytics_close(usn_analytics *handle);
+
+// Records in usn order, each unique record once
+int usn_analytics_each_decoded(usn_analytics *handle, usn_analytics_callback callback, void *ctx);
+// Packed records with resolved paths, pipeline runs on first call
+int usn_analytics_each_bundled(usn_analytics *handle, usn_analytics_callback callback, void *ctx);
+int usn_analytics_bundled_count(usn_analytics *handle, uint64_t *count);
+int usn_analytics_bundled_get(usn_analytics *handle, uint64_t index, usn_analytics_record *record);
+
+// Message of the last error of handle (or of usn_analytics_open with NULL)
+const char *usn_analytics_error(const usn_analytics *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INCLUDE_USNANALYTICS_H
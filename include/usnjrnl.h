@@ -5,16 +5,43 @@
 #include <cstdio>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <functional>
 
+#include "iocmatcher.h"
+#include "burstdetector.h"
+#include "slotsketch.h"
+#include "ringbuffer.h"
+#include "threadpool.h"
+#include "chunkindex.h"
+#include "mftindex.h"
+#include "metrics.h"
+#include "progress.h"
+#include "runsorter.h"
+#include "recordfilter.h"
+#include "historyindex.h"
+#include "dirtree.h"
+#include "utils.h" // before pack(1) of usnrecord.h, fatal_error is thrown across files
 #include "usnrecord.h"
 
 #pragma pack(1)
 
 extern bool raw; // true: output all of raw records, false: no output
+extern bool resume; // true: continue from checkpoint in output directory
 extern char SEP;
 
 using namespace std;
 
+#define SCAN_BLOCK_SIZE (4*1024*1024)
+#define SCAN_OVERLAP 64 // >= sizeof(USN_RECORD_V2)
+#define SCAN_BLOCKS 4
+#define SCAN_CHUNK_SIZE (64ULL*1024*1024) // unit of parallel scan
+#define WRITE_CHUNK_SIZE (1024*1024)
+#define WRITE_QUEUE 8
+#define SCAN_HIT_MEMORY 72 // bytes of a record in usn_set and usn_table
+#define DIR_ENTRY_MEMORY 96 // bytes of an entry in dir_table or path_table besides its name
+#define MAIN_SPILL_STEP 1024 // spilled packed records per main_spill_index entry
+
 class UsnRecord;
 class UsnMain;
 class UsnExecuted;
@@ -24,7 +51,47 @@ class UsnOpened;
 struct historical_dir {
   string name;
   uint32_t pid; // actually should be uint48_t
+  uint16_t pid_seq;
+  uint64_t usn;
+};
+
+// Input block passed from reader to scanner
+struct scan_block {
+  uint64_t base; // offset in input
+  uint64_t len;
+  vector<unsigned char> data;
+};
+
+// Record found by scanner
+struct scan_hit {
+  uint64_t offset;
   uint64_t usn;
+  uint32_t len;
+  int8_t type; // USN_RECORD_TYPE
+  uint64_t key; // file reference/timestamp/reason hash, tells apart records of same usn
+};
+
+// Per input counts in multi-source mode
+struct source_stat {
+  uint64_t size;
+  uint64_t found;    // V2 records
+  uint64_t unique;   // usn not seen in earlier inputs
+  uint64_t overlap;  // same record seen in earlier input
+  uint64_t conflict; // same usn but different record in earlier input, both are kept
+};
+
+// Scan result of a content-defined chunk, offsets relative to chunk
+struct cdc_entry {
+  uint64_t len;
+  uint64_t stop; // where scanning stopped (> len if last record runs over)
+  vector<scan_hit> hits;
+};
+
+// Formatted output passed from formatter to writer
+struct write_chunk {
+  FILE *fp;
+  string data;
+  bool last; // close fp after write
 };
 
 class UsnJrnl {
@@ -33,11 +100,80 @@ private:
   int WriteExecutedHeader(FILE*, bool);
   int WriteOpenedHeader(FILE*, bool);
   int WriteAllHeader(FILE*, bool);
+  int WriteSuspiciousHeader(FILE*, bool);
   int GetAllDirName();
+  void FilterMain();
+  void UpdateDirTree(const UsnMain&);
   historical_dir GetHistoricalFileName(historical_dir, uint8_t);
+  void AddDirRow(const UsnMain&);
+  void PushMain(UsnRecord*, uint16_t, double);
+  int GetAllUsnOffsetParallel();
+  int GetAllUsnOffsetCached();
+  void MergeScanChunks(vector<uint64_t>&, vector<vector<scan_hit> >&, vector<uint64_t>&);
+  int FilterHeader(const USN_RECORD_V2&, int);
+  void ScanBlock(scan_block*, uint64_t, uint64_t*, UsnRecord*, vector<scan_hit>*);
+  uint64_t ScanRange(FILE*, uint64_t, uint64_t, vector<scan_hit>*, vector<uint64_t>*);
+  void StoreScanHit(const scan_hit&);
+  FILE *OpenCsv(string, int (UsnJrnl::*)(FILE*, bool), bool);
+  string GetPathName(uint32_t, int32_t, uint64_t);
+  void WriteSlotSummary();
+  UsnRecord *NewRecord();
+  void SpillScan();
+  void MergeRuns();
+  void SpillMain();
+  void ResolveSize();
+  void CloseScanIndex();
 
 public:
   uint64_t file_size;
+  bool size_known;        // false: gzip input, file_size is found when the scan reaches its end
+  string in_fname;
+  WorkStealingPool *pool; // NULL: no parallel scan
+  MftIndex *mft;          // NULL: directories are learned from journal only
+  uint64_t mft_usn;       // usn the state of mft stands for (after the last record)
+  Metrics *metrics;       // NULL: stages inside PostProcess are not measured
+  progress_task *status;  // NULL: no progress channel
+  uint64_t memory_budget; // bytes, 0: no limit
+  RunSorter *runs;        // scan hits spilled to disk, NULL: usn_set/usn_table in memory
+  string spill_prefix;    // temporary files of runs
+  FILE *main_spill;       // packed records moved out of usnmain_set (memory budget), NULL: none
+  uint64_t main_spilled;  // records in main_spill, they come before usnmain_set[main_begin]
+  vector<uint64_t> main_spill_index; // offset of every MAIN_SPILL_STEP-th record in main_spill
+  bool main_paths;        // path_table is built, spilled records get file_path when read
+  uint64_t main_memory;   // estimated bytes of packed records in usnmain_set
+  uint64_t dir_memory;    // estimated bytes of dir_table and path_table
+  const RecordFilter *filter; // NULL: every record
+  HistoryIndex *history;  // NULL: bundled rows are not indexed
+  DirTree *dir_tree;      // NULL: directory history is not kept
+  uint64_t filtered_scan; // records dropped by scanner
+  uint64_t filtered_usn;  // largest usn dropped by scanner
+  uint64_t filtered_pack; // packed (raw: decoded) records dropped before output
+  uint64_t scan_begin;    // offset where scanning starts
+  uint64_t data_begin;    // input before it has no records (sparse head of $J in an NTFS image), never read
+  uint64_t resume_usn;    // records up to this usn were processed by previous run
+  uint64_t main_begin;    // first usnmain_set record of this run (before: checkpoint tail)
+  uint64_t packed_usn;    // last usn consumed by CheckRecords
+  uint64_t packed_offset;
+  bool append;            // output files are appended (resume, follow pass)
+  bool following;         // more records will come (follow mode)
+  string bundled_fname;   // current records csv
+  uint64_t bundled_rows;  // rows in bundled_fname
+  map<string, uint16_t> prefetch_count; // prefetch file name, count
+  string chunk_cache_fname; // empty: no chunk cache sidecar
+  vector<FILE*> fp_srcs;     // multi-source inputs, empty: single input (fp_in)
+  vector<string> src_names;
+  vector<source_stat> src_stats;
+  uint32_t current_src;      // source being scanned
+  map<pair<uint64_t, uint64_t>, uint64_t> src_table; // (usn, scan_hit key), offset (multi-source scan)
+  vector<uint64_t> src_offset; // offset of i-th record of usn_set (multi-source)
+  unordered_map<uint64_t, cdc_entry> chunk_cache; // chunk hash, scan result
+  uint64_t input_hash; // 0: not computed yet (scanning from 0 computes it on the way)
+  uint64_t found_num;  // records found if not all are in usn_set (scan index, multi-source), 0: usn_set.size()
+  const uint64_t *index_pairs; // usn/offset pairs of a loaded scan index, NULL: usn_set/usn_table
+  uint64_t index_entries;
+  void *index_map;             // mapping index_pairs points into, NULL: none
+  uint64_t index_map_size;
+  vector<uint64_t> index_body; // pairs read without mapping (Windows)
   uint64_t offset;
   FILE *fp_in;
   FILE *fp_ofreport;
@@ -47,20 +183,41 @@ public:
   map<uint64_t, uint64_t> usn_table; // usn_set, offset
   multimap<uint32_t, historical_dir> dir_table; // id, name(current dir)/pid/usn
   multimap<uint32_t, historical_dir> path_table; // id, name(fullpath dir)/pid/usn
+  IocMatcher ioc_matcher;
+  BurstDetector burst_detector;
+  SlotSketch slot_sketch;
 
 public:
   UsnJrnl(char*, char*);
   ~UsnJrnl();
   int GetAllUsnOffset();
+  int AddSource(char*);
+  int GetAllUsnOffsetMulti();
   int PreProcess();
+  uint64_t UsnNum();
+  uint64_t UsnAt(uint64_t);
+  uint64_t OffsetAt(uint64_t);
   int CheckRecords();
+  uint64_t MainNum();
+  void ForEachMain(function<bool(UsnMain&, bool)>);
+  const UsnMain &MainAt(uint64_t, UsnMain*);
   int PostProcess();
-  int WriteSuspiciousInfo();
+  int LoadIocRules(char*);
+  int LoadCheckpoint(char*);
+  int SaveCheckpoint(char*);
+  int LoadChunkCache();
+  int SaveChunkCache();
+  uint64_t GetInputHash();
+  int LoadScanIndex(char*);
+  int SaveScanIndex(char*);
+  int FollowStep(char*, bool);
+  int Follow(char*, uint32_t);
+  int WriteSuspiciousInfo(char*, bool);
+  int WriteBurstInfo(bool);
   int WriteBundledRecords(char*, bool);
   int WriteExecutedRecords(char*, bool);
   int WriteOpenedRecords(char*, bool);
   int WriteAllRecords(char*, bool);
-  void FindInsertCount(string*, string, map<string, uint16_t>*);
   void WriteFileNameList(string, map<string, uint16_t>*);
 };
 
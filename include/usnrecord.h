@@ -17,6 +17,10 @@ extern bool lt; // true: localtime, false: utc
 
 using namespace std;
 
+// offset of a record in multi-source mode: source index << SOURCE_SHIFT | offset
+#define SOURCE_SHIFT 56
+#define SOURCE_OFFSET_MASK ((1ULL << SOURCE_SHIFT) - 1)
+
 struct USN_RECORD_V2 {
   uint32_t RecordLength;
   uint16_t MajorVersion;
@@ -66,7 +70,8 @@ enum USN_RECORD_TYPE {
   V3_RECORD = 3,
   V4_RECORD = 4,
   NOT_RECORD = -1,
-  CORRUPT_RECORD = -2
+  CORRUPT_RECORD = -2,
+  FILTERED_RECORD = -3 // V2 record dropped by scanner filter
 };
 
 enum FILE_ATTRIBUTE {
@@ -93,12 +98,13 @@ enum FILE_ATTRIBUTE {
 class UsnRecord {
 private:
   FILE *fp_in;
-  unsigned char *data;
+  vector<FILE*> *fp_srcs; // NULL: single input
+  vector<unsigned char> data; // file name as read, reused between records
 
 private:
   int GetFileName();
   int ParseRecord();
-  int WriteRecord(FILE*);
+  int CheckRecord();
   
 public:
   USN_RECORD_V2 usn_record;
@@ -111,9 +117,12 @@ public:
 
 public:
   UsnRecord(FILE*);
+  UsnRecord(vector<FILE*>*);
   int IsValidRecord(uint64_t);
+  int IsValidRecord(const unsigned char*, uint64_t);
   int ReadRecord(uint64_t);
   int ReadParseRecord(uint64_t);
+  int WriteRecord(FILE*);
   int ReadParseWriteRecord(FILE*, uint64_t);
 };
 
@@ -122,15 +131,14 @@ public:
   uint64_t usn;
   uint16_t rec_cnt;
   uint64_t timestamp_i;
-  string timestamp_s;
   double time_taken;
   string file_name;
   uint32_t reasons_i;
-  string reasons_s;
   uint32_t attrs_i;
-  string attrs_s;
   uint32_t cid; // actually should be uint48_t
+  uint16_t cid_seq;
   uint32_t pid; // actually should be uint48_t
+  uint16_t pid_seq;
   string file_path;
 
 public:
@@ -138,45 +146,32 @@ public:
   int StoreRecord(UsnRecord*);
   int StoreRecord(UsnRecord*, uint16_t, double);
   int WriteBundledRecord(FILE*);
+  int FormatBundledRecord(string*);
+  void Save(FILE*) const;
+  void Load(FILE*);
 };
 
+// Prefetch record, a view of a packed record in usnmain_set
 class UsnExecuted {
 public:
-  uint64_t usn;
-  string timestamp_s;
+  const UsnMain *um;
   string exe_name;
   uint16_t exe_cnt;
-  string file_name;
-  string reasons_s;
-  uint16_t rec_cnt;
-  double time_taken;
-  uint32_t cid; // actually should be uint48_t
-  uint64_t timestamp_i;
-  uint32_t reasons_i;
 
 public:
   UsnExecuted();
-  int StoreRecord(UsnMain*, uint16_t);
+  int StoreRecord(const UsnMain*, uint16_t);
   int WriteExecutedRecord(FILE*);
 };
 
+// LNK/ObjectID record, a view of a packed record in usnmain_set
 class UsnOpened {
 public:
-  uint64_t usn;
-  string timestamp_s;
-  string file_path;
-  string file_name;
-  string reasons_s;
-  uint16_t rec_cnt;
-  double time_taken;
-  uint32_t cid; // actually should be uint48_t
-  uint32_t pid; // actually should be uint48_t
-  uint64_t timestamp_i;
-  uint32_t reasons_i;
+  const UsnMain *um;
 
 public:
   UsnOpened();
-  int StoreRecord(UsnMain*);
+  int StoreRecord(const UsnMain*);
   int WriteOpenedRecord(FILE*);
 };
 
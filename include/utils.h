@@ -2,14 +2,34 @@
 #define _INCLUDE_UTILS_H
 
 #include <cstdint>
+#include <cstdio>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <ctime>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "usnanalytics.h"
+
 using namespace std;
 
+extern bool quiet; // true: no progress output
+extern char SEP;
+
+// Thrown by fatal() inside library API calls, code is USN_ANALYTICS_E_*
+struct fatal_error {
+  int code;
+  string message;
+};
+extern thread_local int fatal_throw; // library API calls on this thread
+
+#ifdef _WIN32
+#  define NULL_DEVICE "NUL"
+#else
+#  define NULL_DEVICE "/dev/null"
+#endif
+
 class timer {
   clock_t c_start;
   time_t t_start;
@@ -17,17 +37,35 @@ public:
   timer();
   ~timer();
 };
+void console(const char*, ...);
+[[noreturn]] void fatal(const char*, int);
 bool is_empty_dir(const char *);
+bool is_dir(const char *);
+vector<string> list_dir_files(const char *);
+vector<string> list_dir_subdirs(const char *);
+string get_base_name(const string&);
 uint64_t get_file_size(const char*);
 string parse_datetime(uint64_t, bool);
 string parse_datetime_iso8601(uint64_t, bool);
 string parse_datetimemicro(uint64_t, bool);
+void format_datetimemicro(uint64_t, bool, char*);
 string join(const vector<string>&, const char*);
 uint16_t parse_file_attr(uint32_t, string*);
 uint16_t parse_reason(uint32_t, string*);
+const string& reason_name(uint32_t);
+const string& file_attr_name(uint32_t);
 string UTF16toUTF8(char16_t*, int);
+int UTF16toUTF8(const char16_t*, int, string*);
 bool is_valid_ts(uint64_t);
+void write_u64(FILE*, uint64_t);
+uint64_t read_u64(FILE*);
+void write_str(FILE*, const string&);
+string read_str(FILE*);
 bool is_valid_usn(uint64_t);
 string get_timezone_str (bool);
+string json_str(const string&);
+uint64_t parse_size(const char*);
+uint64_t heap_size(const string&);
+int parse_time(const char*, bool, uint64_t*, uint64_t*);
   
 #endif // _INCLUDE_UTILS_H
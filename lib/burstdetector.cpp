@@ -0,0 +1,167 @@
+#include "burstdetector.h"
+#include "usnrecord.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <algorithm>
+
+using namespace std;
+
+BurstDetector::BurstDetector() {
+  window_ts = 60ULL * 10000000; // 60s
+  dir_threshold = 100;
+  global_threshold = 100;
+}
+
+// Return lower case extension (including '.') of file name, "" if none
+static string get_ext(const string &name) {
+  size_t pos = name.rfind('.');
+  string ext;
+  if (pos == string::npos)
+    return ext;
+  ext = name.substr(pos);
+  transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+// Classify a packed record and count it in its directory and volume wide windows
+void BurstDetector::Feed(uint64_t usn, uint64_t ts, uint32_t pid, uint32_t reasons, const string &file_name) {
+  Expire(ts);
+
+  if (reasons == RENAME) {
+    Push(pid, BURST_RENAME, usn, ts);
+    size_t pos = file_name.find(" -> ");
+    if (pos != string::npos && get_ext(file_name.substr(0, pos)) != get_ext(file_name.substr(pos+4)))
+      Push(pid, BURST_EXTCHANGE, usn, ts);
+  }
+  if (reasons & OVERWRITE)
+    Push(pid, BURST_OVERWRITE, usn, ts);
+  if (reasons & DELETE)
+    Push(pid, BURST_DELETE, usn, ts);
+}
+
+void BurstDetector::Push(uint32_t pid, uint8_t kind, uint64_t usn, uint64_t ts) {
+  burst_event e;
+  e.usn = usn;
+  e.ts = ts;
+
+  for (int scope=0; scope < 2; scope++) {
+    uint64_t key = (uint64_t(scope == 0 ? pid : BURST_GLOBAL) << 8) | kind;
+    uint32_t threshold = scope == 0 ? dir_threshold : global_threshold;
+    burst_window &w = windows[key];
+
+    w.events.push_back(e);
+    expiry.push_back(key);
+    expiry_ts.push_back(ts);
+
+    if (w.active) {
+      w.count++;
+      w.last = e;
+      if (w.events.size() > w.peak)
+        w.peak = w.events.size();
+    } else if (w.events.size() >= threshold) {
+      w.active = true;
+      w.start = w.events.front();
+      w.last = e;
+      w.count = w.events.size();
+      w.peak = w.events.size();
+    }
+  }
+}
+
+// Drop events older than window and close bursts falling below threshold
+void BurstDetector::Expire(uint64_t ts) {
+  while (!expiry.empty() && expiry_ts.front() + window_ts <= ts) {
+    uint64_t key = expiry.front();
+    expiry.pop_front();
+    expiry_ts.pop_front();
+
+    auto itr = windows.find(key);
+    burst_window &w = itr->second;
+    uint32_t threshold = (key >> 8) == BURST_GLOBAL ? global_threshold : dir_threshold;
+    w.events.pop_front();
+    if (w.active && w.events.size() < threshold)
+      Close(key, &w);
+    if (!w.active && w.events.empty())
+      windows.erase(itr);
+  }
+}
+
+void BurstDetector::Close(uint64_t key, burst_window *w) {
+  burst_info b;
+  b.pid = uint32_t(key >> 8);
+  b.kind = uint8_t(key & 0xFF);
+  b.start_usn = w->start.usn;
+  b.end_usn = w->last.usn;
+  b.start_ts = w->start.ts;
+  b.end_ts = w->last.ts;
+  b.count = w->count;
+  b.peak = w->peak;
+  bursts.push_back(b);
+  w->active = false;
+}
+
+// Report bursts still open at the end of stream
+// Windows are kept so that a checkpoint can continue them in the next run.
+void BurstDetector::Finish() {
+  for (auto &x: windows) {
+    if (x.second.active) {
+      Close(x.first, &x.second);
+      x.second.active = true;
+    }
+  }
+  sort(bursts.begin(), bursts.end(), [](const burst_info &a, const burst_info &b) {
+    return a.start_usn < b.start_usn;
+  });
+}
+
+// Write windows and expiry order
+void BurstDetector::Save(FILE *fp) {
+  write_u64(fp, windows.size());
+  for (auto &x: windows) {
+    write_u64(fp, x.first);
+    write_u64(fp, x.second.active);
+    write_u64(fp, x.second.start.usn);
+    write_u64(fp, x.second.start.ts);
+    write_u64(fp, x.second.last.usn);
+    write_u64(fp, x.second.last.ts);
+    write_u64(fp, x.second.count);
+    write_u64(fp, x.second.peak);
+    write_u64(fp, x.second.events.size());
+    for (auto &e: x.second.events) {
+      write_u64(fp, e.usn);
+      write_u64(fp, e.ts);
+    }
+  }
+  write_u64(fp, expiry.size());
+  for (size_t i=0; i < expiry.size(); i++) {
+    write_u64(fp, expiry[i]);
+    write_u64(fp, expiry_ts[i]);
+  }
+}
+
+void BurstDetector::Load(FILE *fp) {
+  uint64_t n = read_u64(fp);
+  for (uint64_t i=0; i < n && !feof(fp); i++) {
+    burst_window &w = windows[read_u64(fp)];
+    w.active = read_u64(fp) != 0;
+    w.start.usn = read_u64(fp);
+    w.start.ts = read_u64(fp);
+    w.last.usn = read_u64(fp);
+    w.last.ts = read_u64(fp);
+    w.count = read_u64(fp);
+    w.peak = read_u64(fp);
+    uint64_t m = read_u64(fp);
+    for (uint64_t j=0; j < m && !feof(fp); j++) {
+      burst_event e;
+      e.usn = read_u64(fp);
+      e.ts = read_u64(fp);
+      w.events.push_back(e);
+    }
+  }
+  n = read_u64(fp);
+  for (uint64_t i=0; i < n && !feof(fp); i++) {
+    expiry.push_back(read_u64(fp));
+    expiry_ts.push_back(read_u64(fp));
+  }
+}
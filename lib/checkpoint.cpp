@@ -0,0 +1,146 @@
+#include "usnjrnl.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define CHECKPOINT_MAGIC   "USNCKPT"
+#define CHECKPOINT_VERSION 3 // 2: parent sequence numbers, 3: file sequence numbers
+#define CHECKPOINT_TAIL    2 // packed records kept for merge decisions of next run
+
+static string checkpoint_name(char *odname) {
+  return string(odname) + SEP + "usn_analytics.checkpoint";
+}
+
+// Save state needed to continue with a grown journal
+// (last packed usn and offset, tail of packed records, directory table,
+// prefetch run counts, open burst windows)
+int UsnJrnl::SaveCheckpoint(char *odname) {
+  FILE *fp;
+  string fname = checkpoint_name(odname);
+  string tmp = fname + ".tmp";
+
+  if((fp = fopen(tmp.c_str(), "wb")) == NULL) {
+    perror("Checkpoint File Error");
+    return -1;
+  }
+  write_str(fp, CHECKPOINT_MAGIC);
+  write_u64(fp, CHECKPOINT_VERSION);
+  write_u64(fp, packed_usn);
+  write_u64(fp, packed_offset);
+  write_u64(fp, file_size);
+
+  // packed records: previous tail, then this run's (spilled ones first)
+  uint64_t rows = main_begin + MainNum();
+  uint64_t tail = rows < CHECKPOINT_TAIL ? rows : CHECKPOINT_TAIL;
+  UsnMain buf;
+  write_u64(fp, tail);
+  for(uint64_t i=rows-tail; i < rows; i++)
+    (i < main_begin ? usnmain_set[i] : MainAt(i - main_begin, &buf)).Save(fp);
+
+  write_u64(fp, dir_table.size());
+  for(auto &x: dir_table) {
+    write_u64(fp, x.first);
+    write_str(fp, x.second.name);
+    write_u64(fp, x.second.pid);
+    write_u64(fp, x.second.pid_seq);
+    write_u64(fp, x.second.usn);
+  }
+
+  write_u64(fp, prefetch_count.size());
+  for(auto &x: prefetch_count) {
+    write_str(fp, x.first);
+    write_u64(fp, x.second);
+  }
+
+  burst_detector.Save(fp);
+
+  if(ferror(fp)) {
+    perror("Checkpoint File Error");
+    fclose(fp);
+    remove(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  // replace old checkpoint only when new one is complete
+  if(rename(tmp.c_str(), fname.c_str()) != 0) {
+    perror("Checkpoint File Error");
+    return -1;
+  }
+  return 0;
+}
+
+// Restore state of previous run and decide where scanning starts
+// If the record at saved offset is not the saved usn any more (journal wrapped or
+// different file), the whole file is scanned and already seen usns are skipped.
+// return: -1 if checkpoint is missing or broken
+int UsnJrnl::LoadCheckpoint(char *odname) {
+  FILE *fp;
+  string fname = checkpoint_name(odname);
+
+  if((fp = fopen(fname.c_str(), "rb")) == NULL) {
+    perror("Checkpoint File Error");
+    return -1;
+  }
+  if(read_str(fp) != CHECKPOINT_MAGIC || read_u64(fp) != CHECKPOINT_VERSION) {
+    fprintf(stderr, "Checkpoint File Error: %s is not a checkpoint\n", fname.c_str());
+    fclose(fp);
+    return -1;
+  }
+  resume_usn = read_u64(fp);
+  uint64_t saved_offset = read_u64(fp);
+  uint64_t saved_size = read_u64(fp);
+  packed_usn = resume_usn; // kept if no new record is packed
+  packed_offset = saved_offset;
+
+  // counts of a truncated file read as 0, loops also stop at its end
+  uint64_t tail = read_u64(fp);
+  for(uint64_t i=0; i < tail && !feof(fp); i++) {
+    UsnMain x;
+    x.Load(fp);
+    usnmain_set.push_back(move(x));
+  }
+  main_begin = usnmain_set.size();
+
+  uint64_t n = read_u64(fp);
+  for(uint64_t i=0; i < n && !feof(fp); i++) {
+    uint32_t id = read_u64(fp);
+    historical_dir hdir;
+    hdir.name = read_str(fp);
+    hdir.pid = read_u64(fp);
+    hdir.pid_seq = read_u64(fp);
+    hdir.usn = read_u64(fp);
+    dir_table.insert(make_pair(id, hdir));
+  }
+
+  n = read_u64(fp);
+  for(uint64_t i=0; i < n && !feof(fp); i++) {
+    string name = read_str(fp);
+    prefetch_count[name] = read_u64(fp);
+  }
+
+  burst_detector.Load(fp);
+  // a complete checkpoint ends with the last field, a short read hits its end
+  if(feof(fp) || ferror(fp)) {
+    fprintf(stderr, "Checkpoint File Error: %s is truncated or broken\n", fname.c_str());
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  // continue from saved offset if the journal only grew
+  ResolveSize();
+  UsnRecord ur(fp_in);
+  scan_begin = data_begin;
+  if(resume_usn > 0 && saved_offset < file_size && ur.IsValidRecord(saved_offset) == V2_RECORD) {
+    ur.ReadParseRecord(saved_offset);
+    if(ur.usn_record.Usn == resume_usn)
+      scan_begin = saved_offset;
+  }
+
+  console("Resume from USN %llu (offset %llu of %llu bytes, previous %llu bytes)\n", resume_usn, scan_begin, file_size, saved_size);
+  fprintf(fp_ofreport, "Resume from USN %llu, %s\n", resume_usn, scan_begin > data_begin ? "continue from last offset" : "full rescan");
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include "usnjrnl.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <string>
+
+#define CHUNK_CACHE_MAGIC   "USNCDC"
+#define CHUNK_CACHE_VERSION 1
+
+// Load chunk hashes and their scan results of a previous acquisition
+// return: -1 if there is no usable cache (every chunk is scanned)
+int UsnJrnl::LoadChunkCache() {
+  FILE *fp;
+
+  if((fp = fopen(chunk_cache_fname.c_str(), "rb")) == NULL)
+    return -1;
+  if(read_str(fp) != CHUNK_CACHE_MAGIC || read_u64(fp) != CHUNK_CACHE_VERSION) {
+    fprintf(stderr, "Chunk Cache Error: %s is not a chunk cache, ignored\n", chunk_cache_fname.c_str());
+    fclose(fp);
+    return -1;
+  }
+  uint64_t n = read_u64(fp);
+  for(uint64_t i=0; i < n && !feof(fp); i++) {
+    uint64_t hash = read_u64(fp);
+    cdc_entry &e = chunk_cache[hash];
+    e.len = read_u64(fp);
+    e.stop = read_u64(fp);
+    uint64_t m = read_u64(fp);
+    for(uint64_t j=0; j < m && !feof(fp); j++) {
+      scan_hit h;
+      uint64_t v = read_u64(fp);
+      h.offset = v >> 32;
+      h.len = (v >> 8) & 0xFFFFFF;
+      h.type = int8_t(v & 0xFF);
+      h.usn = read_u64(fp);
+      h.key = 0; // not kept, chunk cache is not used with multiple sources
+      e.hits.push_back(h);
+    }
+  }
+  if(ferror(fp) || feof(fp)) { // truncated
+    fprintf(stderr, "Chunk Cache Error: %s is broken, ignored\n", chunk_cache_fname.c_str());
+    chunk_cache.clear();
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Write chunk hashes and scan results of current input
+int UsnJrnl::SaveChunkCache() {
+  FILE *fp;
+  string tmp = chunk_cache_fname + ".tmp";
+
+  if((fp = fopen(tmp.c_str(), "wb")) == NULL) {
+    perror("Chunk Cache Error");
+    return -1;
+  }
+  write_str(fp, CHUNK_CACHE_MAGIC);
+  write_u64(fp, CHUNK_CACHE_VERSION);
+  write_u64(fp, chunk_cache.size());
+  for(auto &x: chunk_cache) {
+    write_u64(fp, x.first);
+    write_u64(fp, x.second.len);
+    write_u64(fp, x.second.stop);
+    write_u64(fp, x.second.hits.size());
+    for(auto &h: x.second.hits) {
+      // offset in chunk (< CDC_MAX_SIZE), record length and type in one word
+      write_u64(fp, (h.offset << 32) | (uint64_t(h.len) << 8) | uint8_t(h.type));
+      write_u64(fp, h.usn);
+    }
+  }
+  if(ferror(fp)) {
+    perror("Chunk Cache Error");
+    fclose(fp);
+    remove(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  if(rename(tmp.c_str(), chunk_cache_fname.c_str()) != 0) {
+    perror("Chunk Cache Error");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include "chunkindex.h"
+#include "slotsketch.h" // hash64
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#endif
+
+ChunkIndex::ChunkIndex() {
+  for (int i=0; i < 256; i++)
+    gear[i] = hash64(i);
+}
+
+// Hash of chunk content, 8 bytes at a time
+uint64_t ChunkIndex::Hash(const unsigned char *p, uint64_t len) {
+  uint64_t h = hash64(len);
+  uint64_t w;
+  uint64_t i;
+  for (i=0; i+8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ (w * 0x87C37B91114253D5ULL)) * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+  }
+  if (i < len) {
+    w = 0;
+    memcpy(&w, p + i, len - i);
+    h ^= w;
+  }
+  return hash64(h);
+}
+
+// Split [begin, end) of input into chunks
+void ChunkIndex::Split(FILE *fp, uint64_t begin, uint64_t end, vector<cdc_chunk> *chunks) {
+  vector<unsigned char> buf(CDC_READ_SIZE + CDC_MAX_SIZE);
+  uint64_t base = begin; // offset of buf[0]
+  uint64_t len = 0;      // valid bytes in buf
+  uint64_t start = 0;    // current chunk start in buf
+
+  fseeko64(fp, begin, SEEK_SET);
+  while (true) {
+    // move unfinished chunk to front and refill
+    if (start > 0) {
+      memmove(&buf[0], &buf[start], len - start);
+      base += start;
+      len -= start;
+      start = 0;
+    }
+    uint64_t want = min(uint64_t(buf.size() - len), end - base - len);
+    uint64_t n = want > 0 ? fread(&buf[len], 1, want, fp) : 0;
+    len += n;
+    bool eof = (n < want || base + len >= end);
+
+    while (start < len) {
+      uint64_t limit = min(start + CDC_MAX_SIZE, len);
+      uint64_t cut = 0;
+      uint64_t h = 0;
+      if (limit - start < CDC_MIN_SIZE) {
+        if (!eof)
+          break;
+        cut = limit;
+      } else {
+        // bytes before min size only warm up the rolling hash
+        for (uint64_t i=start + CDC_MIN_SIZE - 64; i < limit; i++) {
+          h = (h << 1) + gear[buf[i]];
+          if (((base + i + 1) & 7) == 0 && i + 1 - start >= CDC_MIN_SIZE && (h & CDC_MASK) == 0) {
+            cut = i + 1;
+            break;
+          }
+        }
+        if (cut == 0) {
+          if (limit - start < CDC_MAX_SIZE && !eof)
+            break; // need more data
+          cut = limit;
+        }
+      }
+      cdc_chunk c;
+      c.offset = base + start;
+      c.len = cut - start;
+      c.hash = Hash(&buf[start], c.len);
+      chunks->push_back(c);
+      start = cut;
+    }
+    if (eof && start >= len)
+      break;
+  }
+}
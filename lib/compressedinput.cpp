@@ -0,0 +1,646 @@
+#include "compressedinput.h"
+#include "ntfsimage.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <sys/types.h>
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#  define ftello64 ftello
+#endif
+
+// Decompressed view of an input, read at any offset
+class InputReader {
+public:
+  uint64_t pos;
+  uint64_t size;
+  InputReader() : pos(0), size(0) {}
+  virtual ~InputReader() {}
+  virtual int64_t ReadAt(uint64_t, char*, size_t) = 0;
+  virtual uint64_t Size() { return size; }
+};
+
+// Decompressed bytes [begin, begin + len) of an input
+struct input_block {
+  uint64_t begin;
+  uint64_t len;
+  uint64_t used; // last use, the least recently used block is refilled
+  vector<char> data;
+};
+
+static int input_errno(int e) {
+  errno = e;
+  return -1;
+}
+
+#ifdef HAVE_ZLIB
+// Point the inflater can restart from without the data before it
+struct gz_point {
+  uint64_t out;     // uncompressed offset
+  uint64_t in;      // compressed offset of first full byte
+  int bits;         // bits of the byte before in still to be used
+  bool header;      // start of a gzip member, no window needed
+  vector<unsigned char> window; // last GZIP_WINDOW bytes before out, deflated
+};
+
+// Access points of a gzip input, shared by every handle of it. Nothing is
+// inflated up front: a handle reading past the last point adds the points
+// it passes (zlib examples/zran.c), so the scan, which reads the input once
+// from the start, builds the whole index and later reads restart near their
+// target. A corrupt or truncated tail ends the input where the good data ends.
+struct gz_index {
+  mutex m;
+  vector<gz_point> points;
+  bool complete;    // inflated to the end, size is known
+  uint64_t size;
+};
+
+// Whether fp starts with a gzip stream, a file of the magic bytes but no
+// deflate data after them is not a gzip input
+static bool gz_check(FILE *fp) {
+  vector<unsigned char> in(INPUT_CHUNK), out(GZIP_WINDOW);
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 47) != Z_OK)
+    return false;
+  strm.avail_in = fread(&in[0], 1, in.size(), fp);
+  strm.next_in = &in[0];
+  strm.next_out = &out[0];
+  strm.avail_out = out.size();
+  int ret = inflate(&strm, Z_NO_FLUSH);
+  bool ok = ret == Z_STREAM_END || (ret == Z_OK && strm.avail_out < out.size());
+  inflateEnd(&strm);
+  return ok;
+}
+
+class GzipReader : public InputReader {
+private:
+  FILE *fp;
+  shared_ptr<gz_index> idx;
+  z_stream strm;
+  bool active;
+  uint32_t trailer; // bytes of a member trailer still to skip after a raw inflate
+  uint64_t out;     // uncompressed offset of the stream
+  uint64_t in_pos;  // compressed offset of the end of in
+  vector<unsigned char> in;
+  vector<unsigned char> window; // last GZIP_WINDOW bytes of output, circular
+  uint32_t window_pos;
+  vector<input_block> cache;
+  uint64_t tick;
+
+  // Restart the stream at point p
+  int Start(const gz_point &p) {
+    if (active)
+      inflateEnd(&strm);
+    active = false;
+    memset(&strm, 0, sizeof(strm));
+    int c = 0;
+    if (fseeko64(fp, p.in - (p.bits ? 1 : 0), SEEK_SET) != 0)
+      return -1;
+    if (p.bits && (c = getc(fp)) == EOF)
+      return input_errno(EIO);
+    if (inflateInit2(&strm, p.header ? 47 : -15) != Z_OK)
+      return input_errno(ENOMEM);
+    active = true;
+    window_pos = 0;
+    if (!p.header) {
+      uLongf len = GZIP_WINDOW;
+      if (uncompress(&window[0], &len, &p.window[0], p.window.size()) != Z_OK || len != GZIP_WINDOW)
+        return input_errno(EIO);
+      if (p.bits)
+        inflatePrime(&strm, p.bits, c >> (8 - p.bits));
+      inflateSetDictionary(&strm, &window[0], GZIP_WINDOW);
+    }
+    trailer = p.header ? 0 : 8;
+    out = p.out;
+    in_pos = p.in;
+    return 0;
+  }
+
+  int Read() {
+    strm.avail_in = fread(&in[0], 1, in.size(), fp);
+    strm.next_in = &in[0];
+    in_pos += strm.avail_in;
+    return strm.avail_in;
+  }
+
+  // Keep n bytes of output at p as the window of the next point
+  void Keep(const unsigned char *p, uint32_t n) {
+    if (n >= GZIP_WINDOW) {
+      memcpy(&window[0], p + n - GZIP_WINDOW, GZIP_WINDOW);
+      window_pos = 0;
+      return;
+    }
+    uint32_t k = min(n, uint32_t(GZIP_WINDOW - window_pos));
+    memcpy(&window[window_pos], p, k);
+    memcpy(&window[0], p + k, n - k);
+    window_pos = (window_pos + n) % GZIP_WINDOW;
+  }
+
+  // Add a point at the stream position if it is GZIP_SPAN past the last one
+  void AddPoint(bool header) {
+    lock_guard<mutex> lock(idx->m);
+    if (idx->complete || out < idx->points.back().out + (header ? 1 : GZIP_SPAN))
+      return;
+    gz_point q;
+    q.out = out;
+    q.in = in_pos - strm.avail_in;
+    q.bits = header ? 0 : strm.data_type & 7;
+    q.header = header;
+    if (!header) {
+      vector<unsigned char> w(GZIP_WINDOW);
+      memcpy(&w[0], &window[window_pos], GZIP_WINDOW - window_pos);
+      memcpy(&w[GZIP_WINDOW - window_pos], &window[0], window_pos);
+      uLongf len = compressBound(GZIP_WINDOW);
+      q.window.resize(len);
+      if (compress2(&q.window[0], &len, &w[0], GZIP_WINDOW, 1) != Z_OK)
+        return;
+      q.window.resize(len);
+      q.window.shrink_to_fit();
+    }
+    idx->points.push_back(move(q));
+  }
+
+  // The stream ended at out, points at or after it are not needed
+  void Complete() {
+    lock_guard<mutex> lock(idx->m);
+    if (idx->complete)
+      return;
+    while (idx->points.size() > 1 && idx->points.back().out >= out)
+      idx->points.pop_back();
+    idx->size = out;
+    idx->complete = true;
+  }
+
+  // Decompress the next bytes of the stream into the least recently used block
+  int Fill() {
+    input_block *b = &cache[0];
+    for (auto &x: cache)
+      if (x.used < b->used)
+        b = &x;
+    b->begin = out;
+    strm.next_out = (Bytef*)&b->data[0];
+    strm.avail_out = b->data.size();
+    bool end = false;
+    while (strm.avail_out > 0) {
+      if (strm.avail_in == 0 && Read() == 0) {
+        end = !ferror(fp);
+        break;
+      }
+      unsigned char *p = strm.next_out;
+      int ret = inflate(&strm, Z_BLOCK);
+      Keep(p, strm.next_out - p);
+      out += strm.next_out - p;
+      if (ret == Z_STREAM_END) {
+        // raw inflate leaves the trailer, gzip mode reads it itself
+        if (trailer > 0) {
+          while (trailer > 0) {
+            if (strm.avail_in == 0 && Read() == 0)
+              break;
+            uint32_t n = min(trailer, strm.avail_in);
+            strm.next_in += n;
+            strm.avail_in -= n;
+            trailer -= n;
+          }
+          inflateReset2(&strm, 47);
+        } else
+          inflateReset(&strm);
+        // another member may follow
+        AddPoint(true);
+        continue;
+      }
+      // garbage after the last member or a corrupt tail
+      if ((ret != Z_OK && ret != Z_BUF_ERROR) || (ret == Z_BUF_ERROR && strm.avail_in != 0)) {
+        end = ret != Z_MEM_ERROR;
+        break;
+      }
+      // end of a block which is not the last one
+      if ((strm.data_type & 128) && !(strm.data_type & 64))
+        AddPoint(false);
+    }
+    if (end)
+      Complete();
+    b->len = b->data.size() - strm.avail_out;
+    b->used = ++tick;
+    return b->len;
+  }
+
+public:
+  GzipReader(FILE *f, shared_ptr<gz_index> i) : fp(f), idx(i), active(false), trailer(0), out(0), in_pos(0),
+    in(INPUT_CHUNK), window(GZIP_WINDOW), window_pos(0), cache(INPUT_BLOCKS), tick(0) {
+    size = UINT64_MAX;
+    for (auto &x: cache) {
+      x.begin = x.len = x.used = 0;
+      x.data.resize(INPUT_CHUNK);
+    }
+  }
+
+  ~GzipReader() {
+    if (active)
+      inflateEnd(&strm);
+    fclose(fp);
+  }
+
+  // Uncompressed size, inflates the rest of the input once if no handle has done so
+  uint64_t Size() {
+    if (size != UINT64_MAX)
+      return size;
+    gz_point p;
+    {
+      lock_guard<mutex> lock(idx->m);
+      if (idx->complete)
+        return size = idx->size;
+      p = idx->points.back();
+    }
+    if (!active || out < p.out)
+      if (Start(p) < 0)
+        return 0;
+    while (Fill() > 0)
+      ;
+    lock_guard<mutex> lock(idx->m);
+    if (!idx->complete) // read error
+      return out;
+    return size = idx->size;
+  }
+
+  int64_t ReadAt(uint64_t p, char *buf, size_t n) {
+    if (size == UINT64_MAX) {
+      lock_guard<mutex> lock(idx->m);
+      if (idx->complete)
+        size = idx->size;
+    }
+    if (p >= size)
+      return 0;
+    n = min(uint64_t(n), size - p);
+    size_t copied = 0;
+    while (copied < n) {
+      uint64_t q = p + copied;
+      input_block *b = NULL;
+      for (auto &x: cache)
+        if (q >= x.begin && q < x.begin + x.len)
+          b = &x;
+      if (b != NULL) {
+        size_t k = min(n - copied, size_t(b->begin + b->len - q));
+        memcpy(buf + copied, &b->data[q - b->begin], k);
+        b->used = ++tick;
+        copied += k;
+        continue;
+      }
+      // restart from the nearest point unless going on is closer
+      gz_point start;
+      bool restart;
+      {
+        lock_guard<mutex> lock(idx->m);
+        auto itr = upper_bound(idx->points.begin(), idx->points.end(), q,
+          [](uint64_t a, const gz_point &b) { return a < b.out; }) - 1;
+        restart = !active || q < out || itr->out > out;
+        if (restart)
+          start = *itr;
+      }
+      if (restart && Start(start) < 0)
+        return -1;
+      if (Fill() == 0)
+        break;
+    }
+    return copied;
+  }
+};
+#endif // HAVE_ZLIB
+
+#ifdef HAVE_ZSTD
+struct zstd_frame {
+  uint64_t in;   // compressed offset
+  uint64_t out;  // uncompressed offset
+  uint32_t csize;
+  uint32_t dsize;
+};
+
+// Read the seek table at the end of a seekable zstd file
+static int zstd_seek_table(FILE *fp, vector<zstd_frame> *frames, uint64_t *size) {
+  unsigned char footer[9];
+  if (fseeko64(fp, -9, SEEK_END) != 0 || fread(footer, 1, 9, fp) != 9)
+    return input_errno(EIO);
+  uint32_t num, magic;
+  memcpy(&num, footer, 4);
+  memcpy(&magic, footer + 5, 4);
+  if (magic != ZSTD_SEEKABLE_MAGIC)
+    return input_errno(ENOTSUP);
+  uint32_t entry = (footer[4] & 0x80) ? 12 : 8;
+  vector<unsigned char> table(uint64_t(num) * entry);
+  if (fseeko64(fp, -int64_t(9 + table.size()), SEEK_END) != 0
+    || fread(table.data(), 1, table.size(), fp) != table.size())
+    return input_errno(EIO);
+  uint64_t in = 0, out = 0;
+  for (uint32_t i = 0; i < num; i++) {
+    zstd_frame f;
+    memcpy(&f.csize, &table[i * entry], 4);
+    memcpy(&f.dsize, &table[i * entry + 4], 4);
+    f.in = in;
+    f.out = out;
+    in += f.csize;
+    out += f.dsize;
+    if (f.dsize > 0)
+      frames->push_back(f);
+  }
+  *size = out;
+  return 0;
+}
+
+class ZstdReader : public InputReader {
+private:
+  FILE *fp;
+  shared_ptr<vector<zstd_frame> > frames;
+  ZSTD_DCtx *dctx;
+  vector<char> src;
+  vector<char> cache;
+  int64_t cached; // frame in cache, -1: none
+
+public:
+  ZstdReader(FILE *f, shared_ptr<vector<zstd_frame> > fr, uint64_t sz) : fp(f), frames(fr), cached(-1) {
+    size = sz;
+    dctx = ZSTD_createDCtx();
+  }
+
+  ~ZstdReader() {
+    ZSTD_freeDCtx(dctx);
+    fclose(fp);
+  }
+
+  int64_t ReadAt(uint64_t p, char *buf, size_t n) {
+    if (p >= size)
+      return 0;
+    n = min(uint64_t(n), size - p);
+    size_t copied = 0;
+    while (copied < n) {
+      uint64_t q = p + copied;
+      int64_t k = upper_bound(frames->begin(), frames->end(), q,
+        [](uint64_t a, const zstd_frame &b) { return a < b.out; }) - frames->begin() - 1;
+      const zstd_frame &f = (*frames)[k];
+      if (k != cached) {
+        src.resize(f.csize);
+        cache.resize(f.dsize);
+        cached = -1;
+        if (fseeko64(fp, f.in, SEEK_SET) != 0 || fread(src.data(), 1, f.csize, fp) != f.csize)
+          return input_errno(EIO);
+        size_t r = ZSTD_decompressDCtx(dctx, cache.data(), f.dsize, src.data(), f.csize);
+        if (ZSTD_isError(r) || r != f.dsize)
+          return input_errno(EIO);
+        cached = k;
+      }
+      size_t m = min(n - copied, size_t(f.out + f.dsize - q));
+      memcpy(buf + copied, &cache[q - f.out], m);
+      copied += m;
+    }
+    return copied;
+  }
+};
+#endif // HAVE_ZSTD
+
+// $J of a registered NTFS image
+class NtfsReader : public InputReader {
+private:
+  FILE *fp;
+  shared_ptr<NtfsImage> image;
+
+public:
+  NtfsReader(FILE *f, shared_ptr<NtfsImage> i) : fp(f), image(i) {
+    size = image->size;
+  }
+
+  ~NtfsReader() {
+    fclose(fp);
+  }
+
+  int64_t ReadAt(uint64_t p, char *buf, size_t n) {
+    return image->ReadAt(fp, p, buf, n);
+  }
+};
+
+// Indexes are built once per input and shared by every handle of it,
+// a gzip index lives while a handle of its input is open
+static mutex index_mutex;
+static map<string, shared_ptr<NtfsImage> > ntfs_images;
+#ifdef HAVE_ZLIB
+static map<string, weak_ptr<gz_index> > gz_indexes;
+
+static shared_ptr<gz_index> find_gz_index(const char *fname) {
+  auto itr = gz_indexes.find(fname);
+  return itr != gz_indexes.end() ? itr->second.lock() : NULL;
+}
+#endif
+#ifdef HAVE_ZSTD
+static map<string, pair<shared_ptr<vector<zstd_frame> >, uint64_t> > zstd_indexes;
+#endif
+
+static InputReader *open_reader(const char *fname, int format, FILE *fp) {
+  lock_guard<mutex> lock(index_mutex);
+#ifdef HAVE_ZLIB
+  if (format == GZIP_INPUT) {
+    shared_ptr<gz_index> idx = find_gz_index(fname);
+    if (idx == NULL) {
+      for (auto itr = gz_indexes.begin(); itr != gz_indexes.end(); )
+        itr = itr->second.expired() ? gz_indexes.erase(itr) : next(itr);
+      idx.reset(new gz_index());
+      gz_point p;
+      p.out = p.in = 0;
+      p.bits = 0;
+      p.header = true;
+      idx->points.push_back(p);
+      idx->complete = false;
+      idx->size = 0;
+      gz_indexes[fname] = idx;
+    }
+    return new GzipReader(fp, idx);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (format == ZSTD_INPUT) {
+    auto itr = zstd_indexes.find(fname);
+    if (itr == zstd_indexes.end()) {
+      shared_ptr<vector<zstd_frame> > frames(new vector<zstd_frame>());
+      uint64_t size;
+      if (zstd_seek_table(fp, frames.get(), &size) < 0)
+        return NULL;
+      itr = zstd_indexes.insert(make_pair(string(fname), make_pair(frames, size))).first;
+    }
+    return new ZstdReader(fp, itr->second.first, itr->second.second);
+  }
+#endif
+  (void)fname;
+  (void)fp;
+  errno = ENOTSUP; // built without support of this format
+  return NULL;
+}
+
+static ssize_t reader_read(void *cookie, char *buf, size_t n) {
+  InputReader *r = (InputReader*)cookie;
+  int64_t k = r->ReadAt(r->pos, buf, n);
+  if (k < 0)
+    return -1;
+  r->pos += k;
+  return k;
+}
+
+static int reader_seek(InputReader *r, int64_t *offset, int whence) {
+  int64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? int64_t(r->pos) : int64_t(r->Size());
+  if (base + *offset < 0)
+    return input_errno(EINVAL);
+  r->pos = base + *offset;
+  *offset = r->pos;
+  return 0;
+}
+
+static int reader_close(void *cookie) {
+  delete (InputReader*)cookie;
+  return 0;
+}
+
+// Format of fname by its magic bytes and the data after them: a raw journal
+// (e.g. carved) may start with the same bytes by chance and is read as it is
+int input_format(const char *fname) {
+  FILE *fp;
+  unsigned char magic[4];
+  if ((fp = fopen(fname, "rb")) == NULL)
+    return PLAIN_INPUT;
+  size_t n = fread(magic, 1, 4, fp);
+  int format = PLAIN_INPUT;
+  // deflate method, reserved flags clear
+  if (n == 4 && magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8 && (magic[3] & 0xE0) == 0)
+    format = GZIP_INPUT;
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    format = ZSTD_INPUT;
+#ifdef HAVE_ZLIB
+  if (format == GZIP_INPUT) {
+    shared_ptr<gz_index> idx;
+    {
+      lock_guard<mutex> lock(index_mutex);
+      idx = find_gz_index(fname);
+    }
+    if (idx == NULL && (fseeko64(fp, 0, SEEK_SET) != 0 || !gz_check(fp)))
+      format = PLAIN_INPUT;
+  }
+#endif
+  // only the seekable format is read, its footer ends the file
+  if (format == ZSTD_INPUT) {
+    unsigned char footer[4];
+    uint32_t magic_end = 0;
+    if (fseeko64(fp, -4, SEEK_END) == 0 && fread(footer, 1, 4, fp) == 4)
+      memcpy(&magic_end, footer, 4);
+    if (magic_end != ZSTD_SEEKABLE_MAGIC)
+      format = PLAIN_INPUT;
+  }
+  fclose(fp);
+  return format;
+}
+
+// Register fname as an NTFS volume image, open_input of it reads $UsnJrnl:$J
+// return: NULL if it is not an NTFS volume with a journal
+NtfsImage *open_ntfs_image(const char *fname) {
+  lock_guard<mutex> lock(index_mutex);
+  auto itr = ntfs_images.find(fname);
+  if (itr != ntfs_images.end())
+    return itr->second.get();
+  shared_ptr<NtfsImage> image(new NtfsImage());
+  if (image->Open(fname) < 0)
+    return NULL;
+  ntfs_images[fname] = image;
+  return image.get();
+}
+
+static shared_ptr<NtfsImage> find_ntfs_image(const char *fname) {
+  lock_guard<mutex> lock(index_mutex);
+  auto itr = ntfs_images.find(fname);
+  return itr != ntfs_images.end() ? itr->second : NULL;
+}
+
+FILE *open_input(const char *fname) {
+  FILE *fp;
+  if ((fp = fopen(fname, "rb")) == NULL)
+    return NULL;
+  InputReader *r;
+  shared_ptr<NtfsImage> image = find_ntfs_image(fname);
+  if (image != NULL)
+    r = new NtfsReader(fp, image);
+  else {
+    int format = input_format(fname);
+    if (format == PLAIN_INPUT)
+      return fp;
+    errno = 0;
+    r = open_reader(fname, format, fp);
+  }
+  if (r == NULL) {
+    int e = errno;
+    fclose(fp);
+    errno = e;
+    return NULL;
+  }
+#if defined(__APPLE__)
+  FILE *in = funopen(r, [](void *c, char *buf, int n) -> int { return reader_read(c, buf, n); }, NULL,
+    [](void *c, fpos_t offset, int whence) -> fpos_t {
+      int64_t o = offset;
+      return reader_seek((InputReader*)c, &o, whence) < 0 ? -1 : o;
+    }, reader_close);
+#elif defined(_WIN32)
+  FILE *in = NULL;
+  errno = ENOTSUP;
+#else
+  cookie_io_functions_t io;
+  io.read = reader_read;
+  io.write = NULL;
+  io.seek = [](void *c, off64_t *offset, int whence) -> int {
+    int64_t o = *offset;
+    int ret = reader_seek((InputReader*)c, &o, whence);
+    *offset = o;
+    return ret;
+  };
+  io.close = reader_close;
+  FILE *in = fopencookie(r, "rb", io);
+#endif
+  if (in == NULL) {
+    int e = errno;
+    delete r;
+    errno = e;
+  }
+  return in;
+}
+
+// Size of an input opened by open_input, uncompressed for compressed ones
+uint64_t get_input_size(FILE *fp) {
+  int64_t pos = ftello64(fp);
+  fseeko64(fp, 0, SEEK_END);
+  uint64_t size = ftello64(fp);
+  fseeko64(fp, pos, SEEK_SET);
+  return size;
+}
+
+// Whether get_input_size of fname is known without reading all of it,
+// false for a gzip input no handle has inflated to the end yet
+bool input_size_known(const char *fname) {
+#ifdef HAVE_ZLIB
+  shared_ptr<gz_index> idx;
+  {
+    lock_guard<mutex> lock(index_mutex);
+    idx = find_gz_index(fname);
+  }
+  if (idx != NULL) {
+    lock_guard<mutex> lock(idx->m);
+    return idx->complete;
+  }
+#endif
+  (void)fname;
+  return true;
+}
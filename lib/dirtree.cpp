@@ -0,0 +1,273 @@
+#include "dirtree.h"
+#include "utils.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
+
+DirTree::DirTree() {
+  map = NULL;
+  map_size = 0;
+  header = NULL;
+  // nil node
+  dtree_node nil;
+  memset(&nil, 0, sizeof(nil));
+  node_set.push_back(nil);
+}
+
+DirTree::~DirTree() {
+#ifndef _WIN32
+  if (map != NULL)
+    munmap(map, map_size);
+#endif
+}
+
+// Treap priority, fixed per id so the shape does not depend on insertion order
+static uint32_t priority(uint32_t id) {
+  uint32_t h = id * 0x9e3779b1U;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  return h;
+}
+
+static const dtree_node *find_node(const dtree_node *base, uint32_t root, uint32_t id) {
+  uint32_t n = root;
+  while (n != 0) {
+    if (id == base[n].id)
+      return &base[n];
+    n = id < base[n].id ? base[n].left : base[n].right;
+  }
+  return NULL;
+}
+
+uint32_t DirTree::NewNode(const dtree_node &n) {
+  node_set.push_back(n);
+  return node_set.size() - 1;
+}
+
+// Insert or replace n.id below root, return new root
+// Nodes on the path are copied, rotations only touch those fresh copies.
+uint32_t DirTree::Insert(uint32_t root, const dtree_node &n) {
+  if (root == 0) {
+    dtree_node c = n;
+    c.left = c.right = 0;
+    return NewNode(c);
+  }
+  dtree_node t = node_set[root];
+  if (n.id == t.id) {
+    dtree_node c = n;
+    c.left = t.left;
+    c.right = t.right;
+    return NewNode(c);
+  }
+  uint32_t c;
+  if (n.id < t.id) {
+    t.left = Insert(t.left, n);
+    c = NewNode(t);
+    uint32_t l = node_set[c].left;
+    if (priority(node_set[l].id) > priority(node_set[c].id)) {
+      node_set[c].left = node_set[l].right;
+      node_set[l].right = c;
+      c = l;
+    }
+  } else {
+    t.right = Insert(t.right, n);
+    c = NewNode(t);
+    uint32_t r = node_set[c].right;
+    if (priority(node_set[r].id) > priority(node_set[c].id)) {
+      node_set[c].right = node_set[r].left;
+      node_set[r].left = c;
+      c = r;
+    }
+  }
+  return c;
+}
+
+// Directory id is name under pid (or deleted) from record usn on
+// Records must come in usn order, a state equal to the current one adds no version.
+void DirTree::Set(uint64_t usn, uint64_t ts, uint32_t id, const string &name, uint32_t pid, bool deleted) {
+  uint32_t root = version_set.empty() ? 0 : version_set.back().root;
+  uint16_t flags = deleted ? DTREE_DELETED : 0;
+  const dtree_node *cur = find_node(node_set.data(), root, id);
+  if (cur != NULL && cur->pid == pid && cur->flags == flags
+    && name.compare(0, string::npos, &string_set[cur->str], cur->len) == 0)
+    return;
+
+  auto itr = string_table.find(name);
+  if (itr == string_table.end()) {
+    itr = string_table.insert(make_pair(name, uint32_t(string_set.size()))).first;
+    string_set += name;
+  }
+  dtree_node n;
+  n.usn = usn;
+  n.id = id;
+  n.pid = pid;
+  n.str = itr->second;
+  n.len = name.size();
+  n.flags = flags;
+  root = Insert(root, n);
+
+  if (!version_set.empty() && version_set.back().usn == usn) {
+    version_set.back().root = root;
+    return;
+  }
+  dtree_version v;
+  v.usn = usn;
+  v.ts = version_set.empty() ? ts : max(ts, version_set.back().ts);
+  v.root = root;
+  v.pad = 0;
+  version_set.push_back(v);
+}
+
+// Write odname/usn_analytics.dtree
+int DirTree::Write(const char *odname) {
+  FILE *fp;
+  string fname = string(odname) + SEP + DTREE_NAME;
+  string tmp = fname + ".tmp";
+
+  if ((fp = fopen(tmp.c_str(), "wb")) == NULL) {
+    perror("Directory Tree File Error");
+    return -1;
+  }
+  dtree_header h;
+  memcpy(h.magic, DTREE_MAGIC, sizeof(h.magic));
+  h.version = DTREE_VERSION;
+  h.nodes = node_set.size();
+  h.versions = version_set.size();
+  h.strings = string_set.size();
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(node_set.data(), sizeof(dtree_node), node_set.size(), fp);
+  fwrite(version_set.data(), sizeof(dtree_version), version_set.size(), fp);
+  fwrite(string_set.data(), 1, string_set.size(), fp);
+
+  if (ferror(fp)) {
+    perror("Directory Tree File Error");
+    fclose(fp);
+    remove(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  if (rename(tmp.c_str(), fname.c_str()) != 0) {
+    perror("Directory Tree File Error");
+    return -1;
+  }
+  return 0;
+}
+
+// Map tree file and check its sections fit in it
+int DirTree::Open(const char *fname) {
+  FILE *fp;
+  if ((fp = fopen(fname, "rb")) == NULL) {
+    perror("Directory Tree File Error");
+    return -1;
+  }
+  map_size = get_file_size(fname);
+  if (map_size < sizeof(dtree_header)) {
+    fprintf(stderr, "Directory Tree File Error: %s is not a directory tree\n", fname);
+    fclose(fp);
+    return -1;
+  }
+#ifdef _WIN32
+  body.resize(map_size);
+  if (fread(&body[0], 1, map_size, fp) != map_size) {
+    perror("Directory Tree File Error");
+    fclose(fp);
+    return -1;
+  }
+  const unsigned char *p = &body[0];
+#else
+  map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    perror("Directory Tree File Error");
+    fclose(fp);
+    return -1;
+  }
+  const unsigned char *p = (const unsigned char*)map;
+#endif
+  fclose(fp);
+
+  header = (const dtree_header*)p;
+  if (memcmp(header->magic, DTREE_MAGIC, sizeof(header->magic)) != 0 || header->version != DTREE_VERSION) {
+    fprintf(stderr, "Directory Tree File Error: %s is not a directory tree\n", fname);
+    return -1;
+  }
+  uint64_t pos = sizeof(dtree_header);
+  nodes = (const dtree_node*)(p + pos);
+  pos += header->nodes * sizeof(dtree_node);
+  versions = (const dtree_version*)(p + pos);
+  pos += header->versions * sizeof(dtree_version);
+  strings = (const char*)(p + pos);
+  pos += header->strings;
+  if (header->nodes == 0 || pos > map_size) {
+    fprintf(stderr, "Directory Tree File Error: %s is broken\n", fname);
+    return -1;
+  }
+  return 0;
+}
+
+uint64_t DirTree::Versions() {
+  return header->versions;
+}
+
+const dtree_version &DirTree::Version(uint64_t v) {
+  return versions[v];
+}
+
+// Last version at or before usn
+// return: -1 if usn is before the first change
+int64_t DirTree::FindUsn(uint64_t usn) {
+  const dtree_version *v = upper_bound(versions, versions + header->versions, usn,
+    [](uint64_t a, const dtree_version &b) { return a < b.usn; });
+  return int64_t(v - versions) - 1;
+}
+
+// Last version at or before FILETIME ts
+// return: -1 if ts is before the first change
+int64_t DirTree::FindTime(uint64_t ts) {
+  const dtree_version *v = upper_bound(versions, versions + header->versions, ts,
+    [](uint64_t a, const dtree_version &b) { return a < b.ts; });
+  return int64_t(v - versions) - 1;
+}
+
+// State of directory id in version v, NULL if not known then
+const dtree_node *DirTree::Get(uint64_t v, uint32_t id) {
+  return find_node(nodes, versions[v].root, id);
+}
+
+// Full path of directory id in version v ("\a\b\"), as far as it is known
+// A path without leading '\' has an ancestor which is not in the tree.
+string DirTree::Path(uint64_t v, uint32_t id) {
+  string path;
+  uint32_t root = versions[v].root;
+  for (int i = 0; i < 32; i++) { // prevent from infinite loop
+    if (id == DTREE_ROOT)
+      return "\\" + path;
+    const dtree_node *n = find_node(nodes, root, id);
+    if (n == NULL)
+      break;
+    path = string(strings + n->str, n->len) + path;
+    id = n->pid;
+  }
+  return path;
+}
+
+// Call f for every directory of version v in id order
+void DirTree::Walk(uint64_t v, const function<void(const dtree_node&)> &f) {
+  vector<uint32_t> stack;
+  uint32_t n = versions[v].root;
+  while (n != 0 || !stack.empty()) {
+    while (n != 0) {
+      stack.push_back(n);
+      n = nodes[n].left;
+    }
+    n = stack.back();
+    stack.pop_back();
+    f(nodes[n]);
+    n = nodes[n].right;
+  }
+}
@@ -0,0 +1,174 @@
+#include "usnjrnl.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <csignal>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#ifdef __linux__
+#  include <poll.h>
+#  include <unistd.h>
+#  include <sys/inotify.h>
+#endif
+
+#define FOLLOW_TICK_MS 250         // max wait between checks, min interval between passes
+#define FOLLOW_PACK_WINDOW 10000000 // 1s, records this close to the newest may still be packed
+
+static volatile sig_atomic_t follow_stop = 0;
+
+static void follow_signal(int) {
+  follow_stop = 1;
+}
+
+// Process records appended since previous pass
+// Tables of previous pass are dropped except packing tail, directory table,
+// prefetch counts and detector state. Unless flush, records within the pack
+// window of the newest record are left for next pass.
+// return: packed records written
+int UsnJrnl::FollowStep(char *odname, bool flush) {
+  uint64_t size = get_file_size(in_fname.c_str());
+
+  // file replaced or truncated: rescan, already processed usns are skipped
+  scan_begin = (size < file_size || packed_usn == 0) ? 0 : packed_offset;
+  file_size = size;
+  resume_usn = packed_usn;
+  append = true;
+
+  CloseScanIndex();
+  usn_set.clear();
+  usn_table.clear();
+  corrupt_offset_set.clear();
+  if(usnmain_set.size() > 2)
+    usnmain_set.erase(usnmain_set.begin(), usnmain_set.end() - 2);
+  main_begin = usnmain_set.size();
+
+  bool q = quiet;
+  quiet = true;
+  GetAllUsnOffset();
+
+  sort(usn_set.begin(), usn_set.end());
+  if(!flush && usn_set.size() > 0) {
+    UsnRecord ur(fp_in);
+    ur.ReadRecord(usn_table[usn_set.back()]);
+    uint64_t newest = ur.usn_record.TimeStamp;
+    while(usn_set.size() > 0) {
+      ur.ReadRecord(usn_table[usn_set.back()]);
+      if(ur.usn_record.TimeStamp + FOLLOW_PACK_WINDOW <= newest)
+        break;
+      usn_set.pop_back();
+    }
+  }
+  if(usn_set.size() < 2) { // last record is never packed alone
+    if(!following) { // stopping, report what is still open
+      burst_detector.Finish();
+      slot_sketch.Finish();
+      if(burst_detector.bursts.size() > 0)
+        WriteBurstInfo(lt);
+      if(slot_sketch.slots.size() > 0)
+        WriteSlotSummary();
+    }
+    quiet = q;
+    return 0;
+  }
+
+  time_t now = time(NULL);
+  fprintf(fp_ofreport, "\n[Follow] %s\n", parse_datetime((uint64_t(now) + 11644473600ULL) * 10000000, lt).c_str());
+  fprintf(fp_ofreport, "%llu bytes (%s)\n", file_size, in_fname.c_str());
+  PreProcess();
+  CheckRecords();
+  path_table.clear(); // rebuilt from whole dir_table
+  PostProcess();
+  WriteBundledRecords(odname, lt);
+  WriteExecutedRecords(odname, lt);
+  WriteOpenedRecords(odname, lt);
+  WriteSuspiciousInfo(odname, lt);
+  WriteBurstInfo(lt);
+  // closed bursts/slots are reported once
+  burst_detector.bursts.clear();
+  slot_sketch.slots.clear();
+  fflush(fp_ofreport);
+  quiet = q;
+
+  int written = usnmain_set.size() - main_begin;
+  console("%s %8d records (USN %llu)\n", parse_datetime((uint64_t(now) + 11644473600ULL) * 10000000, lt).c_str(),
+    written, packed_usn);
+  return written;
+}
+
+// Wait for input to change, at most ms
+// fd: inotify descriptor, -1 to poll file size only
+static void wait_change(int fd, int ms) {
+#ifdef __linux__
+  if(fd >= 0) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    if(poll(&p, 1, ms) > 0) {
+      char buf[4096];
+      while(read(fd, buf, sizeof(buf)) > 0) // drain events
+        ;
+    }
+    return;
+  }
+#endif
+  this_thread::sleep_for(chrono::milliseconds(ms));
+}
+
+// Tail input until SIGINT/SIGTERM and emit packed records as it grows
+// Records are written at most latency seconds after the input stops growing
+// (plus the pack window while it keeps growing). On exit a checkpoint is
+// saved so that --resume can continue later.
+int UsnJrnl::Follow(char *odname, uint32_t latency) {
+  int fd = -1;
+  following = true;
+  burst_detector.bursts.clear(); // already reported by first pass
+  slot_sketch.slots.clear();
+  chunk_cache_fname.clear(); // rewriting the cache every pass costs more than scanning the tail
+  signal(SIGINT, follow_signal);
+  signal(SIGTERM, follow_signal);
+
+#ifdef __linux__
+  fd = inotify_init1(IN_NONBLOCK);
+  if(fd >= 0 && inotify_add_watch(fd, in_fname.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB) < 0) {
+    close(fd);
+    fd = -1;
+  }
+#endif
+  console("Follow %s (%s), Ctrl-C to stop\n", in_fname.c_str(), fd >= 0 ? "inotify" : "polling");
+
+  uint64_t last_size = file_size;
+  bool pending = false; // appended records not written yet
+  chrono::steady_clock::time_point last_growth = chrono::steady_clock::now();
+  chrono::steady_clock::time_point last_pass = last_growth;
+
+  while(!follow_stop) {
+    wait_change(fd, FOLLOW_TICK_MS);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    uint64_t size = get_file_size(in_fname.c_str());
+    if(size != last_size) {
+      last_size = size;
+      last_growth = now;
+      pending = true;
+    }
+    if(!pending)
+      continue;
+    bool idle = now - last_growth >= chrono::seconds(latency);
+    if(!idle && now - last_pass < chrono::milliseconds(FOLLOW_TICK_MS))
+      continue;
+    FollowStep(odname, idle);
+    last_pass = now;
+    if(idle)
+      pending = false;
+  }
+
+#ifdef __linux__
+  if(fd >= 0)
+    close(fd);
+#endif
+  following = false;
+  FollowStep(odname, true);
+  SaveCheckpoint(odname);
+  console("Follow stopped\n");
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include "historyindex.h"
+#include "utils.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
+
+HistoryIndex::HistoryIndex() {
+  map = NULL;
+  map_size = 0;
+  header = NULL;
+}
+
+HistoryIndex::~HistoryIndex() {
+#ifndef _WIN32
+  if (map != NULL)
+    munmap(map, map_size);
+#endif
+}
+
+// Register a records csv, return its index
+uint32_t HistoryIndex::AddFile(const string &fname) {
+  file_names.push_back(get_base_name(fname));
+  return file_names.size() - 1;
+}
+
+void HistoryIndex::AddName(const string &name, uint32_t row) {
+  string key = name;
+  transform(key.begin(), key.end(), key.begin(), ::tolower);
+  auto itr = name_table.find(key);
+  if (itr == name_table.end()) {
+    itr = name_table.insert(make_pair(key, uint32_t(name_list.size()))).first;
+    name_list.push_back(key);
+  }
+  name_rows.push_back(make_pair(itr->second, row));
+}
+
+// Add a row written at offset of file, rows must be added in output order
+// id is the file reference with its sequence, a reused MFT entry is another file.
+// A rename ("old -> new") is found by both names, a move ("name (pid -> pid)") by name.
+void HistoryIndex::AddRow(uint32_t file, uint64_t offset, uint32_t len, uint64_t id, const string &name) {
+  hidx_row r;
+  r.offset = offset;
+  r.len = len;
+  r.file = file;
+  r.id = id;
+  uint32_t row = row_set.size();
+  row_set.push_back(r);
+  id_rows.push_back(make_pair(id, row));
+
+  size_t pos = name.find(" -> ");
+  if (pos == string::npos)
+    AddName(name, row);
+  else if (name.size() > 0 && name[name.size()-1] == ')' && name.rfind(" (", pos) != string::npos)
+    AddName(name.substr(0, name.rfind(" (", pos)), row);
+  else {
+    AddName(name.substr(0, pos), row);
+    AddName(name.substr(pos + 4), row);
+  }
+}
+
+static void write_pad(FILE *fp, uint64_t *pos) {
+  static const char zero[8] = {0};
+  uint64_t pad = (8 - *pos % 8) % 8;
+  fwrite(zero, 1, pad, fp);
+  *pos += pad;
+}
+
+// Write odname/usn_analytics.hidx
+int HistoryIndex::Write(const char *odname) {
+  FILE *fp;
+  string fname = string(odname) + SEP + HIDX_NAME;
+  string tmp = fname + ".tmp";
+
+  if ((fp = fopen(tmp.c_str(), "wb")) == NULL) {
+    perror("History Index File Error");
+    return -1;
+  }
+
+  // postings of a key keep row order, so a file's history comes out in usn order
+  stable_sort(id_rows.begin(), id_rows.end(), [](const pair<uint64_t, uint32_t> &a, const pair<uint64_t, uint32_t> &b) {
+    return hidx_id_order(a.first) < hidx_id_order(b.first);
+  });
+  vector<uint32_t> name_order(name_list.size());
+  for (uint32_t i = 0; i < name_order.size(); i++)
+    name_order[i] = i;
+  sort(name_order.begin(), name_order.end(), [this](uint32_t a, uint32_t b) { return name_list[a] < name_list[b]; });
+  vector<uint32_t> name_rank(name_list.size());
+  for (uint32_t i = 0; i < name_order.size(); i++)
+    name_rank[name_order[i]] = i;
+  stable_sort(name_rows.begin(), name_rows.end(), [&name_rank](const pair<uint32_t, uint32_t> &a, const pair<uint32_t, uint32_t> &b) {
+    return name_rank[a.first] < name_rank[b.first];
+  });
+
+  string strings;
+  vector<hidx_file> file_set;
+  for (auto &x: file_names) {
+    hidx_file f;
+    f.str = strings.size();
+    f.len = x.size();
+    strings += x;
+    file_set.push_back(f);
+  }
+  vector<hidx_id> id_set;
+  vector<uint32_t> posting_set;
+  for (size_t i = 0; i < id_rows.size(); i++) {
+    if (i == 0 || id_rows[i].first != id_rows[i-1].first) {
+      hidx_id e;
+      e.id = id_rows[i].first;
+      e.begin = posting_set.size();
+      e.count = 0;
+      id_set.push_back(e);
+    }
+    id_set.back().count++;
+    posting_set.push_back(id_rows[i].second);
+  }
+  vector<hidx_name> name_set;
+  for (size_t i = 0; i < name_rows.size(); i++) {
+    if (i == 0 || name_rows[i].first != name_rows[i-1].first) {
+      const string &name = name_list[name_rows[i].first];
+      hidx_name e;
+      e.str = strings.size();
+      e.len = name.size();
+      e.begin = posting_set.size();
+      e.count = 0;
+      strings += name;
+      name_set.push_back(e);
+    }
+    name_set.back().count++;
+    posting_set.push_back(name_rows[i].second);
+  }
+
+  hidx_header h;
+  memcpy(h.magic, HIDX_MAGIC, sizeof(h.magic));
+  h.version = HIDX_VERSION;
+  h.files = file_set.size();
+  h.rows = row_set.size();
+  h.ids = id_set.size();
+  h.names = name_set.size();
+  h.postings = posting_set.size();
+  h.strings = strings.size();
+
+  uint64_t pos = sizeof(h) + file_set.size() * sizeof(hidx_file) + row_set.size() * sizeof(hidx_row)
+    + id_set.size() * sizeof(hidx_id) + name_set.size() * sizeof(hidx_name) + posting_set.size() * sizeof(uint32_t);
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(file_set.data(), sizeof(hidx_file), file_set.size(), fp);
+  fwrite(row_set.data(), sizeof(hidx_row), row_set.size(), fp);
+  fwrite(id_set.data(), sizeof(hidx_id), id_set.size(), fp);
+  fwrite(name_set.data(), sizeof(hidx_name), name_set.size(), fp);
+  fwrite(posting_set.data(), sizeof(uint32_t), posting_set.size(), fp);
+  fwrite(strings.data(), 1, strings.size(), fp);
+  pos += strings.size();
+  write_pad(fp, &pos);
+
+  if (ferror(fp)) {
+    perror("History Index File Error");
+    fclose(fp);
+    remove(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  if (rename(tmp.c_str(), fname.c_str()) != 0) {
+    perror("History Index File Error");
+    return -1;
+  }
+  return 0;
+}
+
+// Map index file and check its sections fit in it
+int HistoryIndex::Open(const char *fname) {
+  FILE *fp;
+  if ((fp = fopen(fname, "rb")) == NULL) {
+    perror("History Index File Error");
+    return -1;
+  }
+  map_size = get_file_size(fname);
+  if (map_size < sizeof(hidx_header)) {
+    fprintf(stderr, "History Index File Error: %s is not a history index\n", fname);
+    fclose(fp);
+    return -1;
+  }
+#ifdef _WIN32
+  body.resize(map_size);
+  if (fread(&body[0], 1, map_size, fp) != map_size) {
+    perror("History Index File Error");
+    fclose(fp);
+    return -1;
+  }
+  const unsigned char *p = &body[0];
+#else
+  map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    perror("History Index File Error");
+    fclose(fp);
+    return -1;
+  }
+  const unsigned char *p = (const unsigned char*)map;
+#endif
+  fclose(fp);
+
+  header = (const hidx_header*)p;
+  if (memcmp(header->magic, HIDX_MAGIC, sizeof(header->magic)) != 0 || header->version != HIDX_VERSION) {
+    fprintf(stderr, "History Index File Error: %s is not a history index\n", fname);
+    return -1;
+  }
+  uint64_t pos = sizeof(hidx_header);
+  files = (const hidx_file*)(p + pos);
+  pos += header->files * sizeof(hidx_file);
+  rows = (const hidx_row*)(p + pos);
+  pos += header->rows * sizeof(hidx_row);
+  ids = (const hidx_id*)(p + pos);
+  pos += header->ids * sizeof(hidx_id);
+  names = (const hidx_name*)(p + pos);
+  pos += header->names * sizeof(hidx_name);
+  postings = (const uint32_t*)(p + pos);
+  pos += header->postings * sizeof(uint32_t);
+  strings = (const char*)(p + pos);
+  pos += header->strings;
+  if (pos > map_size || !Valid()) {
+    fprintf(stderr, "History Index File Error: %s is broken\n", fname);
+    return -1;
+  }
+  return 0;
+}
+
+// Check section sizes and every index read from file against its target
+bool HistoryIndex::Valid() {
+  uint64_t size = map_size - sizeof(hidx_header);
+  if (header->files > size / sizeof(hidx_file) || header->rows > size / sizeof(hidx_row)
+    || header->ids > size / sizeof(hidx_id) || header->names > size / sizeof(hidx_name)
+    || header->postings > size / sizeof(uint32_t) || header->strings > size)
+    return false;
+  for (uint64_t i = 0; i < header->files; i++)
+    if (files[i].str > header->strings || files[i].len > header->strings - files[i].str)
+      return false;
+  for (uint64_t i = 0; i < header->rows; i++)
+    if (rows[i].file >= header->files)
+      return false;
+  for (uint64_t i = 0; i < header->ids; i++)
+    if (ids[i].begin > header->postings || ids[i].count > header->postings - ids[i].begin)
+      return false;
+  for (uint64_t i = 0; i < header->names; i++)
+    if (names[i].str > header->strings || names[i].len > header->strings - names[i].str
+      || names[i].begin > header->postings || names[i].count > header->postings - names[i].begin)
+      return false;
+  for (uint64_t i = 0; i < header->postings; i++)
+    if (postings[i] >= header->rows)
+      return false;
+  return true;
+}
+
+uint64_t HistoryIndex::Rows() {
+  return header->rows;
+}
+
+const hidx_row &HistoryIndex::Row(uint64_t i) {
+  return rows[i];
+}
+
+string HistoryIndex::FileName(uint32_t i) {
+  return string(strings + files[i].str, files[i].len);
+}
+
+// Append rows of file reference to out
+// return: number of rows
+uint64_t HistoryIndex::FindId(uint64_t id, vector<uint32_t> *out) {
+  const hidx_id *e = lower_bound(ids, ids + header->ids, hidx_id_order(id), [](const hidx_id &a, uint64_t b) {
+    return hidx_id_order(a.id) < b;
+  });
+  if (e == ids + header->ids || e->id != id)
+    return 0;
+  out->insert(out->end(), postings + e->begin, postings + e->begin + e->count);
+  return e->count;
+}
+
+// Append rows of every file which had FileID (any sequence) to out
+// return: number of rows
+uint64_t HistoryIndex::FindFileId(uint64_t file_id, vector<uint32_t> *out) {
+  uint64_t n = 0;
+  const hidx_id *e = lower_bound(ids, ids + header->ids, hidx_id_order(file_id), [](const hidx_id &a, uint64_t b) {
+    return hidx_id_order(a.id) < b;
+  });
+  for (; e < ids + header->ids && (e->id & 0x0000FFFFFFFFFFFF) == file_id; e++) {
+    out->insert(out->end(), postings + e->begin, postings + e->begin + e->count);
+    n += e->count;
+  }
+  return n;
+}
+
+// Append rows of file name (case-insensitive) to out
+// return: number of rows
+uint64_t HistoryIndex::FindName(const string &name, vector<uint32_t> *out) {
+  string key = name;
+  transform(key.begin(), key.end(), key.begin(), ::tolower);
+  const char *str = strings;
+  const hidx_name *e = lower_bound(names, names + header->names, key, [str](const hidx_name &a, const string &b) {
+    return b.compare(0, string::npos, str + a.str, a.len) > 0;
+  });
+  if (e == names + header->names || key.compare(0, string::npos, str + e->str, e->len) != 0)
+    return 0;
+  out->insert(out->end(), postings + e->begin, postings + e->begin + e->count);
+  return e->count;
+}
@@ -0,0 +1,247 @@
+#include "iocmatcher.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+
+using namespace std;
+
+IocMatcher::IocMatcher() {
+  trie.push_back(map<uint8_t, uint32_t>());
+  trie_rules.push_back(vector<uint32_t>());
+}
+
+// Built-in rules used when no rule file is given
+int IocMatcher::LoadDefaultRules() {
+  AddRule(IOC_EXT, ".job", "job");
+  AddRule(IOC_EXT, ".exe", "exe");
+  AddRule(IOC_EXT, ".dll", "dll");
+  AddRule(IOC_EXT, ".scr", "scr");
+  AddRule(IOC_EXT, ".ps1", "ps1");
+  AddRule(IOC_EXT, ".vba", "vbe/vbs");
+  AddRule(IOC_EXT, ".vbe", "vbe/vbs");
+  AddRule(IOC_EXT, ".vbs", "vbe/vbs");
+  AddRule(IOC_EXT, ".bat", "bat");
+  AddRule(IOC_EXT, ".tck", "tck");
+  AddRule(IOC_NAME, "PSEXESVC.exe", "PSEXESVC");
+  Compile();
+  return 0;
+}
+
+// Load rules from text file then compile them
+// format: one rule per line, "kind<TAB>pattern[<TAB>group]"
+//   kind: name, ext, substr or path; lines starting with '#' are comments
+// return: number of rules, -1 on error
+int IocMatcher::LoadRuleFile(const char *fname) {
+  FILE *fp;
+  char line[4096];
+  uint64_t lineno = 0;
+
+  if((fp = fopen(fname, "r")) == NULL) {
+    perror("IOC Rule File Error");
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    ++lineno;
+    string s(line);
+    while(s.size() > 0 && (s.back() == '\n' || s.back() == '\r'))
+      s.pop_back();
+    if(s.size() == 0 || s[0] == '#')
+      continue;
+
+    size_t tab1 = s.find('\t');
+    if(tab1 == string::npos) {
+      fprintf(stderr, "%s:%llu: missing TAB separator\n", fname, lineno);
+      fclose(fp);
+      return -1;
+    }
+    string kind_s = s.substr(0, tab1);
+    string pattern, group;
+    size_t tab2 = s.find('\t', tab1+1);
+    if(tab2 == string::npos) {
+      pattern = s.substr(tab1+1);
+      group = pattern;
+    } else {
+      pattern = s.substr(tab1+1, tab2-tab1-1);
+      group = s.substr(tab2+1);
+    }
+    if(pattern.size() == 0)
+      continue;
+
+    uint8_t kind;
+    if(kind_s == "name")
+      kind = IOC_NAME;
+    else if(kind_s == "ext")
+      kind = IOC_EXT;
+    else if(kind_s == "substr")
+      kind = IOC_SUBSTR;
+    else if(kind_s == "path")
+      kind = IOC_PATH;
+    else {
+      fprintf(stderr, "%s:%llu: unknown kind \"%s\"\n", fname, lineno, kind_s.c_str());
+      fclose(fp);
+      return -1;
+    }
+    AddRule(kind, pattern, group);
+  }
+  fclose(fp);
+  Compile();
+  return rules.size();
+}
+
+// Insert a rule into the trie
+int IocMatcher::AddRule(uint8_t kind, string pattern, string group) {
+  ioc_rule rule;
+  uint32_t node = 0;
+
+  transform(pattern.begin(), pattern.end(), pattern.begin(), ::tolower);
+  rule.kind = kind;
+  rule.pattern = pattern;
+  rule.group = group;
+  rules.push_back(rule);
+
+  auto gitr = group_index.find(group);
+  if(gitr == group_index.end()) {
+    gitr = group_index.insert(make_pair(group, groups.size())).first;
+    groups.push_back(group);
+  }
+  rule_group.push_back(gitr->second);
+
+  for(size_t i=0; i < pattern.size(); i++) {
+    uint8_t c = pattern[i];
+    auto itr = trie[node].find(c);
+    if(itr == trie[node].end()) {
+      trie[node][c] = trie.size();
+      node = trie.size();
+      trie.push_back(map<uint8_t, uint32_t>());
+      trie_rules.push_back(vector<uint32_t>());
+    } else
+      node = itr->second;
+  }
+  trie_rules[node].push_back(rules.size()-1);
+  return 0;
+}
+
+// Flatten trie into sorted edge arrays and build failure/dictionary links
+void IocMatcher::Compile() {
+  uint32_t n = trie.size();
+
+  edge_begin.assign(n, 0);
+  edge_end.assign(n, 0);
+  edge_char.clear();
+  edge_next.clear();
+  out_begin.assign(n, 0);
+  out_end.assign(n, 0);
+  out_rule.clear();
+  fail.assign(n, 0);
+  dict.assign(n, -1);
+
+  for(uint32_t i=0; i < n; i++) {
+    edge_begin[i] = edge_char.size();
+    for(auto x: trie[i]) { // std::map keeps edges sorted
+      edge_char.push_back(x.first);
+      edge_next.push_back(x.second);
+    }
+    edge_end[i] = edge_char.size();
+    out_begin[i] = out_rule.size();
+    for(uint32_t r: trie_rules[i])
+      out_rule.push_back(r);
+    out_end[i] = out_rule.size();
+  }
+
+  // breadth first so that failure target is always computed before
+  queue<uint32_t> q;
+  for(uint32_t e=edge_begin[0]; e < edge_end[0]; e++)
+    q.push(edge_next[e]);
+  while(!q.empty()) {
+    uint32_t node = q.front();
+    q.pop();
+    for(uint32_t e=edge_begin[node]; e < edge_end[node]; e++) {
+      uint32_t child = edge_next[e];
+      uint32_t f = fail[node];
+      while(true) {
+        uint32_t x = Next(f, edge_char[e]);
+        if(x != 0 || f == 0) {
+          fail[child] = x;
+          break;
+        }
+        f = fail[f];
+      }
+      uint32_t fc = fail[child];
+      dict[child] = (out_begin[fc] != out_end[fc]) ? int32_t(fc) : dict[fc];
+      q.push(child);
+    }
+  }
+
+  trie.clear();
+  trie_rules.clear();
+  group_index.clear();
+}
+
+// Goto function, return 0 (root) if no edge
+uint32_t IocMatcher::Next(uint32_t node, uint8_t c) {
+  uint32_t lo = edge_begin[node], hi = edge_end[node];
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if(edge_char[mid] < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo < edge_end[node] && edge_char[lo] == c)
+    return edge_next[lo];
+  return 0;
+}
+
+// Run automaton over text and append matched rule indexes
+void IocMatcher::Scan(const string &text, bool is_path, vector<uint32_t> *hits) {
+  uint32_t node = 0;
+  size_t len = text.size();
+
+  for(size_t i=0; i < len; i++) {
+    uint8_t c = tolower((unsigned char)text[i]);
+    uint32_t x;
+    while((x = Next(node, c)) == 0 && node != 0)
+      node = fail[node];
+    node = x;
+
+    int32_t o = (out_begin[node] != out_end[node]) ? int32_t(node) : dict[node];
+    for(; o >= 0; o = dict[o]) {
+      for(uint32_t k=out_begin[o]; k < out_end[o]; k++) {
+        uint32_t r = out_rule[k];
+        uint8_t kind = rules[r].kind;
+        if(is_path) {
+          if(kind == IOC_PATH)
+            hits->push_back(r);
+        } else if(kind == IOC_SUBSTR) {
+          hits->push_back(r);
+        } else if(kind == IOC_EXT) {
+          if(i == len-1)
+            hits->push_back(r);
+        } else if(kind == IOC_NAME) {
+          if(i == len-1 && rules[r].pattern.size() == len)
+            hits->push_back(r);
+        }
+      }
+    }
+  }
+}
+
+// Match file name and file path against all rules in one pass each
+// out: hits (rule indexes, sorted and unique)
+// return: number of matched rules
+int IocMatcher::Match(const string &file_name, const string &file_path, vector<uint32_t> *hits) {
+  hits->clear();
+  if(rules.size() == 0)
+    return 0;
+  Scan(file_name, false, hits);
+  Scan(file_path, true, hits);
+  if(hits->size() > 1) {
+    sort(hits->begin(), hits->end());
+    hits->erase(unique(hits->begin(), hits->end()), hits->end());
+  }
+  return hits->size();
+}
@@ -0,0 +1,175 @@
+#include "metrics.h"
+#include "utils.h"
+#include "probes.h"
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#ifndef _WIN32
+  #include <sys/resource.h>
+#endif
+
+static double wall_now() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_now() {
+#ifdef _WIN32
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+static uint64_t peak_rss() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return uint64_t(ru.ru_maxrss) * 1024; // KB on Linux
+#endif
+}
+
+// Bytes read/written by the process so far (rchar/wchar of /proc/self/io)
+// Counts through the page cache too, so warm and cold runs are comparable.
+static void io_bytes(uint64_t *rd, uint64_t *wr) {
+  char line[128];
+  unsigned long long v;
+  FILE *fp;
+
+  *rd = *wr = 0;
+  if ((fp = fopen("/proc/self/io", "r")) == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "rchar: %llu", &v) == 1)
+      *rd = v;
+    else if (sscanf(line, "wchar: %llu", &v) == 1)
+      *wr = v;
+  }
+  fclose(fp);
+}
+
+static const char *counter_names[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+Metrics::Metrics() {
+  wall_start = 0;
+  perf = NULL;
+  status = NULL;
+  allocations = NULL;
+}
+
+// Start a stage, records_in is the number of records handed to it
+void Metrics::Begin(const char *name, uint64_t records_in) {
+  current.name = name;
+  current.records_in = records_in;
+  wall_begin = wall_now();
+  cpu_begin = cpu_now();
+  io_bytes(&read_begin, &written_begin);
+  if (perf != NULL)
+    perf->Read(counters_begin);
+  if (allocations != NULL)
+    allocations_begin = allocations();
+  if (stages.empty())
+    wall_start = wall_begin;
+  USN_PROBE2(stage__begin, current.name.c_str(), records_in);
+  if (status != NULL)
+    status->owner->Stage(status, name, records_in);
+}
+
+// Finish current stage, records_out is the number of records (or rows) it produced
+void Metrics::End(uint64_t records_out) {
+  uint64_t rd, wr;
+  if (perf != NULL) {
+    perf->Read(current.counters);
+    for (int i = 0; i < PERF_COUNTERS; i++)
+      current.counters[i] -= counters_begin[i];
+  } else
+    memset(current.counters, 0, sizeof(current.counters));
+  io_bytes(&rd, &wr);
+  current.wall = wall_now() - wall_begin;
+  current.cpu = cpu_now() - cpu_begin;
+  current.bytes_read = rd - read_begin;
+  current.bytes_written = wr - written_begin;
+  current.records_out = records_out;
+  current.peak_rss = peak_rss();
+  current.allocations = allocations != NULL ? allocations() - allocations_begin : 0;
+  stages.push_back(current);
+  USN_PROBE3(stage__end, current.name.c_str(), records_out, uint64_t(current.wall * 1e9));
+}
+
+// Write odname/metrics.json
+int Metrics::Write(const char *odname, const char *input, uint64_t input_bytes, uint32_t threads) {
+  FILE *fp;
+  string fname = string(odname) + SEP + "metrics.json";
+
+  if ((fp = fopen(fname.c_str(), "w")) == NULL) {
+    perror("Metrics File Error");
+    return -1;
+  }
+  double cpu = 0;
+  uint64_t rd = 0, wr = 0, rss = 0;
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"version\": \"v.201801\",\n");
+  fprintf(fp, "  \"input\": %s,\n", json_str(input).c_str());
+  fprintf(fp, "  \"input_bytes\": %llu,\n", input_bytes);
+  fprintf(fp, "  \"threads\": %u,\n", threads);
+  fprintf(fp, "  \"stages\": [\n");
+  for (size_t i = 0; i < stages.size(); i++) {
+    stage_metric &s = stages[i];
+    fprintf(fp, "    {\"name\": %s, \"wall_sec\": %.6f, \"cpu_sec\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+      "\"records_in\": %llu, \"records_out\": %llu, \"peak_rss_bytes\": %llu",
+      json_str(s.name).c_str(), s.wall, s.cpu, s.bytes_read, s.bytes_written,
+      s.records_in, s.records_out, s.peak_rss);
+    for (int k = 0; perf != NULL && k < PERF_COUNTERS; k++) {
+      if (perf->available[k])
+        fprintf(fp, ", \"%s\": %llu", counter_names[k], s.counters[k]);
+      else
+        fprintf(fp, ", \"%s\": null", counter_names[k]);
+    }
+    if (allocations != NULL)
+      fprintf(fp, ", \"allocations\": %llu", s.allocations);
+    fprintf(fp, "}%s\n", i+1 < stages.size() ? "," : "");
+    cpu += s.cpu;
+    rd += s.bytes_read;
+    wr += s.bytes_written;
+    if (s.peak_rss > rss)
+      rss = s.peak_rss;
+  }
+  fprintf(fp, "  ],\n");
+  fprintf(fp, "  \"total\": {\"wall_sec\": %.6f, \"cpu_sec\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu, \"peak_rss_bytes\": %llu}\n",
+    stages.empty() ? 0.0 : wall_now() - wall_start, cpu, rd, wr, rss);
+  fprintf(fp, "}\n");
+  fclose(fp);
+  return 0;
+}
+
+// Write stage table with hardware counters to report
+// Counters which are not available are shown as "-".
+void Metrics::WriteReport(FILE *fp) {
+  static const int width[PERF_COUNTERS] = {13, 13, 12, 13};
+  bool ipc = perf != NULL && perf->available[PERF_CYCLES] && perf->available[PERF_INSTRUCTIONS];
+
+  fprintf(fp, "\n[Stage Metrics] %lu stages\n", stages.size());
+  fprintf(fp, " Stage            |  Wall(s) |  Records/s |        Cycles |  Instructions |  IPC | Cache Misses | Branch Misses\n");
+  for (auto &s: stages) {
+    uint64_t n = s.records_in > s.records_out ? s.records_in : s.records_out;
+    fprintf(fp, " %-16s | %8.3f | %10.0f", s.name.c_str(), s.wall, s.wall > 0 ? n / s.wall : 0.0);
+    for (int k = 0; k < PERF_COUNTERS; k++) {
+      if (k == PERF_CACHE_MISSES) {
+        if (ipc && s.counters[PERF_CYCLES] > 0)
+          fprintf(fp, " | %4.2f", double(s.counters[PERF_INSTRUCTIONS]) / s.counters[PERF_CYCLES]);
+        else
+          fprintf(fp, " |    -");
+      }
+      if (perf != NULL && perf->available[k])
+        fprintf(fp, " | %*llu", width[k], s.counters[k]);
+      else
+        fprintf(fp, " | %*s", width[k], "-");
+    }
+    fprintf(fp, "\n");
+  }
+}
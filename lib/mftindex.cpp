@@ -0,0 +1,221 @@
+#include "mftindex.h"
+#include "utils.h"
+
+#include <cstring>
+
+#define ATTR_FILE_NAME 0x30
+#define ATTR_DATA      0x80
+#define ATTR_END       0xFFFFFFFF
+#define NS_DOS         2 // 8.3 name, used only if there is no other
+
+MftIndex::MftIndex() {
+  record_size = 0;
+  records = 0;
+  directories = 0;
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Read $MFT extracted as a file
+// return: -1 on error
+int MftIndex::Load(const char *fname) {
+  FILE *fp;
+  if ((fp = fopen(fname, "rb")) == NULL) {
+    perror("MFT File Error");
+    return -1;
+  }
+
+  vector<unsigned char> buf(MFT_READ_SIZE);
+  uint64_t recno = 0;
+  size_t n;
+  while ((n = fread(&buf[0], 1, buf.size(), fp)) > 0) {
+    if (record_size == 0) {
+      // FILE record of $MFT itself tells record size
+      record_size = 1024;
+      if (n >= 0x20 && memcmp(&buf[0], "FILE", 4) == 0) {
+        uint32_t size = get_u32(&buf[0x1C]);
+        if (size >= 256 && size <= 65536 && (size & (size - 1)) == 0)
+          record_size = size;
+      }
+    }
+    LoadRecords(&buf[0], n, recno);
+    recno += n / record_size;
+    if (n % record_size != 0) // buffer holds whole records, so only at end of file
+      break;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Parse consecutive FILE records in buf, first one is record number first
+// (buf is modified by fixup)
+int MftIndex::LoadRecords(unsigned char *buf, uint64_t len, uint64_t first) {
+  if (record_size == 0)
+    record_size = 1024;
+  for (uint64_t i=0; i + record_size <= len; i += record_size)
+    ParseRecord(buf + i, first + i / record_size);
+  return 0;
+}
+
+// Parse one FILE record and store its $FILE_NAME
+// return: -1 if rec is not a valid FILE record
+int MftIndex::ParseRecord(unsigned char *rec, uint64_t recno) {
+  if (memcmp(rec, "FILE", 4) != 0)
+    return -1;
+
+  // update sequence fixup, last 2 bytes of each sector
+  uint16_t usa_offset = get_u16(rec + 0x04);
+  uint16_t usa_count = get_u16(rec + 0x06);
+  if (usa_count == 0 || uint32_t(usa_offset + usa_count * 2) > record_size || uint32_t(usa_count - 1) * 512 > record_size)
+    return -1;
+  uint16_t usn = get_u16(rec + usa_offset);
+  for (uint16_t i=1; i < usa_count; i++) {
+    unsigned char *tail = rec + i * 512 - 2;
+    if (get_u16(tail) != usn)
+      return -1; // torn write
+    memcpy(tail, rec + usa_offset + i * 2, 2);
+  }
+
+  uint16_t seq = get_u16(rec + 0x10);
+  uint16_t attrs_offset = get_u16(rec + 0x14);
+  uint16_t flags = get_u16(rec + 0x16);
+  uint32_t used = get_u32(rec + 0x18);
+  uint64_t base_ref = get_u64(rec + 0x20);
+  uint64_t base = base_ref & 0xFFFFFFFFFFFFULL;
+  if (used > record_size)
+    used = record_size;
+  records++;
+
+  // $FILE_NAME in extension record belongs to base record
+  uint64_t owner = base != 0 ? base : recno;
+  if (owner >= entries.size()) {
+    mft_entry e;
+    memset(&e, 0, sizeof(e));
+    e.name_space = 0xFF;
+    entries.resize(owner + 1, e);
+  }
+  if (base == 0) {
+    entries[owner].seq = seq;
+    entries[owner].flags = flags & (MFT_IN_USE | MFT_DIRECTORY);
+    if ((flags & MFT_IN_USE) && (flags & MFT_DIRECTORY))
+      directories++;
+  }
+
+  uint32_t pos = attrs_offset;
+  while (pos + 16 <= used) {
+    uint32_t type = get_u32(rec + pos);
+    uint32_t len = get_u32(rec + pos + 4);
+    if (type == ATTR_END || len < 16 || pos + len > used)
+      break;
+    if (type == ATTR_FILE_NAME && rec[pos + 8] == 0) { // resident
+      uint32_t vlen = get_u32(rec + pos + 0x10);
+      uint16_t voff = get_u16(rec + pos + 0x14);
+      const unsigned char *v = rec + pos + voff;
+      if (voff + vlen <= len && vlen >= 0x42 && 0x42 + v[0x40] * 2u <= vlen)
+        SetName(owner, get_u64(v), v[0x40], v + 0x42, v[0x41]);
+    } else if (type == ATTR_DATA && rec[pos + 8] == 1 && on_data)
+      on_data(owner, base_ref, (flags & MFT_IN_USE) != 0, rec + pos, len);
+    pos += len;
+  }
+  return 0;
+}
+
+// Keep Win32/POSIX name rather than DOS 8.3 name
+void MftIndex::SetName(uint64_t owner, uint64_t parent_ref, uint16_t len, const unsigned char *name, uint8_t name_space) {
+  mft_entry &e = entries[owner];
+  if (e.name_space != 0xFF && (name_space == NS_DOS || e.name_space != NS_DOS))
+    return;
+
+  vector<char16_t> u(len);
+  memcpy(&u[0], name, len * 2);
+  string s = len > 0 ? UTF16toUTF8(&u[0], len) : "";
+  // remove illegal characer, same as UsnRecord::GetFileName
+  size_t p;
+  while ((p = s.find_first_of("/:*?\"<>|\\\t\r\n")) != string::npos)
+    s.erase(p, 1);
+
+  e.parent = uint32_t(parent_ref & 0xFFFFFFFF);
+  e.parent_seq = uint16_t(parent_ref >> 48);
+  e.name = names.size();
+  e.name_len = s.size();
+  e.name_space = name_space;
+  names += s;
+}
+
+bool MftIndex::IsDirectory(uint32_t ref) {
+  return ref < entries.size() && (entries[ref].flags & MFT_DIRECTORY);
+}
+
+bool MftIndex::InUse(uint32_t ref) {
+  return ref < entries.size() && (entries[ref].flags & MFT_IN_USE);
+}
+
+// ref is in use with sequence seq (not reused since a reference to it was made)
+bool MftIndex::InUse(uint32_t ref, uint16_t seq) {
+  return InUse(ref) && entries[ref].seq == seq;
+}
+
+// Full path of directory ref ("\" for root, "\dir\sub\" otherwise)
+// return: false if ref or one of its parents is unknown
+bool MftIndex::GetPath(uint32_t ref, string *path) {
+  auto itr = path_cache.find(ref);
+  if (itr != path_cache.end()) {
+    *path = itr->second;
+    return true;
+  }
+
+  vector<uint32_t> chain;
+  uint32_t cur = ref;
+  string base;
+  while (true) {
+    if (cur == MFT_ROOT) {
+      base = "\\";
+      break;
+    }
+    auto c = path_cache.find(cur);
+    if (c != path_cache.end()) {
+      base = c->second;
+      break;
+    }
+    if (cur >= entries.size() || entries[cur].name_space == 0xFF || chain.size() >= 255)
+      return false;
+    chain.push_back(cur);
+    uint32_t parent = entries[cur].parent;
+    if (parent < entries.size() && entries[parent].seq != 0 && entries[parent].seq != entries[cur].parent_seq)
+      return false; // parent record was reused, name chain is stale
+    cur = parent;
+  }
+
+  // cache every directory on the way down
+  for (size_t i=chain.size(); i-- > 0;) {
+    mft_entry &e = entries[chain[i]];
+    base += names.substr(e.name, e.name_len) + "\\";
+    path_cache[chain[i]] = base;
+  }
+  *path = base;
+  return true;
+}
+
+// Same, only if record ref still is the directory of sequence seq
+// (a reused record is another directory)
+bool MftIndex::GetPath(uint32_t ref, uint16_t seq, string *path) {
+  if (ref != MFT_ROOT && (ref >= entries.size() || entries[ref].seq != seq))
+    return false;
+  return GetPath(ref, path);
+}
@@ -0,0 +1,106 @@
+#include "usnjrnl.h"
+#include "utils.h"
+#include "compressedinput.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <algorithm>
+
+// Add an input of the same volume (e.g. live $J and $J of shadow copies)
+// First call registers the input given to constructor.
+int UsnJrnl::AddSource(char *ifname) {
+  FILE *fp;
+  source_stat st;
+
+  // size of a gzip input is found by its scan (GetAllUsnOffsetMulti)
+  if(fp_srcs.empty()) {
+    fp = fp_in;
+    st.size = file_size;
+  } else {
+    if((fp = open_input(ifname)) == NULL)
+      fatal("Input File Error", USN_ANALYTICS_E_INPUT);
+    st.size = 0;
+    if(input_size_known(ifname)) {
+      st.size = get_input_size(fp);
+      console("%llu bytes (%s)\n", st.size, ifname);
+      fprintf(fp_ofreport, "%llu bytes (%s)\n", st.size, ifname);
+    }
+  }
+  if(fp_srcs.size() >= (1U << (64 - SOURCE_SHIFT))) {
+    errno = 0;
+    fatal("Too many inputs", USN_ANALYTICS_E_ARG);
+  }
+  st.found = st.unique = st.overlap = st.conflict = 0;
+  fp_srcs.push_back(fp);
+  src_names.push_back(ifname);
+  src_stats.push_back(st);
+  return 0;
+}
+
+// Scan every input in turn into one record table
+// A record already stored from an earlier input (same usn, file reference,
+// timestamp, reason) is skipped, so each record is decoded and packed once.
+// Different records of one usn are all kept, in usn_set the usn repeats.
+// Offsets carry the source index (SOURCE_SHIFT).
+int UsnJrnl::GetAllUsnOffsetMulti() {
+  uint64_t total_size = 0;
+  for(uint32_t k=0; k < fp_srcs.size(); k++) {
+    current_src = k;
+    fp_in = fp_srcs[k];
+    in_fname = src_names[k];
+    file_size = src_stats[k].size;
+    size_known = input_size_known(src_names[k].c_str());
+    if(k > 0)
+      console("Search USNRECORD (%s)", src_names[k].c_str());
+    GetAllUsnOffset();
+    src_stats[k].size = file_size;
+    total_size += file_size;
+  }
+  current_src = 0;
+  fp_in = fp_srcs[0];
+  in_fname = src_names[0];
+  file_size = total_size;
+  // records of one usn in input order
+  vector<pair<uint64_t, uint64_t> > recs; // usn, offset
+  recs.reserve(src_table.size());
+  for(auto &x: src_table)
+    recs.push_back(make_pair(x.first.first, x.second));
+  map<pair<uint64_t, uint64_t>, uint64_t>().swap(src_table);
+  sort(recs.begin(), recs.end());
+  usn_set.reserve(recs.size());
+  src_offset.reserve(recs.size());
+  for(auto &x: recs) {
+    usn_set.push_back(x.first);
+    src_offset.push_back(x.second);
+  }
+
+  uint64_t found = 0, unique = 0, overlap = 0, conflict = 0;
+  for(auto &x: src_stats) {
+    found += x.found;
+    unique += x.unique;
+    overlap += x.overlap;
+    conflict += x.conflict;
+  }
+  uint64_t later = found - src_stats[0].found;
+  found_num = found - overlap;
+  fprintf(fp_ofreport, "\n[Sources] %lu inputs, %llu unique records, %llu duplicates across inputs (%.1f%% of later inputs), %llu conflicts (kept)\n",
+    fp_srcs.size(), unique, overlap, later > 0 ? 100.0 * overlap / later : 0.0, conflict);
+  fprintf(fp_ofreport, " Records |   Unique |  Overlap | Conflict |        Bytes | Input\n");
+  for(uint32_t k=0; k < fp_srcs.size(); k++) {
+    source_stat &x = src_stats[k];
+    fprintf(fp_ofreport, "%8llu | %8llu | %8llu | %8llu | %12llu | %s\n", x.found, x.unique, x.overlap, x.conflict,
+      x.size, src_names[k].c_str());
+  }
+  fprintf(fp_ofreport, "\n");
+  console("%8llu duplicates across %lu inputs\n", overlap, fp_srcs.size());
+  return 0;
+}
+
+// Record reader for usn_table offsets
+UsnRecord *UsnJrnl::NewRecord() {
+  if(fp_srcs.empty())
+    return new UsnRecord(fp_in);
+  return new UsnRecord(&fp_srcs);
+}
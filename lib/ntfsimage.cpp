@@ -0,0 +1,249 @@
+#include "ntfsimage.h"
+#include "utils.h"
+
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <algorithm>
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#endif
+
+// Non-resident $DATA attribute, one part of the run list of a stream
+struct data_attr {
+  uint64_t owner;
+  uint64_t base_ref; // base reference of the extension record holding it, 0: base record
+  bool in_use;       // record holding it is in use
+  uint64_t vcn;   // first cluster of this part
+  uint64_t size;  // data size, valid in the part of vcn 0
+  uint64_t init;  // initialized size, too
+  vector<ntfs_run> runs;
+};
+
+NtfsImage::NtfsImage() {
+  mft_size = 0;
+  cluster_size = 0;
+  size = 0;
+  valid_size = 0;
+  data_begin = 0;
+  allocated = 0;
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Decode mapping pairs from p to end, runs start at cluster vcn
+// return: -1 if a pair is broken
+static int decode_runs(const unsigned char *p, const unsigned char *end, uint64_t vcn, vector<ntfs_run> *runs) {
+  uint64_t lcn = 0;
+  while (p < end && *p != 0) {
+    int len_bytes = *p & 0x0F;
+    int off_bytes = *p >> 4;
+    p++;
+    if (len_bytes == 0 || len_bytes > 8 || off_bytes > 8 || p + len_bytes + off_bytes > end)
+      return -1;
+    ntfs_run r;
+    r.vcn = vcn;
+    r.len = 0;
+    for (int i = 0; i < len_bytes; i++)
+      r.len |= uint64_t(p[i]) << (8 * i);
+    p += len_bytes;
+    if (off_bytes == 0)
+      r.lcn = NTFS_SPARSE;
+    else {
+      // signed offset from the previous run
+      uint64_t delta = 0;
+      for (int i = 0; i < off_bytes; i++)
+        delta |= uint64_t(p[i]) << (8 * i);
+      if (off_bytes < 8 && (p[off_bytes - 1] & 0x80))
+        delta |= ~0ULL << (8 * off_bytes);
+      lcn += delta;
+      r.lcn = lcn;
+      p += off_bytes;
+    }
+    runs->push_back(r);
+    vcn += r.len;
+  }
+  return 0;
+}
+
+static int parse_data(const unsigned char *a, uint32_t len, data_attr *d) {
+  if (len < 0x40)
+    return -1;
+  d->vcn = get_u64(a + 0x10);
+  d->size = get_u64(a + 0x30);
+  d->init = get_u64(a + 0x38);
+  uint16_t runs_offset = get_u16(a + 0x20);
+  if (runs_offset >= len)
+    return -1;
+  return decode_runs(a + runs_offset, a + len, d->vcn, &d->runs);
+}
+
+// Attribute name equals ASCII name ("" for unnamed)
+static bool attr_named(const unsigned char *a, uint32_t len, const char *name) {
+  uint8_t name_len = a[0x09];
+  uint16_t name_offset = get_u16(a + 0x0A);
+  if (size_t(name_len) != strlen(name) || name_offset + name_len * 2u > len)
+    return false;
+  for (uint8_t i = 0; i < name_len; i++)
+    if (a[name_offset + i * 2] != (unsigned char)name[i] || a[name_offset + i * 2 + 1] != 0)
+      return false;
+  return true;
+}
+
+// Read n bytes at pos of the stream of runs, bytes of sparse or unmapped
+// clusters and after valid are zeros
+// return: -1 on read error
+int64_t NtfsImage::ReadStream(FILE *fp, const vector<ntfs_run> &stream, uint64_t valid, uint64_t pos, char *buf, size_t n) const {
+  size_t done = 0;
+  while (done < n) {
+    uint64_t p = pos + done;
+    uint64_t vcn = p / cluster_size;
+    auto itr = upper_bound(stream.begin(), stream.end(), vcn, [](uint64_t a, const ntfs_run &b) { return a < b.vcn; });
+    size_t k = n - done;
+    if (itr != stream.begin() && vcn < (itr - 1)->vcn + (itr - 1)->len) {
+      const ntfs_run &r = *(itr - 1);
+      k = min(uint64_t(k), (r.vcn + r.len) * cluster_size - p);
+      if (p < valid)
+        k = min(uint64_t(k), valid - p);
+      if (p >= valid || r.lcn == NTFS_SPARSE)
+        memset(buf + done, 0, k);
+      else if (fseeko64(fp, r.lcn * cluster_size + (p - r.vcn * cluster_size), SEEK_SET) != 0
+        || fread(buf + done, 1, k, fp) != k) {
+        if (errno == 0)
+          errno = EIO;
+        return -1;
+      }
+    } else {
+      if (itr != stream.end())
+        k = min(uint64_t(k), itr->vcn * cluster_size - p);
+      memset(buf + done, 0, k);
+    }
+    done += k;
+  }
+  return done;
+}
+
+// Read $J at pos, fp is the image (one per thread)
+int64_t NtfsImage::ReadAt(FILE *fp, uint64_t pos, char *buf, size_t n) const {
+  if (pos >= size)
+    return 0;
+  n = min(uint64_t(n), size - pos);
+  return ReadStream(fp, runs, valid_size, pos, buf, n);
+}
+
+// Load $MFT of image fname and find $UsnJrnl:$J
+// return: -1 on error
+int NtfsImage::Open(const char *fname) {
+  FILE *fp;
+  if ((fp = fopen(fname, "rb")) == NULL) {
+    perror("NTFS Image Error");
+    return -1;
+  }
+
+  unsigned char boot[512];
+  uint32_t record_size = 0;
+  if (fread(boot, 1, sizeof(boot), fp) == sizeof(boot) && memcmp(boot + 3, "NTFS    ", 8) == 0) {
+    uint16_t sector_size = get_u16(boot + 0x0B);
+    uint8_t sectors = boot[0x0D];
+    int8_t clusters = (int8_t)boot[0x40];
+    cluster_size = sectors <= 0x80 ? sector_size * sectors : 1U << (256 - sectors);
+    record_size = clusters > 0 ? clusters * cluster_size : 1U << -clusters;
+  }
+  if (cluster_size == 0 || (cluster_size & (cluster_size - 1)) != 0
+    || record_size < 256 || record_size > 65536 || (record_size & (record_size - 1)) != 0) {
+    fprintf(stderr, "NTFS Image Error: %s is not an NTFS volume\n", fname);
+    fclose(fp);
+    return -1;
+  }
+
+  // record 0 ($MFT) maps the rest of $MFT
+  vector<data_attr> parts;
+  vector<unsigned char> buf(MFT_READ_SIZE);
+  MftIndex boot_mft;
+  boot_mft.record_size = record_size;
+  boot_mft.on_data = [&parts](uint64_t owner, uint64_t, bool, const unsigned char *a, uint32_t len) {
+    data_attr d;
+    if (owner == 0 && attr_named(a, len, "") && parse_data(a, len, &d) == 0 && d.vcn == 0)
+      parts.push_back(d);
+  };
+  if (fseeko64(fp, get_u64(boot + 0x30) * cluster_size, SEEK_SET) != 0
+    || fread(&buf[0], 1, record_size, fp) != record_size
+    || boot_mft.ParseRecord(&buf[0], 0) < 0 || parts.empty()) {
+    fprintf(stderr, "NTFS Image Error: $MFT of %s is broken\n", fname);
+    fclose(fp);
+    return -1;
+  }
+  mft_runs = parts[0].runs;
+  mft_size = parts[0].size;
+
+  // runs of a fragmented $MFT continue in extension records, which come
+  // before the clusters they map
+  parts.clear();
+  mft.record_size = record_size;
+  mft.on_data = [this, &parts](uint64_t owner, uint64_t base_ref, bool in_use, const unsigned char *a, uint32_t len) {
+    data_attr d;
+    if (parse_data(a, len, &d) < 0)
+      return;
+    d.owner = owner;
+    d.base_ref = base_ref;
+    d.in_use = in_use;
+    if (owner == 0 && attr_named(a, len, "")) {
+      if (d.vcn == mft_runs.back().vcn + mft_runs.back().len)
+        mft_runs.insert(mft_runs.end(), d.runs.begin(), d.runs.end());
+    } else if (attr_named(a, len, "$J"))
+      parts.push_back(d);
+  };
+  for (uint64_t pos = 0; pos < mft_size; pos += MFT_READ_SIZE) {
+    size_t n = min(uint64_t(MFT_READ_SIZE), mft_size - pos);
+    if (ReadStream(fp, mft_runs, mft_size, pos, (char*)&buf[0], n) < 0) {
+      perror("NTFS Image Error");
+      fclose(fp);
+      return -1;
+    }
+    mft.LoadRecords(&buf[0], n, pos / record_size);
+  }
+  mft.on_data = nullptr;
+  fclose(fp);
+
+  // an old $UsnJrnl may remain in a free record, and a freed extension
+  // record may still name a base record that was reused since
+  stable_sort(parts.begin(), parts.end(), [](const data_attr &a, const data_attr &b) { return a.vcn < b.vcn; });
+  bool found = false;
+  for (auto &d: parts) {
+    string path;
+    if (!mft.InUse(d.owner) || !mft.GetPath(d.owner, &path) || path != USNJRNL_PATH)
+      continue;
+    if (d.base_ref != 0 && (!d.in_use || !mft.InUse(d.owner, uint16_t(d.base_ref >> 48))))
+      continue;
+    if (d.vcn == 0) {
+      size = d.size;
+      valid_size = d.init;
+      found = true;
+    }
+    runs.insert(runs.end(), d.runs.begin(), d.runs.end());
+  }
+  if (!found) {
+    fprintf(stderr, "NTFS Image Error: $Extend\\$UsnJrnl:$J not found in %s\n", fname);
+    return -1;
+  }
+
+  data_begin = size;
+  for (auto &r: runs) {
+    if (r.lcn == NTFS_SPARSE)
+      continue;
+    allocated += r.len * cluster_size;
+    data_begin = min(data_begin, r.vcn * cluster_size);
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "perfcounters.h"
+
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+  #include <unistd.h>
+  #include <sys/syscall.h>
+  #include <linux/perf_event.h>
+#endif
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    fd[i] = -1;
+    available[i] = false;
+  }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTERS; i++)
+    if (fd[i] >= 0)
+      close(fd[i]);
+#endif
+}
+
+// Open every counter which is supported
+// return: false if none is available
+bool PerfCounters::Open() {
+#ifdef __linux__
+  static const uint64_t config[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  bool any = false;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.inherit = 1;        // include worker threads
+    attr.exclude_kernel = 1; // allowed with perf_event_paranoid 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd[i] < 0) {
+      error = strerror(errno);
+      continue;
+    }
+    available[i] = true;
+    any = true;
+  }
+  return any;
+#else
+  error = "not supported on this platform";
+  return false;
+#endif
+}
+
+// Current values, v has PERF_COUNTERS elements
+// Counts are scaled when the kernel multiplexed counters.
+void PerfCounters::Read(uint64_t *v) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    v[i] = 0;
+#ifdef __linux__
+    if (!available[i])
+      continue;
+    uint64_t r[3]; // value, time enabled, time running
+    if (read(fd[i], r, sizeof(r)) != sizeof(r) || r[2] == 0)
+      continue;
+    v[i] = r[2] < r[1] ? uint64_t(double(r[0]) * r[1] / r[2]) : r[0];
+#endif
+  }
+}
@@ -0,0 +1,197 @@
+#include "progress.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <csignal>
+#ifdef _WIN32
+  #include <io.h>
+#else
+  #include <unistd.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+#endif
+
+static double now_sec() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Progress::Progress() {
+  fd = -1;
+  is_socket = false;
+  interval_ms = 1000;
+  stop = false;
+}
+
+Progress::~Progress() {
+  Close();
+}
+
+// Open channel and start reporting
+// target: file descriptor number (inherited from the caller) or path of a Unix socket
+// return: -1 if the channel can not be opened
+int Progress::Open(const char *target, uint32_t interval) {
+  char *end;
+  long n = strtol(target, &end, 10);
+
+  interval_ms = interval > 0 ? interval : 1000;
+  if (*target != '\0' && *end == '\0') {
+    fd = int(n);
+  } else {
+#ifdef _WIN32
+    fprintf(stderr, "Progress Error: Unix socket is not supported\n");
+    return -1;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(target) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Progress Error: socket path too long\n");
+      return -1;
+    }
+    strcpy(addr.sun_path, target);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      perror("Progress Error");
+      return -1;
+    }
+    is_socket = true;
+#endif
+  }
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN); // a reader going away must not kill the run
+#endif
+  reporter = thread(&Progress::Report, this);
+  return 0;
+}
+
+// Stop reporter after a last report
+void Progress::Close() {
+  if (!reporter.joinable())
+    return;
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  reporter.join();
+#ifndef _WIN32
+  if (is_socket)
+    close(fd);
+#endif
+  fd = -1;
+}
+
+// Register an input, bytes_total is its size
+progress_task *Progress::Add(const string &input, uint64_t bytes_total) {
+  progress_task *t = new progress_task();
+  t->owner = this;
+  t->input = input;
+  t->stage = "start";
+  t->task_begin = t->stage_begin = now_sec();
+  t->bytes = 0;
+  t->bytes_total = bytes_total;
+  t->records = 0;
+  t->records_total = 0;
+  lock_guard<mutex> lock(m);
+  tasks.push_back(t);
+  return t;
+}
+
+// Report input as finished (with the next report) and forget it
+void Progress::Remove(progress_task *t) {
+  lock_guard<mutex> lock(m);
+  t->stage = "finished";
+  t->stage_begin = t->task_begin;
+  t->bytes = t->bytes_total;
+  t->records = 0;
+  t->records_total = 0;
+  finished += Format(t, now_sec());
+  tasks.remove(t);
+  delete t;
+}
+
+// Start a stage, records_total is the number of records it will process
+// (0: stage progress is measured in bytes)
+void Progress::Stage(progress_task *t, const char *name, uint64_t records_total) {
+  lock_guard<mutex> lock(m);
+  t->stage = name;
+  t->stage_begin = now_sec();
+  t->bytes = 0;
+  t->records = 0;
+  t->records_total = records_total;
+}
+
+// Write lines, reporting stops for good if the reader has gone
+// (reporter thread only)
+void Progress::WriteLine(const string &line) {
+  if (fd < 0)
+    return;
+  const char *p = line.data();
+  size_t left = line.size();
+  while (left > 0) {
+#ifdef _WIN32
+    long n = _write(fd, p, left);
+#else
+    long n = is_socket ? send(fd, p, left, MSG_NOSIGNAL) : write(fd, p, left);
+#endif
+    if (n <= 0) {
+      fd = -1;
+      return;
+    }
+    p += n;
+    left -= n;
+  }
+}
+
+// {"time", "input", "stage", "elapsed_sec", "stage_sec", "bytes", "bytes_total", "records",
+//  "records_total", "percent", "bytes_per_sec", "records_per_sec", "eta_sec"}, caller holds m
+string Progress::Format(progress_task *t, double now) {
+  char head[64], tail[512];
+  double stage_sec = now - t->stage_begin;
+  uint64_t bytes = t->bytes.load(memory_order_relaxed);
+  uint64_t records = t->records.load(memory_order_relaxed);
+  uint64_t records_total = t->records_total.load(memory_order_relaxed);
+  double bps = stage_sec > 0 ? bytes / stage_sec : 0;
+  double rps = stage_sec > 0 ? records / stage_sec : 0;
+
+  // records when the stage knows how many, else bytes
+  uint64_t done = records_total > 0 ? records : bytes;
+  uint64_t total = records_total > 0 ? records_total : t->bytes_total;
+  double rate = records_total > 0 ? rps : bps;
+  double percent = t->stage == "finished" ? 100.0 : (total > 0 ? 100.0 * done / total : 0);
+  string eta = "null";
+  if (t->stage == "finished")
+    eta = "0";
+  else if (rate > 0 && total >= done)
+    eta = to_string(uint64_t((total - done) / rate + 0.5));
+
+  uint64_t unix_ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  snprintf(head, sizeof(head), "{\"time\": %llu.%03llu, \"input\": ", unix_ms / 1000, unix_ms % 1000);
+  snprintf(tail, sizeof(tail), ", \"stage\": %s, \"elapsed_sec\": %.1f, \"stage_sec\": %.1f, "
+    "\"bytes\": %llu, \"bytes_total\": %llu, \"records\": %llu, \"records_total\": %llu, \"percent\": %.1f, "
+    "\"bytes_per_sec\": %.0f, \"records_per_sec\": %.0f, \"eta_sec\": %s}\n",
+    json_str(t->stage).c_str(), now - t->task_begin, stage_sec,
+    bytes, t->bytes_total, records, records_total, percent, bps, rps, eta.c_str());
+  return head + json_str(t->input) + tail;
+}
+
+// Every interval (and once more when closed) format lines under the lock
+// and write them after releasing it
+void Progress::Report() {
+  unique_lock<mutex> lock(m);
+  bool last = false;
+  while (!last) {
+    last = cv.wait_for(lock, chrono::milliseconds(interval_ms), [this] { return stop; });
+    double now = now_sec();
+    string lines;
+    lines.swap(finished);
+    for (auto t: tasks)
+      lines += Format(t, now);
+    lock.unlock();
+    if (lines.size() > 0)
+      WriteLine(lines);
+    lock.lock();
+  }
+}
@@ -0,0 +1,184 @@
+#include "recordfilter.h"
+#include "usnrecord.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const struct {
+  const char *name;
+  uint32_t flag;
+} reason_names[] = {
+  {"CREATE", CREATE}, {"EXTEND", EXTEND}, {"OVERWRITE", OVERWRITE}, {"TRUNC", TRUNC},
+  {"DELETE", DELETE}, {"OLDNAME", OLDNAME}, {"NEWNAME", NEWNAME}, {"INFO", INFO},
+  {"SECURITY", SECURITY}, {"OBJECTID", OBJECTID}, {"EA", EA}, {"COMPRESS", COMPRESS},
+  {"ENCRYPT", ENCRYPT}, {"LINK", LINK}, {"INDEX", INDEX}, {"REPARSE", REPARSE},
+  {"STREAM", STREAM}, {"NAMED_O", NAMED_O}, {"NAMED_E", NAMED_E}, {"NAMED_T", NAMED_T},
+  {"TRANSACT", TRANSACT}, {"INTEGRITY", INTEGRITY}, {"RENAME", RENAME}, {"MOVE", MOVE},
+  {"CLOSE", CLOSE}
+};
+
+RecordFilter::RecordFilter() {
+  ts_from = 0;
+  ts_to = UINT64_MAX;
+  usn_from = 0;
+  usn_to = UINT64_MAX;
+  reason_mask = 0;
+  margin = true;
+}
+
+// --from: records at or after the time
+int RecordFilter::SetFrom(const char *s, bool lt) {
+  uint64_t unit;
+  if (parse_time(s, lt, &ts_from, &unit) < 0)
+    return -1;
+  description += string(" from ") + s;
+  return 0;
+}
+
+// --to: records up to the end of the time at its precision (a date includes the whole day)
+int RecordFilter::SetTo(const char *s, bool lt) {
+  uint64_t unit;
+  if (parse_time(s, lt, &ts_to, &unit) < 0)
+    return -1;
+  ts_to += unit - 1;
+  description += string(" to ") + s;
+  return 0;
+}
+
+// --usn-range: "from-to", either side may be omitted, decimal or 0x hex
+int RecordFilter::SetUsnRange(const char *s) {
+  char *end;
+  const char *p = s;
+  if (*p != '-') {
+    usn_from = strtoull(p, &end, 0);
+    if (end == p)
+      return -1;
+    p = end;
+  }
+  if (*p != '-')
+    return -1;
+  p++;
+  if (*p != '\0') {
+    usn_to = strtoull(p, &end, 0);
+    if (*end != '\0')
+      return -1;
+  }
+  if (usn_from > usn_to)
+    return -1;
+  description += string(" usn ") + s;
+  return 0;
+}
+
+// --reason-mask: reason names as in output joined with '|' or ',', or a number
+int RecordFilter::SetReasonMask(const char *s) {
+  char *end;
+  if (*s >= '0' && *s <= '9') {
+    reason_mask |= strtoul(s, &end, 0);
+    if (*end != '\0')
+      return -1;
+  } else {
+    string str(s);
+    size_t begin = 0;
+    while (begin <= str.size()) {
+      size_t pos = str.find_first_of("|,", begin);
+      if (pos == string::npos)
+        pos = str.size();
+      string token = str.substr(begin, pos - begin);
+      transform(token.begin(), token.end(), token.begin(), ::toupper);
+      size_t i;
+      for (i = 0; i < sizeof(reason_names) / sizeof(reason_names[0]); i++) {
+        if (token == reason_names[i].name)
+          break;
+      }
+      if (i == sizeof(reason_names) / sizeof(reason_names[0]))
+        return -1;
+      reason_mask |= reason_names[i].flag;
+      begin = pos + 1;
+    }
+  }
+  if (reason_mask == 0)
+    return -1;
+  description += string(" reason ") + s;
+  return 0;
+}
+
+// --name: case-insensitive glob (* and ?), several are or-ed
+void RecordFilter::AddName(const char *s) {
+  string glob(s);
+  transform(glob.begin(), glob.end(), glob.begin(), ::tolower);
+  names.push_back(glob);
+  description += string(" name ") + s;
+}
+
+bool RecordFilter::Active() const {
+  return ts_from > 0 || ts_to < UINT64_MAX || usn_from > 0 || usn_to < UINT64_MAX
+    || reason_mask != 0 || !names.empty();
+}
+
+// Glob match of lower case pattern, backtracking to the last '*'
+static bool glob_match(const string &glob, const string &name) {
+  size_t g = 0, n = 0, star = string::npos, mark = 0;
+  while (n < name.size()) {
+    if (g < glob.size() && (glob[g] == '?' || glob[g] == (char)tolower((unsigned char)name[n]))) {
+      g++;
+      n++;
+    } else if (g < glob.size() && glob[g] == '*') {
+      star = g++;
+      mark = n;
+    } else if (star != string::npos) {
+      g = star + 1;
+      n = ++mark;
+    } else
+      return false;
+  }
+  while (g < glob.size() && glob[g] == '*')
+    g++;
+  return g == glob.size();
+}
+
+// Name of a packed rename is "old -> new", either side or the whole matches
+bool RecordFilter::MatchName(const string &name) const {
+  size_t pos = name.find(" -> ");
+  for (auto &glob: names) {
+    if (glob_match(glob, name))
+      return true;
+    if (pos != string::npos && (glob_match(glob, name.substr(0, pos)) || glob_match(glob, name.substr(pos + 4))))
+      return true;
+  }
+  return false;
+}
+
+// Scanner side check of a record header, before its name is decoded
+// With margin, every record of a pack zone which the window touches passes.
+// Reasons are not checked, a record without them may still be packed into a
+// record which has them.
+bool RecordFilter::MatchHeader(uint64_t usn, uint64_t ts, uint32_t reasons, uint32_t attrs) const {
+  if (!margin) {
+    if (reason_mask != 0 && !(reasons & reason_mask))
+      return false;
+    return ts >= ts_from && ts <= ts_to && usn >= usn_from && usn <= usn_to;
+  }
+  if (attrs & FOLDER)
+    return true;
+  if (ts / PACK_ZONE_TS < ts_from / PACK_ZONE_TS || ts / PACK_ZONE_TS > ts_to / PACK_ZONE_TS)
+    return false;
+  if (usn / PACK_ZONE_USN < usn_from / PACK_ZONE_USN || usn / PACK_ZONE_USN > usn_to / PACK_ZONE_USN)
+    return false;
+  return true;
+}
+
+// Exact check of a packed (or raw) record
+bool RecordFilter::Match(uint64_t usn, uint64_t ts, uint32_t reasons, const string &name) const {
+  if (ts < ts_from || ts > ts_to || usn < usn_from || usn > usn_to)
+    return false;
+  if (reason_mask != 0 && !(reasons & reason_mask))
+    return false;
+  if (!names.empty() && !MatchName(name))
+    return false;
+  return true;
+}
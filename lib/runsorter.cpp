@@ -0,0 +1,147 @@
+#include "runsorter.h"
+#include "utils.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
+
+// prefix: path prefix of temporary files, budget: bytes for pairs in memory
+RunSorter::RunSorter(const string &_prefix, uint64_t budget) {
+  prefix = _prefix;
+  run_limit = max(budget / sizeof(usn_pair), uint64_t(RUN_READ_PAIRS));
+  pairs = NULL;
+  num = 0;
+  map = NULL;
+  map_size = 0;
+  hits = 0;
+  buf.reserve(run_limit);
+}
+
+RunSorter::~RunSorter() {
+#ifndef _WIN32
+  if (map != NULL)
+    munmap(map, map_size);
+#endif
+  for (auto &x: runs)
+    remove(x.c_str());
+  if (!merged_fname.empty())
+    remove(merged_fname.c_str());
+}
+
+void RunSorter::Add(uint64_t usn, uint64_t offset) {
+  usn_pair p;
+  p.usn = usn;
+  p.offset = offset;
+  buf.push_back(p);
+  hits++;
+  if (buf.size() >= run_limit)
+    Spill();
+}
+
+// Sort buffered pairs and write them as a run, keeping the last pair of a usn
+void RunSorter::Spill() {
+  FILE *fp;
+  string fname = prefix + "-" + to_string(runs.size()) + ".tmp";
+
+  if ((fp = fopen(fname.c_str(), "wb")) == NULL)
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  runs.push_back(fname);
+  stable_sort(buf.begin(), buf.end(), [](const usn_pair &a, const usn_pair &b) { return a.usn < b.usn; });
+  for (size_t i = 0; i < buf.size(); i++) {
+    if (i+1 < buf.size() && buf[i+1].usn == buf[i].usn)
+      continue;
+    write_u64(fp, buf[i].usn);
+    write_u64(fp, buf[i].offset);
+  }
+  if (ferror(fp))
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  fclose(fp);
+  buf.clear();
+}
+
+// Merge runs into one file of unique usns and map it
+// A usn in several runs takes the pair of the latest run.
+int RunSorter::Merge() {
+  struct run_reader {
+    FILE *fp;
+    vector<usn_pair> data;
+    size_t pos;
+    bool Next() {
+      if (++pos < data.size())
+        return true;
+      data.resize(RUN_READ_PAIRS);
+      data.resize(fread(&data[0], sizeof(usn_pair), RUN_READ_PAIRS, fp));
+      pos = 0;
+      return !data.empty();
+    }
+  };
+  typedef pair<uint64_t, int64_t> heap_key; // usn, -run (latest run first)
+
+  Spill();
+  vector<usn_pair>().swap(buf);
+  vector<run_reader> readers(runs.size());
+  priority_queue<heap_key, vector<heap_key>, greater<heap_key> > heap;
+  for (size_t r = 0; r < runs.size(); r++) {
+    if ((readers[r].fp = fopen(runs[r].c_str(), "rb")) == NULL)
+      fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+    readers[r].pos = 0;
+    if (readers[r].Next())
+      heap.push(make_pair(readers[r].data[0].usn, -int64_t(r)));
+  }
+
+  FILE *fp;
+  merged_fname = prefix + "-merged.tmp";
+  if ((fp = fopen(merged_fname.c_str(), "wb")) == NULL)
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  uint64_t last = 0;
+  num = 0;
+  while (!heap.empty()) {
+    heap_key k = heap.top();
+    heap.pop();
+    run_reader &rd = readers[-k.second];
+    if (num == 0 || k.first != last) {
+      write_u64(fp, k.first);
+      write_u64(fp, rd.data[rd.pos].offset);
+      last = k.first;
+      num++;
+    }
+    if (rd.Next())
+      heap.push(make_pair(rd.data[rd.pos].usn, k.second));
+  }
+  for (size_t r = 0; r < runs.size(); r++) {
+    fclose(readers[r].fp);
+    remove(runs[r].c_str());
+  }
+  runs.clear();
+  if (ferror(fp))
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  fclose(fp);
+
+  map_size = num * RUN_PAIR_SIZE;
+#ifdef _WIN32
+  body.resize(num * 2);
+  fp = fopen(merged_fname.c_str(), "rb");
+  if (fp == NULL || (num > 0 && fread(&body[0], RUN_PAIR_SIZE, num, fp) != num))
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  fclose(fp);
+  pairs = body.empty() ? NULL : &body[0];
+#else
+  if (num > 0) {
+    fp = fopen(merged_fname.c_str(), "rb");
+    map = fp == NULL ? MAP_FAILED : mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+      fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+    fclose(fp);
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    pairs = (const uint64_t*)map;
+  }
+  // mapping stays valid without the name
+  remove(merged_fname.c_str());
+  merged_fname.clear();
+#endif
+  return 0;
+}
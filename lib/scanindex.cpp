@@ -0,0 +1,168 @@
+#include "usnjrnl.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#endif
+
+#define SCAN_INDEX_MAGIC   "USNIDX\0\0"
+#define SCAN_INDEX_VERSION 3
+#define SCAN_INDEX_READ    (4*1024*1024)
+
+// Header of usn_analytics.usnidx, followed by usn/offset pairs sorted by usn
+// and corrupt record offsets (all little endian uint64_t)
+struct scan_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t input_size;
+  uint64_t input_hash;
+  uint64_t data_begin; // input before it is not hashed (sparse head of $J)
+  uint64_t found;   // records found by scanner, duplicates included
+  uint64_t entries; // usn/offset pairs
+  uint64_t corrupt; // corrupt offsets
+};
+
+// Hash of input from data_begin, used to tell whether an index belongs to it
+// The size goes in last, so a gzip input is read once for both.
+// The sparse head of $J in an NTFS image is skipped, as the scan does.
+uint64_t UsnJrnl::GetInputHash() {
+  if(input_hash != 0)
+    return input_hash;
+
+  vector<unsigned char> buf(SCAN_INDEX_READ);
+  uint64_t h = 0;
+  size_t n;
+  fseeko64(fp_in, data_begin, SEEK_SET);
+  while((n = fread(&buf[0], 1, buf.size(), fp_in)) > 0)
+    h = hash64(h ^ ChunkIndex::Hash(&buf[0], n));
+  ResolveSize();
+  input_hash = hash64(h ^ file_size) | 1; // never 0
+  return input_hash;
+}
+
+// Memory-map index, UsnNum/UsnAt/OffsetAt read its pairs in place until
+// CloseScanIndex; corrupt offsets are copied to corrupt_offset_set
+// return: -1 if index is missing, broken or made from another input
+int UsnJrnl::LoadScanIndex(char *fname) {
+  FILE *fp;
+  scan_index_header hdr;
+
+  if((fp = fopen(fname, "rb")) == NULL) {
+    perror("Scan Index Error");
+    return -1;
+  }
+  uint64_t size = get_file_size(fname);
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, SCAN_INDEX_MAGIC, 8) != 0
+    || hdr.version != SCAN_INDEX_VERSION
+    || size != sizeof(hdr) + (hdr.entries * 2 + hdr.corrupt) * sizeof(uint64_t)) {
+    fprintf(stderr, "Scan Index Error: %s is not a scan index, ignored\n", fname);
+    fclose(fp);
+    return -1;
+  }
+  if((size_known && hdr.input_size != file_size) || hdr.data_begin != data_begin
+    || hdr.input_hash != GetInputHash() || hdr.input_size != file_size) {
+    fprintf(stderr, "Scan Index Error: %s was made from another input, ignored\n", fname);
+    fclose(fp);
+    return -1;
+  }
+
+#ifdef _WIN32
+  index_body.resize((hdr.entries * 2) + hdr.corrupt);
+  if(index_body.size() > 0 && fread(&index_body[0], sizeof(uint64_t), index_body.size(), fp) != index_body.size()) {
+    fprintf(stderr, "Scan Index Error: %s is truncated, ignored\n", fname);
+    vector<uint64_t>().swap(index_body);
+    fclose(fp);
+    return -1;
+  }
+  const uint64_t *p = index_body.empty() ? NULL : &index_body[0];
+#else
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  if(map == MAP_FAILED) {
+    perror("Scan Index Error");
+    fclose(fp);
+    return -1;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  index_map = map;
+  index_map_size = size;
+  const uint64_t *p = (const uint64_t*)((const char*)map + sizeof(hdr));
+#endif
+
+  // pairs are sorted by usn and unique, as usn_set after PreProcess
+  // (an empty body leaves p NULL, usn_set/usn_table are empty as well)
+  index_pairs = p;
+  index_entries = hdr.entries;
+  if(p != NULL)
+    corrupt_offset_set.assign(p + hdr.entries * 2, p + hdr.entries * 2 + hdr.corrupt);
+  found_num = hdr.found;
+  fclose(fp);
+  fprintf(fp_ofreport, "scan index %s loaded\n", fname);
+  return 0;
+}
+
+// Release the pairs of a loaded scan index
+void UsnJrnl::CloseScanIndex() {
+#ifndef _WIN32
+  if(index_map != NULL)
+    munmap(index_map, index_map_size);
+#endif
+  index_map = NULL;
+  index_map_size = 0;
+  vector<uint64_t>().swap(index_body);
+  index_pairs = NULL;
+  index_entries = 0;
+}
+
+// Write scan result as usn_analytics.usnidx in output directory
+int UsnJrnl::SaveScanIndex(char *odname) {
+  FILE *fp;
+  scan_index_header hdr;
+  string fname = string(odname) + SEP + "usn_analytics.usnidx";
+  string tmp = fname + ".tmp";
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SCAN_INDEX_MAGIC, 8);
+  hdr.version = SCAN_INDEX_VERSION;
+  hdr.input_size = file_size;
+  hdr.data_begin = data_begin;
+  hdr.input_hash = GetInputHash();
+  hdr.found = found_num > 0 ? found_num : usn_set.size();
+  hdr.entries = index_pairs != NULL ? index_entries : usn_table.size();
+  hdr.corrupt = corrupt_offset_set.size();
+
+  if((fp = fopen(tmp.c_str(), "wb")) == NULL) {
+    perror("Scan Index Error");
+    return -1;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  for(uint64_t i=0; i < index_entries; i++) {
+    write_u64(fp, index_pairs[i*2]);
+    write_u64(fp, index_pairs[i*2+1]);
+  }
+  for(auto &x: usn_table) {
+    write_u64(fp, x.first);
+    write_u64(fp, x.second);
+  }
+  for(auto x: corrupt_offset_set)
+    write_u64(fp, x);
+  if(ferror(fp)) {
+    perror("Scan Index Error");
+    fclose(fp);
+    remove(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  if(rename(tmp.c_str(), fname.c_str()) != 0) {
+    perror("Scan Index Error");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include "slotsketch.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// 64bit mixer (splitmix64 finalizer)
+uint64_t hash64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static bool topk_greater(const topk_entry &a, const topk_entry &b) {
+  return a.count > b.count;
+}
+
+CountMinTopK::CountMinTopK() {
+  Clear();
+}
+
+void CountMinTopK::Clear() {
+  memset(table, 0, sizeof(table));
+  heap.clear();
+}
+
+// Count key with weight and keep it if it is one of the heaviest
+void CountMinTopK::Add(uint64_t key, uint32_t weight, uint64_t usn, const string &name) {
+  uint64_t est = UINT64_MAX;
+
+  for (int d=0; d < CMS_DEPTH; d++) {
+    uint32_t *cell = &table[d][hash64(key + d * 0x632BE59BD9B4E019ULL) % CMS_WIDTH];
+    *cell += weight;
+    if (*cell < est)
+      est = *cell;
+  }
+
+  for (size_t i=0; i < heap.size(); i++) {
+    if (heap[i].key == key) {
+      heap[i].count = est;
+      heap[i].usn = usn;
+      heap[i].name = name;
+      make_heap(heap.begin(), heap.end(), topk_greater);
+      return;
+    }
+  }
+
+  topk_entry e;
+  e.key = key;
+  e.count = est;
+  e.usn = usn;
+  e.name = name;
+  if (heap.size() < TOPK_SIZE) {
+    heap.push_back(e);
+    push_heap(heap.begin(), heap.end(), topk_greater);
+  } else if (est > heap.front().count) {
+    pop_heap(heap.begin(), heap.end(), topk_greater);
+    heap.back() = e;
+    push_heap(heap.begin(), heap.end(), topk_greater);
+  }
+}
+
+// return: heavy hitters, the heaviest first
+vector<topk_entry> CountMinTopK::Top() {
+  vector<topk_entry> top = heap;
+  sort(top.begin(), top.end(), topk_greater);
+  return top;
+}
+
+HyperLogLog::HyperLogLog() {
+  Clear();
+}
+
+void HyperLogLog::Clear() {
+  memset(reg, 0, sizeof(reg));
+}
+
+void HyperLogLog::Add(uint64_t value) {
+  uint64_t h = hash64(value);
+  uint32_t idx = h >> (64 - HLL_BITS);
+  uint64_t w = (h << HLL_BITS) | (1ULL << (HLL_BITS - 1)); // guard bit bounds the rank
+  uint8_t rank = __builtin_clzll(w) + 1;
+  if (rank > reg[idx])
+    reg[idx] = rank;
+}
+
+uint64_t HyperLogLog::Estimate() {
+  const double m = 1 << HLL_BITS;
+  double sum = 0;
+  uint32_t zeros = 0;
+
+  for (uint32_t i=0; i < (1 << HLL_BITS); i++) {
+    sum += 1.0 / double(1ULL << reg[i]);
+    if (reg[i] == 0)
+      zeros++;
+  }
+  double est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  if (est <= 2.5 * m && zeros > 0) // small range correction
+    est = m * log(m / zeros);
+  return uint64_t(est + 0.5);
+}
+
+SlotSketch::SlotSketch() {
+  open = false;
+}
+
+// Start a new slot at a large USN gap then count a packed record
+void SlotSketch::Feed(uint64_t usn, uint64_t ts, uint32_t cid, uint32_t pid, uint16_t rec_cnt, const string &file_name) {
+  if (open && usn - last_usn > SLOT_USN_GAP)
+    Close();
+  if (!open) {
+    cur.usn_begin = usn;
+    cur.ts_begin = ts;
+    cur.records = 0;
+    open = true;
+  }
+  cur.usn_end = usn;
+  cur.ts_end = ts;
+  last_usn = usn;
+  Count(usn, cid, pid, rec_cnt, file_name);
+}
+
+// Count records merged into the last packed record, slot is unchanged
+void SlotSketch::Count(uint64_t usn, uint32_t cid, uint32_t pid, uint16_t rec_cnt, const string &file_name) {
+  if (!open)
+    return;
+  cur.records += rec_cnt;
+  files.Add(cid, rec_cnt, usn, file_name);
+  dirs.Add(pid, rec_cnt, usn, "");
+  file_ids.Add(cid);
+}
+
+void SlotSketch::Close() {
+  cur.distinct_files = file_ids.Estimate();
+  cur.top_files = files.Top();
+  cur.top_dirs = dirs.Top();
+  slots.push_back(cur);
+  files.Clear();
+  dirs.Clear();
+  file_ids.Clear();
+  open = false;
+}
+
+void SlotSketch::Finish() {
+  if (open)
+    Close();
+}
@@ -0,0 +1,125 @@
+#include "usnjrnl.h"
+#include "utils.h"
+
+#include <string>
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#  define ftello64 ftello
+#endif
+
+// Move scan hits so far into a RunSorter, later hits are added to it
+// usn_table already holds the last offset of every usn, so it is the first run.
+void UsnJrnl::SpillScan() {
+  runs = new RunSorter(spill_prefix, memory_budget / 2);
+  for(auto &x: usn_table)
+    runs->Add(x.first, x.second);
+  runs->hits = usn_set.size();
+  vector<uint64_t>().swap(usn_set);
+  usn_table.clear();
+}
+
+// Merge spilled runs into sorted unique usns (replaces sort/unique of usn_set)
+// Not written to report, which stays the same as without memory budget.
+void UsnJrnl::MergeRuns() {
+  runs->Merge();
+  console("%8llu records merged from disk (memory budget %llu bytes)\n", runs->Size(), memory_budget);
+}
+
+// Unique usns after PreProcess (before: records found)
+uint64_t UsnJrnl::UsnNum() {
+  if(index_pairs != NULL)
+    return index_entries;
+  return runs != NULL ? runs->Size() : usn_set.size();
+}
+
+// i-th usn in usn order after PreProcess
+uint64_t UsnJrnl::UsnAt(uint64_t i) {
+  if(index_pairs != NULL)
+    return index_pairs[i*2];
+  return runs != NULL ? runs->Usn(i) : usn_set[i];
+}
+
+// Offset of i-th usn after PreProcess
+uint64_t UsnJrnl::OffsetAt(uint64_t i) {
+  if(index_pairs != NULL)
+    return index_pairs[i*2+1];
+  if(runs != NULL)
+    return runs->Offset(i);
+  return fp_srcs.empty() ? usn_table[usn_set[i]] : src_offset[i];
+}
+
+// Move packed records except the last two (CheckRecords merges into them) to
+// main_spill. As GetAllDirName does for records in memory, their directories
+// go to dir_table first, then records outside filter are dropped.
+void UsnJrnl::SpillMain() {
+  if(usnmain_set.size() <= main_begin + 2)
+    return;
+  if(main_spill == NULL) {
+    string fname = spill_prefix + "-main.tmp";
+    if((main_spill = fopen(fname.c_str(), "w+b")) == NULL)
+      fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  }
+  uint64_t end = usnmain_set.size() - 2;
+  for(uint64_t i=main_begin; i < end; i++) {
+    UsnMain &x = usnmain_set[i];
+    AddDirRow(x);
+    if(filter != NULL && !filter->Match(x.usn, x.timestamp_i, x.reasons_i, x.file_name)) {
+      filtered_pack++;
+      continue;
+    }
+    if(main_spilled % MAIN_SPILL_STEP == 0)
+      main_spill_index.push_back(ftello64(main_spill));
+    x.Save(main_spill);
+    main_spilled++;
+  }
+  if(ferror(main_spill))
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  usnmain_set.erase(usnmain_set.begin() + main_begin, usnmain_set.begin() + end);
+  main_memory = 0;
+  for(auto &x: usnmain_set)
+    main_memory += sizeof(UsnMain) + heap_size(x.file_name) + heap_size(x.file_path);
+}
+
+// Packed records of this run, spilled ones included
+uint64_t UsnJrnl::MainNum() {
+  return main_spilled + usnmain_set.size() - main_begin;
+}
+
+// Call f with every packed record of this run in usn order, spilled ones first,
+// until it returns false. A spilled record is read into a buffer which is valid
+// during the call only (second argument true).
+void UsnJrnl::ForEachMain(function<bool(UsnMain&, bool)> f) {
+  if(main_spill != NULL) {
+    UsnMain x;
+    fflush(main_spill);
+    fseeko64(main_spill, 0, SEEK_SET);
+    for(uint64_t i=0; i < main_spilled; i++) {
+      x.Load(main_spill);
+      if(main_paths)
+        x.file_path = GetPathName(x.pid, x.pid_seq, x.usn);
+      if(!f(x, true))
+        return;
+    }
+    if(ferror(main_spill) || feof(main_spill))
+      fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  }
+  for(uint64_t i=main_begin; i < usnmain_set.size(); i++)
+    if(!f(usnmain_set[i], false))
+      return;
+}
+
+// i-th packed record of this run, a spilled one is read into buf
+const UsnMain &UsnJrnl::MainAt(uint64_t i, UsnMain *buf) {
+  if(i >= main_spilled)
+    return usnmain_set[main_begin + i - main_spilled];
+  fflush(main_spill);
+  fseeko64(main_spill, main_spill_index[i / MAIN_SPILL_STEP], SEEK_SET);
+  for(uint64_t k = i - i % MAIN_SPILL_STEP; k <= i; k++)
+    buf->Load(main_spill);
+  if(ferror(main_spill) || feof(main_spill))
+    fatal("Spill File Error", USN_ANALYTICS_E_OUTPUT);
+  if(main_paths)
+    buf->file_path = GetPathName(buf->pid, buf->pid_seq, buf->usn);
+  return *buf;
+}
@@ -0,0 +1,99 @@
+#include "threadpool.h"
+
+#include <chrono>
+
+using namespace std;
+
+static thread_local int32_t worker_index = -1; // -1 outside of pool workers
+
+WorkStealingPool::WorkStealingPool(uint32_t n) : stop(false), queued(0), next_queue(0) {
+  if (n == 0)
+    n = 1;
+  for (uint32_t i=0; i < n; i++)
+    queues.push_back(new worker_queue());
+  for (uint32_t i=0; i < n; i++)
+    workers.push_back(thread(&WorkStealingPool::WorkerLoop, this, i));
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  stop.store(true);
+  sleep_cv.notify_all();
+  for (auto &t: workers)
+    t.join();
+  for (auto q: queues)
+    delete q;
+}
+
+uint32_t WorkStealingPool::Size() {
+  return queues.size();
+}
+
+// Queue task on caller's own deque if called from a worker, else round robin
+void WorkStealingPool::Submit(TaskGroup *group, function<void()> task) {
+  uint32_t q;
+  if (worker_index >= 0)
+    q = worker_index;
+  else
+    q = next_queue.fetch_add(1) % queues.size();
+
+  group->pending.fetch_add(1);
+  {
+    lock_guard<mutex> lock(queues[q]->m);
+    queues[q]->tasks.push_back(make_pair(group, task));
+  }
+  queued.fetch_add(1);
+  sleep_cv.notify_one();
+}
+
+// Run one task from own deque or stolen from another
+// return: false if no task was found
+bool WorkStealingPool::RunOne(int32_t self) {
+  pair<TaskGroup*, function<void()> > t;
+  bool found = false;
+  uint32_t n = queues.size();
+
+  if (self >= 0) {
+    lock_guard<mutex> lock(queues[self]->m);
+    if (!queues[self]->tasks.empty()) {
+      t = queues[self]->tasks.back();
+      queues[self]->tasks.pop_back();
+      found = true;
+    }
+  }
+  for (uint32_t i=1; !found && i <= n; i++) {
+    uint32_t victim = (uint32_t(self < 0 ? 0 : self) + i) % n;
+    lock_guard<mutex> lock(queues[victim]->m);
+    if (!queues[victim]->tasks.empty()) {
+      t = queues[victim]->tasks.front();
+      queues[victim]->tasks.pop_front();
+      found = true;
+    }
+  }
+  if (!found)
+    return false;
+
+  queued.fetch_sub(1);
+  t.second();
+  t.first->pending.fetch_sub(1);
+  return true;
+}
+
+void WorkStealingPool::WorkerLoop(uint32_t self) {
+  worker_index = self;
+  while (!stop.load()) {
+    if (RunOne(self))
+      continue;
+    unique_lock<mutex> lock(sleep_m);
+    sleep_cv.wait_for(lock, chrono::milliseconds(10), [this]() {
+      return stop.load() || queued.load() > 0;
+    });
+  }
+}
+
+// Block until every task of group has finished, running queued tasks meanwhile
+void WorkStealingPool::Wait(TaskGroup *group) {
+  while (group->pending.load() > 0) {
+    if (!RunOne(worker_index))
+      this_thread::sleep_for(chrono::microseconds(200));
+  }
+}
@@ -0,0 +1,178 @@
+#include "timelinemerge.h"
+#include "utils.h"
+
+#include <cstring>
+#include <queue>
+#include <functional>
+#include <utility>
+
+TimelineMerge::~TimelineMerge() {
+  for (auto &s: sources)
+    if (s.fp != NULL)
+      fclose(s.fp);
+}
+
+// Add records csv files of output directory odname as source name
+// return: number of records csv files
+int TimelineMerge::AddSource(const string &name, const string &odname) {
+  merge_source s;
+  for (auto &f: list_dir_files(odname.c_str())) {
+    string base = get_base_name(f);
+    if (base.compare(0, strlen(RECORDS_CSV_PREFIX), RECORDS_CSV_PREFIX) == 0
+      && base.size() > 4 && base.compare(base.size() - 4, 4, ".csv") == 0)
+      s.files.push_back(f);
+  }
+  if (s.files.empty())
+    return 0;
+  s.name = name;
+  s.file = 0;
+  s.fp = NULL;
+  s.ts_begin = s.ts_end = 0;
+  s.ts = 0;
+  s.tz_offset = 0;
+  s.parsed = false;
+  s.rows = 0;
+  sources.push_back(s);
+  return s.files.size();
+}
+
+size_t TimelineMerge::Sources() {
+  return sources.size();
+}
+
+static bool read_line(FILE *fp, string *line) {
+  char buf[4096];
+  line->clear();
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    line->append(buf);
+    if (line->back() == '\n') {
+      line->pop_back();
+      return true;
+    }
+  }
+  return !line->empty();
+}
+
+// Days from 1970/01/01 to y/m/d of the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = unsigned(y - era * 400);
+  unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + int64_t(doe) - 719468;
+}
+
+// Parse "YYYY/MM/DD HH:MM:SS.ffffff" of format_datetimemicro
+// out: ts (FILETIME, as written, zone not applied)
+static bool scan_datetimemicro(const char *s, size_t len, uint64_t *ts) {
+  static const char layout[] = "0000/00/00 00:00:00.000000";
+  if (len != sizeof(layout) - 1)
+    return false;
+  uint64_t f[7] = {0};
+  int k = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (layout[i] != '0') {
+      if (s[i] != layout[i])
+        return false;
+      k++;
+    } else if (s[i] >= '0' && s[i] <= '9')
+      f[k] = f[k] * 10 + (s[i] - '0');
+    else
+      return false;
+  }
+  if (f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > 31)
+    return false;
+  int64_t sec = days_from_civil(f[0], f[1], f[2]) * 86400 + f[3] * 3600 + f[4] * 60 + f[5];
+  // 11644473600 seconds from 1601/01/01 to 1970/01/01
+  *ts = uint64_t(sec + 11644473600LL) * 10000000 + f[6] * 10;
+  return true;
+}
+
+// Read next row of source s, opening its next file at the end of one
+// return: false at the end of its last file
+bool TimelineMerge::NextRow(merge_source &s) {
+  while (true) {
+    if (s.fp == NULL) {
+      if (s.file >= s.files.size())
+        return false;
+      if ((s.fp = fopen(s.files[s.file].c_str(), "r")) == NULL) {
+        perror("Records File Error");
+        s.file++;
+        continue;
+      }
+      // "TimeStamp(+hh:mm)" tells the zone of the file
+      read_line(s.fp, &s.header);
+      size_t pos = s.header.find("TimeStamp(");
+      int tz_hour = 0, tz_min = 0;
+      if (pos != string::npos)
+        sscanf(s.header.c_str() + pos + 10, "%d:%d", &tz_hour, &tz_min);
+      s.tz_offset = (int64_t(tz_hour) * 60 + tz_min) * 60 * 10000000;
+    }
+    if (!read_line(s.fp, &s.row)) {
+      fclose(s.fp);
+      s.fp = NULL;
+      s.file++;
+      continue;
+    }
+    break;
+  }
+
+  // third field, a row which can not be parsed keeps the time of the previous one
+  size_t p = s.row.find('\t');
+  if (p != string::npos)
+    p = s.row.find('\t', p + 1);
+  size_t q = p != string::npos ? s.row.find('\t', p + 1) : string::npos;
+  uint64_t ts;
+  s.parsed = false;
+  if (q != string::npos && q - p >= 3 && s.row[p + 1] == '"' && s.row[q - 1] == '"'
+    && scan_datetimemicro(&s.row[p + 2], q - p - 3, &ts)) {
+    s.ts_begin = p + 1;
+    s.ts_end = q;
+    s.ts = ts - s.tz_offset;
+    s.parsed = true;
+  }
+  return true;
+}
+
+// Write merged rows to fp with TimeStamp in local time or UTC
+// return: number of rows
+uint64_t TimelineMerge::Write(FILE *fp, bool lt) {
+  typedef pair<uint64_t, uint32_t> entry; // time, source (ties keep source order)
+  priority_queue<entry, vector<entry>, greater<entry> > heap;
+  string header;
+  for (uint32_t i = 0; i < sources.size(); i++) {
+    if (NextRow(sources[i]))
+      heap.push(entry(sources[i].ts, i));
+    if (header.empty())
+      header = sources[i].header;
+  }
+
+  size_t pos = header.find("TimeStamp(");
+  size_t end = pos != string::npos ? header.find(')', pos) : string::npos;
+  if (end != string::npos)
+    header.replace(pos + 10, end - pos - 10, get_timezone_str(lt));
+  fprintf(fp, "\"Source\"\t%s\n", header.c_str());
+
+  char buf[32];
+  uint64_t n = 0;
+  while (!heap.empty()) {
+    merge_source &s = sources[heap.top().second];
+    uint32_t i = heap.top().second;
+    heap.pop();
+    fprintf(fp, "\"%s\"\t", s.name.c_str());
+    if (s.parsed) {
+      format_datetimemicro(s.ts, lt, buf);
+      fwrite(s.row.data(), 1, s.ts_begin, fp);
+      fprintf(fp, "\"%s\"", buf);
+      fwrite(s.row.data() + s.ts_end, 1, s.row.size() - s.ts_end, fp);
+    } else
+      fwrite(s.row.data(), 1, s.row.size(), fp);
+    fputc('\n', fp);
+    s.rows++;
+    n++;
+    if (NextRow(s))
+      heap.push(entry(s.ts, i));
+  }
+  return n;
+}
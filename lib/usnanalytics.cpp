@@ -0,0 +1,257 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include "usnanalytics.h"
+#include "utils.h"
+#include "compressedinput.h"
+#include "ntfsimage.h"
+#include "usnjrnl.h"
+
+// usnjrnl.h leaves pack(1) on for records, the handle is not an on-disk layout
+#pragma pack()
+
+// Pipeline stages done for a handle
+enum {
+  STAGE_OPENED,
+  STAGE_SORTED,  // scanned, sorted and deduplicated
+  STAGE_BUNDLED  // packed and paths resolved
+};
+
+struct usn_analytics {
+  string input;
+  string work_dir;
+  UsnJrnl *jrnl;
+  WorkStealingPool *pool;
+  MftIndex mft;
+  RecordFilter filter;
+  int stage;
+  string error;
+  UsnMain spilled; // bundled record returned by usn_analytics_bundled_get
+};
+
+static string open_error; // of usn_analytics_open failing before a handle exists
+
+// Run f with fatal() throwing, turn what it throws into an error code
+template <typename F>
+static int guard(usn_analytics *h, F f) {
+  int ret;
+  fatal_throw++;
+  try {
+    ret = f();
+  } catch (fatal_error &e) {
+    h->error = e.message;
+    ret = e.code;
+  } catch (bad_alloc&) {
+    h->error = "Out of memory";
+    ret = USN_ANALYTICS_E_MEMORY;
+  }
+  fatal_throw--;
+  return ret;
+}
+
+// Scan and sort (and pack) up to stage
+static int run_until(usn_analytics *h, int stage) {
+  UsnJrnl *j = h->jrnl;
+  if (h->stage < STAGE_SORTED && stage >= STAGE_SORTED) {
+    j->GetAllUsnOffset();
+    j->PreProcess();
+    h->stage = STAGE_SORTED;
+  }
+  if (h->stage < STAGE_BUNDLED && stage >= STAGE_BUNDLED) {
+    j->CheckRecords();
+    j->PostProcess();
+    h->stage = STAGE_BUNDLED;
+  }
+  return USN_ANALYTICS_OK;
+}
+
+static void bundled_view(const UsnMain &x, usn_analytics_record *r) {
+  r->usn = x.usn;
+  r->timestamp = x.timestamp_i;
+  r->reasons = x.reasons_i;
+  r->attributes = x.attrs_i;
+  r->file_id = x.cid;
+  r->parent_id = x.pid;
+  r->records = x.rec_cnt;
+  r->time_taken = x.time_taken;
+  r->file_name = x.file_name.c_str();
+  r->file_name_len = x.file_name.size();
+  r->path = x.file_path.c_str();
+  r->path_len = x.file_path.size();
+}
+
+void usn_analytics_options_init(usn_analytics_options *options) {
+  memset(options, 0, sizeof(*options));
+}
+
+int usn_analytics_open(const char *input, const usn_analytics_options *options, usn_analytics **handle) {
+  usn_analytics_options defaults;
+  usn_analytics *h;
+
+  *handle = NULL;
+  if (input == NULL) {
+    open_error = "No input";
+    return USN_ANALYTICS_E_ARG;
+  }
+  if (options == NULL) {
+    usn_analytics_options_init(&defaults);
+    options = &defaults;
+  }
+  // spill files are written next to the report
+  if (options->memory_budget > 0 && options->work_dir == NULL) {
+    open_error = "memory_budget needs work_dir";
+    return USN_ANALYTICS_E_ARG;
+  }
+  try {
+    h = new usn_analytics();
+  } catch (bad_alloc&) {
+    open_error = "Out of memory";
+    return USN_ANALYTICS_E_MEMORY;
+  }
+  h->input = input;
+  h->work_dir = options->work_dir != NULL ? options->work_dir : "";
+  h->jrnl = NULL;
+  h->pool = NULL;
+  h->stage = STAGE_OPENED;
+
+  // console output belongs to the command line
+  quiet = true;
+  lt = options->utc == 0;
+  int ret = guard(h, [h, options]() -> int {
+    RecordFilter &f = h->filter;
+    if ((options->from != NULL && f.SetFrom(options->from, lt) < 0)
+      || (options->to != NULL && f.SetTo(options->to, lt) < 0)
+      || (options->usn_range != NULL && f.SetUsnRange(options->usn_range) < 0)
+      || (options->reason_mask != NULL && f.SetReasonMask(options->reason_mask) < 0)) {
+      h->error = "Invalid filter";
+      return USN_ANALYTICS_E_ARG;
+    }
+    if (options->name != NULL)
+      f.AddName(options->name);
+
+    // registered before the journal opens it
+    NtfsImage *image = NULL;
+    if (options->ntfs_image && (image = open_ntfs_image(h->input.c_str())) == NULL) {
+      h->error = "NTFS Image Error: " + h->input;
+      return USN_ANALYTICS_E_INPUT;
+    }
+    h->jrnl = new UsnJrnl(&h->input[0], h->work_dir.empty() ? NULL : &h->work_dir[0]);
+    if (image != NULL) {
+      h->jrnl->scan_begin = h->jrnl->data_begin = image->data_begin;
+      h->jrnl->mft = &image->mft;
+    }
+    uint32_t threads = options->threads > 0 ? options->threads : thread::hardware_concurrency();
+    if (threads > 1) {
+      h->pool = new WorkStealingPool(threads);
+      h->jrnl->pool = h->pool;
+    }
+    h->jrnl->memory_budget = options->memory_budget;
+    if (f.Active())
+      h->jrnl->filter = &f;
+    if (options->mft != NULL) {
+      if (h->mft.Load(options->mft) < 0) {
+        h->error = string("MFT File Error: ") + options->mft;
+        return USN_ANALYTICS_E_INPUT;
+      }
+      h->jrnl->mft = &h->mft;
+    }
+    return USN_ANALYTICS_OK;
+  });
+  if (ret != USN_ANALYTICS_OK) {
+    open_error = h->error;
+    usn_analytics_close(h);
+    return ret;
+  }
+  *handle = h;
+  return USN_ANALYTICS_OK;
+}
+
+void usn_analytics_close(usn_analytics *handle) {
+  if (handle == NULL)
+    return;
+  delete handle->jrnl;
+  delete handle->pool;
+  delete handle;
+}
+
+int usn_analytics_each_decoded(usn_analytics *handle, usn_analytics_callback callback, void *ctx) {
+  if (handle == NULL || callback == NULL)
+    return USN_ANALYTICS_E_ARG;
+  return guard(handle, [handle, callback, ctx]() -> int {
+    run_until(handle, STAGE_SORTED);
+    UsnJrnl *j = handle->jrnl;
+    UsnRecord ur(j->fp_in);
+    usn_analytics_record r;
+    for (uint64_t k = 0; k < j->UsnNum(); k++) {
+      ur.ReadParseRecord(j->OffsetAt(k));
+      const USN_RECORD_V2 &u = ur.usn_record;
+      if (j->filter != NULL && !j->filter->Match(u.Usn, u.TimeStamp, u.Reason, ur.file_name))
+        continue;
+      r.usn = u.Usn;
+      r.timestamp = u.TimeStamp;
+      r.reasons = u.Reason;
+      r.attributes = u.FileAttributes;
+      r.file_id = ur.cid;
+      r.parent_id = ur.pid;
+      r.records = 1;
+      r.time_taken = 0;
+      r.file_name = ur.file_name.c_str();
+      r.file_name_len = ur.file_name.size();
+      r.path = "";
+      r.path_len = 0;
+      if (callback(&r, ctx) != 0)
+        return USN_ANALYTICS_STOPPED;
+    }
+    return USN_ANALYTICS_OK;
+  });
+}
+
+int usn_analytics_each_bundled(usn_analytics *handle, usn_analytics_callback callback, void *ctx) {
+  if (handle == NULL || callback == NULL)
+    return USN_ANALYTICS_E_ARG;
+  return guard(handle, [handle, callback, ctx]() -> int {
+    run_until(handle, STAGE_BUNDLED);
+    UsnJrnl *j = handle->jrnl;
+    usn_analytics_record r;
+    int ret = USN_ANALYTICS_OK;
+    j->ForEachMain([&](UsnMain &x, bool) -> bool {
+      bundled_view(x, &r);
+      if (callback(&r, ctx) == 0)
+        return true;
+      ret = USN_ANALYTICS_STOPPED;
+      return false;
+    });
+    return ret;
+  });
+}
+
+int usn_analytics_bundled_count(usn_analytics *handle, uint64_t *count) {
+  if (handle == NULL || count == NULL)
+    return USN_ANALYTICS_E_ARG;
+  return guard(handle, [handle, count]() -> int {
+    run_until(handle, STAGE_BUNDLED);
+    *count = handle->jrnl->MainNum();
+    return USN_ANALYTICS_OK;
+  });
+}
+
+int usn_analytics_bundled_get(usn_analytics *handle, uint64_t index, usn_analytics_record *record) {
+  if (handle == NULL || record == NULL)
+    return USN_ANALYTICS_E_ARG;
+  return guard(handle, [handle, index, record]() -> int {
+    run_until(handle, STAGE_BUNDLED);
+    UsnJrnl *j = handle->jrnl;
+    if (index >= j->MainNum()) {
+      handle->error = "Index out of range";
+      return USN_ANALYTICS_E_ARG;
+    }
+    bundled_view(j->MainAt(index, &handle->spilled), record);
+    return USN_ANALYTICS_OK;
+  });
+}
+
+const char *usn_analytics_error(const usn_analytics *handle) {
+  return handle != NULL ? handle->error.c_str() : open_error.c_str();
+}
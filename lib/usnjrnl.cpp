@@ -1,116 +1,568 @@
 #include "usnjrnl.h"
 #include "utils.h"
+#include "probes.h"
+#include "compressedinput.h"
 
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <atomic>
 #include <algorithm>
 #include <vector>
+#include <deque>
 #include <map>
 #include <iostream> // to_string
 #include <string> // to_string
+#include <thread>
+
+#ifdef __APPLE__
+#  define fseeko64 fseeko
+#  define ftello64 ftello
+#endif
 
 UsnJrnl::~UsnJrnl() {
-  fclose(fp_in);
+  if(fp_srcs.empty())
+    fclose(fp_in);
+  for(auto fp: fp_srcs)
+    fclose(fp);
   fclose(fp_ofreport);
+  delete runs;
+  CloseScanIndex();
+  if(main_spill != NULL) {
+    fclose(main_spill);
+    remove((spill_prefix + "-main.tmp").c_str());
+  }
 }
 
 UsnJrnl::UsnJrnl(char *ifname, char *odname) {
   offset = 0;
-
-  if((fp_in = fopen(ifname, "rb")) == NULL) {
-    perror("Input File Error");
-    exit(EXIT_FAILURE);
-  }
+  pool = NULL;
+  mft = NULL;
+  mft_usn = 0;
+  metrics = NULL;
+  status = NULL;
+  memory_budget = 0;
+  runs = NULL;
+  main_spill = NULL;
+  main_spilled = 0;
+  main_paths = false;
+  main_memory = 0;
+  dir_memory = 0;
+  if (odname != NULL)
+    spill_prefix = string(odname) + SEP + "usn_analytics.spill";
+  filter = NULL;
+  history = NULL;
+  dir_tree = NULL;
+  filtered_scan = 0;
+  filtered_usn = 0;
+  filtered_pack = 0;
+  current_src = 0;
+  in_fname = ifname;
+  append = resume;
+  following = false;
+  bundled_rows = 0;
+  main_begin = 0;
+  scan_begin = 0;
+  data_begin = 0;
+  resume_usn = 0;
+  packed_usn = 0;
+  packed_offset = 0;
+  input_hash = 0;
+  found_num = 0;
+  index_pairs = NULL;
+  index_entries = 0;
+  index_map = NULL;
+  index_map_size = 0;
+
+  if((fp_in = open_input(ifname)) == NULL)
+    fatal("Input File Error", USN_ANALYTICS_E_INPUT);
   
+  // library without work directory: report is discarded
   string ofreport;
-  ofreport = string(odname) + SEP + "usn_analytics_report.txt";
-  fp_ofreport = fopen(ofreport.c_str(), "w");
+  if (odname != NULL)
+    ofreport = string(odname) + SEP + "usn_analytics_report.txt";
+  else
+    ofreport = NULL_DEVICE;
+  fp_ofreport = fopen(ofreport.c_str(), resume ? "a" : "w");
       
   if(fp_ofreport == NULL ) {
-    perror("Output File Error");
-    exit(EXIT_FAILURE);
+    fclose(fp_in);
+    fatal("Output File Error", USN_ANALYTICS_E_OUTPUT);
   }
 
-  file_size = get_file_size(ifname);
-  printf("%llu bytes (%s)\n", file_size, ifname);  
-  fprintf(fp_ofreport, "%llu bytes (%s)\n", file_size, ifname);     
+  if (resume) {
+    time_t now = time(NULL);
+    fprintf(fp_ofreport, "\n[Resume] %s\n", parse_datetime((uint64_t(now) + 11644473600ULL) * 10000000, lt).c_str());
+  }
+  // a gzip input is inflated once, by the scan, which finds its size
+  file_size = 0;
+  size_known = false;
+  if (input_size_known(ifname))
+    ResolveSize();
+}
+
+// Set file_size of current input if it is not known yet (inflates a gzip
+// input to its end unless the scan did)
+void UsnJrnl::ResolveSize() {
+  if (size_known)
+    return;
+  file_size = get_input_size(fp_in);
+  size_known = true;
+  console("%llu bytes (%s)\n", file_size, in_fname.c_str());
+  fprintf(fp_ofreport, "%llu bytes (%s)\n", file_size, in_fname.c_str());
 }
 
 // Search and create usn/offset table from input
 int UsnJrnl::GetAllUsnOffset() {
-  int result;
-  uint64_t progress = file_size / 10; 
-  offset = 0;  
-    
-  while(offset <= file_size-sizeof(USN_RECORD_V2)) {
-    
-    if(offset >= progress) {
-      printf(".");
-      progress += file_size / 10;
+  if(!chunk_cache_fname.empty())
+    return GetAllUsnOffsetCached();
+  // chunks keep their hits until merged, so a memory budget needs the sequential scan
+  if(pool != NULL && pool->Size() > 1 && memory_budget == 0 && size_known && file_size >= scan_begin + 2 * SCAN_CHUNK_SIZE)
+    return GetAllUsnOffsetParallel();
+
+  // no progress dots while the size is unknown
+  uint64_t progress_step = max(file_size / 10, uint64_t(1)); // inputs of less than 10 bytes
+  uint64_t progress = progress_step;
+  offset = scan_begin;  
+
+  // stage 1 (reader thread): read input into blocks
+  // stage 2 (this thread): validate/decode records in each block
+  vector<scan_block> blocks(SCAN_BLOCKS);
+  SpscRing<scan_block*> full_queue(SCAN_BLOCKS), free_queue(SCAN_BLOCKS);
+  for(uint32_t i=0; i < SCAN_BLOCKS; i++) {
+    blocks[i].data.resize(SCAN_BLOCK_SIZE + SCAN_OVERLAP);
+    scan_block *b = &blocks[i];
+    free_queue.Push(b);
+  }
+
+  // blocks overlap so that a header starting near the end of a block is complete
+  // the input hash of the scan index is taken from the same blocks, they are the
+  // pieces GetInputHash would read if scanning starts at data_begin
+  bool hashing = input_hash == 0 && scan_begin == data_begin;
+  bool known = size_known;
+  thread reader([&]() {
+    uint64_t base = scan_begin;
+    uint64_t h = 0;
+    scan_block *b;
+    while((base < file_size || !known) && free_queue.Pop(b)) {
+      b->base = base;
+      fseeko64(fp_in, base, SEEK_SET);
+      b->len = fread(&(b->data[0]), 1, SCAN_BLOCK_SIZE + SCAN_OVERLAP, fp_in);
+      if(hashing && b->len > 0) {
+        h = hash64(h ^ ChunkIndex::Hash(&(b->data[0]), min(b->len, uint64_t(SCAN_BLOCK_SIZE))));
+        if(b->len > SCAN_BLOCK_SIZE && b->len < SCAN_BLOCK_SIZE + SCAN_OVERLAP) // last piece
+          h = hash64(h ^ ChunkIndex::Hash(&(b->data[SCAN_BLOCK_SIZE]), b->len - SCAN_BLOCK_SIZE));
+      }
+      if(b->len < SCAN_BLOCK_SIZE + SCAN_OVERLAP) {
+        if(hashing && (base + b->len == file_size || !known))
+          input_hash = hash64(h ^ (base + b->len)) | 1;
+        full_queue.Push(b);
+        break;
+      }
+      full_queue.Push(b);
+      base += SCAN_BLOCK_SIZE;
     }
+    full_queue.Close();
+  });
+  // spill errors of StoreScanHit leave while reader is running
+  StageGuard reader_guard(reader, [&]() {
+    free_queue.Cancel();
+    full_queue.Cancel();
+  });
+
+  UsnRecord ur(fp_in);
+  vector<scan_hit> hits;
+  scan_block *b;
+  while(full_queue.Pop(b)) {
+    hits.clear();
+    ScanBlock(b, b->base + SCAN_BLOCK_SIZE, &offset, &ur, &hits);
+    for(auto x: hits)
+      StoreScanHit(x);
+    free_queue.Push(b);
+    while(offset >= progress && progress < file_size) {
+      console(".");
+      progress += progress_step;
+    }
+  }
+  reader.join();
+  if(runs != NULL)
+    found_num = runs->hits;
+  console("Done\n");
+  ResolveSize();
+  return 0;
+}
 
-    UsnRecord* ur = new UsnRecord(fp_in);
-    result = ur->IsValidRecord(offset);
+// Identity of a record besides usn, same record in two inputs has same key
+static uint64_t record_key(const USN_RECORD_V2 &r) {
+  return hash64(r.FileReferenceNumber ^ hash64(r.TimeStamp ^ hash64(r.Reason)));
+}
 
+// Apply header predicates of filter to a valid record, hit stays in scan results
+// (offset/len are needed to merge chunks) but is not stored
+// return: type, FILTERED_RECORD if it is dropped
+int UsnJrnl::FilterHeader(const USN_RECORD_V2 &r, int type) {
+  if(filter == NULL || type != V2_RECORD)
+    return type;
+  if(filter->MatchHeader(r.Usn, r.TimeStamp, r.Reason, r.FileAttributes))
+    return type;
+  return FILTERED_RECORD;
+}
+
+// Validate records in block from *pos until end, *pos is advanced
+void UsnJrnl::ScanBlock(scan_block *b, uint64_t end, uint64_t *pos, UsnRecord *ur, vector<scan_hit> *hits) {
+  int result;
+  uint64_t block_end = b->base + b->len;
+  size_t found = hits->size();
+  uint64_t begin = *pos;
+  (void)found; // probe argument only
+
+  USN_PROBE2(scan__block__begin, b->base, b->len);
+  while(*pos < end && *pos + sizeof(USN_RECORD_V2) <= block_end) {
+    result = ur->IsValidRecord(&(b->data[*pos - b->base]), *pos);
     if(result == NOT_RECORD) {
-      offset += 8;
-      delete ur;
+      *pos += 8;
       continue;
-    } else if(result == V2_RECORD) {
-	    usn_set.push_back(ur->usn_record.Usn);
-	    usn_table[ur->usn_record.Usn] = offset;
-	  } else if(result == CORRUPT_RECORD) {
-      corrupt_offset_set.push_back(offset);
-    } else if (result == V3_RECORD) {
-      printf("USN_RECORD_V3 found at offset %lld, skip\n", offset);
-	  } else if (result == V4_RECORD) {
-      printf("USN_RECORD_V4 found at offset %lld, skip\n", offset);
-	  } 
-	  offset += ur->usn_record.RecordLength;
-    delete ur;
-  }
-  printf("Done\n");
+    }
+    scan_hit h;
+    h.offset = *pos;
+    h.usn = ur->usn_record.Usn;
+    h.len = ur->usn_record.RecordLength;
+    h.type = FilterHeader(ur->usn_record, result);
+    h.key = record_key(ur->usn_record);
+    hits->push_back(h);
+    *pos += ur->usn_record.RecordLength;
+  }
+  USN_PROBE2(scan__block__end, b->base, hits->size() - found);
+  if (status != NULL)
+    status->bytes.fetch_add(*pos - begin, memory_order_relaxed);
+}
+
+// Scan [begin, end) of input with fp, a record starting before end is completed
+// out: piece_hashes (if not NULL, hash of every block_size piece of [begin, end))
+// return: offset where scanning stopped
+uint64_t UsnJrnl::ScanRange(FILE *fp, uint64_t begin, uint64_t end, vector<scan_hit> *hits, vector<uint64_t> *piece_hashes) {
+  scan_block b;
+  uint64_t pos = begin;
+  uint64_t block_size = min(uint64_t(SCAN_BLOCK_SIZE), end - begin); // small ranges of chunk cache
+  UsnRecord ur(fp);
+
+  // blocks stay aligned to begin, a record is at most SCAN_OVERLAP past the last one
+  b.data.resize(block_size + SCAN_OVERLAP);
+  for(b.base = begin; b.base < end; b.base += block_size) {
+    fseeko64(fp, b.base, SEEK_SET);
+    b.len = fread(&(b.data[0]), 1, block_size + SCAN_OVERLAP, fp);
+    if(piece_hashes != NULL)
+      piece_hashes->push_back(ChunkIndex::Hash(&(b.data[0]), min(b.len, min(block_size, end - b.base))));
+    ScanBlock(&b, min(end, b.base + block_size), &pos, &ur, hits);
+    if(b.len < block_size + SCAN_OVERLAP)
+      break;
+  }
+  return pos;
+}
+
+// Store a record found by scanner
+void UsnJrnl::StoreScanHit(const scan_hit &h) {
+  if(h.type == V2_RECORD && append && h.usn <= resume_usn) // processed by previous run/pass
+    return;
+  if(h.type == V2_RECORD && !fp_srcs.empty()) {
+    // across inputs a record (usn, file reference, timestamp, reason) is kept once,
+    // duplicates within one input as usual
+    source_stat &st = src_stats[current_src];
+    uint64_t off = (uint64_t(current_src) << SOURCE_SHIFT) | h.offset;
+    auto itr = src_table.lower_bound(make_pair(h.usn, uint64_t(0)));
+    bool seen = false; // usn is in an earlier input
+    st.found++;
+    for(; itr != src_table.end() && itr->first.first == h.usn; itr++) {
+      if((itr->second >> SOURCE_SHIFT) == current_src)
+        continue;
+      if(itr->first.second == h.key) {
+        st.overlap++;
+        return;
+      }
+      seen = true;
+    }
+    auto ins = src_table.insert(make_pair(make_pair(h.usn, h.key), off));
+    if(!ins.second)
+      ins.first->second = off; // duplicate within input
+    else if(seen)
+      st.conflict++; // e.g. journal recreated, records of both inputs are kept
+    else
+      st.unique++;
+  } else if(h.type == V2_RECORD) {
+    if(runs != NULL) {
+      runs->Add(h.usn, h.offset);
+      return;
+    }
+    usn_set.push_back(h.usn);
+    usn_table[h.usn] = h.offset;
+    if(memory_budget > 0 && usn_set.size() * SCAN_HIT_MEMORY >= memory_budget / 2)
+      SpillScan();
+  } else if(h.type == CORRUPT_RECORD) {
+    corrupt_offset_set.push_back(h.offset);
+  } else if(h.type == FILTERED_RECORD) {
+    filtered_scan++;
+    if(h.usn > filtered_usn)
+      filtered_usn = h.usn;
+  } else if (h.type == V3_RECORD) {
+    console("USN_RECORD_V3 found at offset %lld, skip\n", h.offset);
+  } else if (h.type == V4_RECORD) {
+    console("USN_RECORD_V4 found at offset %lld, skip\n", h.offset);
+  } 
+}
+
+// Whether a chunk scan has examined pos (pos is not inside a record it found)
+// out: idx (first hit at or after pos)
+static bool chunk_visited(const vector<scan_hit> &hits, uint64_t pos, size_t *idx) {
+  size_t lo = 0, hi = hits.size();
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if(hits[mid].offset < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *idx = lo;
+  if(lo > 0 && hits[lo-1].offset + hits[lo-1].len > pos)
+    return false;
+  return true;
+}
+
+// Scan chunks of a large input on the thread pool then merge them in offset order
+// A chunk starts at a fixed offset which may fall inside a record found by the
+// previous chunk, so the merge scans sequentially from where the previous chunk
+// stopped until it reaches a position the chunk has also examined; from there
+// the chunk result equals a sequential scan.
+int UsnJrnl::GetAllUsnOffsetParallel() {
+  uint64_t nchunk = (file_size - scan_begin + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+  vector<vector<scan_hit> > hits(nchunk);
+  vector<uint64_t> stops(nchunk);
+  // hashes of the SCAN_BLOCK_SIZE pieces of each chunk, for the input hash of the scan index
+  bool hashing = input_hash == 0 && scan_begin == data_begin;
+  vector<vector<uint64_t> > piece_hashes(nchunk);
+  TaskGroup group;
+
+  atomic<int> open_errno(0);
+
+  for(uint64_t k=0; k < nchunk; k++) {
+    pool->Submit(&group, [this, k, hashing, &hits, &stops, &piece_hashes, &open_errno]() {
+      FILE *fp;
+      if((fp = open_input(in_fname.c_str())) == NULL) {
+        open_errno.store(errno);
+        return;
+      }
+      stops[k] = ScanRange(fp, scan_begin + k * SCAN_CHUNK_SIZE, min(uint64_t(scan_begin + (k+1) * SCAN_CHUNK_SIZE), file_size),
+        &hits[k], hashing ? &piece_hashes[k] : NULL);
+      fclose(fp);
+    });
+  }
+  pool->Wait(&group);
+  // reported by this thread, workers do not exit/throw
+  if(open_errno.load() != 0) {
+    errno = open_errno.load();
+    fatal("Input File Error", USN_ANALYTICS_E_INPUT);
+  }
+  // chunks are multiples of SCAN_BLOCK_SIZE, so pieces are those of GetInputHash
+  if(hashing) {
+    uint64_t h = 0;
+    uint64_t pieces = 0;
+    for(auto &x: piece_hashes) {
+      for(auto ph: x)
+        h = hash64(h ^ ph);
+      pieces += x.size();
+    }
+    if(pieces == (file_size - data_begin + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE)
+      input_hash = hash64(h ^ file_size) | 1;
+  }
+
+  vector<uint64_t> begins(nchunk);
+  for(uint64_t k=0; k < nchunk; k++)
+    begins[k] = scan_begin + k * SCAN_CHUNK_SIZE;
+  MergeScanChunks(begins, hits, stops);
+  console("Done\n");
+  return 0;
+}
+
+// Merge scan results of consecutive chunks starting at scan_begin in offset order
+// in: begins/hits/stops of each chunk, hits are released while merging
+void UsnJrnl::MergeScanChunks(vector<uint64_t> &begins, vector<vector<scan_hit> > &hits, vector<uint64_t> &stops) {
+  uint64_t nchunk = hits.size();
+  UsnRecord ur(fp_in);
+  uint64_t progress = nchunk / 10;
+  offset = scan_begin;
+  for(uint64_t k=0; k < nchunk; k++) {
+    size_t idx = 0;
+    while(offset < stops[k] && offset + sizeof(USN_RECORD_V2) <= file_size
+      && (offset < begins[k] || !chunk_visited(hits[k], offset, &idx))) {
+      scan_hit h;
+      h.type = ur.IsValidRecord(offset);
+      if(h.type == NOT_RECORD) {
+        offset += 8;
+        continue;
+      }
+      h.type = FilterHeader(ur.usn_record, h.type);
+      h.offset = offset;
+      h.usn = ur.usn_record.Usn;
+      h.len = ur.usn_record.RecordLength;
+      h.key = record_key(ur.usn_record);
+      StoreScanHit(h);
+      offset += h.len;
+    }
+    if(offset < stops[k]) {
+      for(; idx < hits[k].size(); idx++)
+        StoreScanHit(hits[k][idx]);
+      offset = stops[k];
+    }
+    vector<scan_hit>().swap(hits[k]);
+    if(k >= progress) {
+      console(".");
+      progress += nchunk / 10;
+    }
+  }
+}
+
+// Scan input chunk by chunk and reuse results of chunks found in chunk cache
+// A cached result is trusted only where it does not depend on bytes after the
+// chunk: a record running over the end and positions whose header would cross
+// the end are left to the sequential fix-up of MergeScanChunks.
+int UsnJrnl::GetAllUsnOffsetCached() {
+  ChunkIndex cdc;
+  vector<cdc_chunk> chunks;
+  LoadChunkCache();
+  cdc.Split(fp_in, scan_begin, size_known ? file_size : UINT64_MAX, &chunks);
+  // Split has read to the end, MergeScanChunks needs the size before it is reported
+  if(!size_known)
+    file_size = get_input_size(fp_in);
+
+  uint64_t nchunk = chunks.size();
+  vector<vector<scan_hit> > hits(nchunk);
+  vector<uint64_t> begins(nchunk);
+  vector<uint64_t> stops(nchunk);
+  unordered_map<uint64_t, cdc_entry> next_cache;
+  uint64_t reused = 0, reused_bytes = 0;
+
+  for(uint64_t k=0; k < nchunk; k++) {
+    cdc_chunk &c = chunks[k];
+    begins[k] = c.offset;
+    auto itr = chunk_cache.find(c.hash);
+    if(itr != chunk_cache.end() && itr->second.len == c.len) {
+      cdc_entry &e = itr->second;
+      // first position whose header crosses the end of chunk
+      uint64_t safe = c.len >= sizeof(USN_RECORD_V2) ? (c.len - sizeof(USN_RECORD_V2) + 8) & ~7ULL : 0;
+      uint64_t spill = e.stop;
+      uint64_t kept_end = 0;
+      for(auto h: e.hits) {
+        if(h.offset + h.len > c.len) {
+          spill = min(spill, h.offset);
+          break;
+        }
+        kept_end = h.offset + h.len;
+        h.offset += c.offset;
+        hits[k].push_back(h);
+      }
+      uint64_t cut = min(spill, max(kept_end, safe));
+      stops[k] = c.offset + cut;
+      reused++;
+      reused_bytes += c.len;
+      next_cache[c.hash] = e;
+    } else {
+      cdc_entry &e = next_cache[c.hash];
+      stops[k] = ScanRange(fp_in, c.offset, c.offset + c.len, &hits[k], NULL);
+      e.len = c.len;
+      e.stop = stops[k] - c.offset;
+      e.hits = hits[k];
+      for(auto &h: e.hits)
+        h.offset -= c.offset;
+    }
+  }
+  chunk_cache.swap(next_cache);
+
+  MergeScanChunks(begins, hits, stops);
+  SaveChunkCache();
+  console("Done\n");
+  ResolveSize();
+  console("%llu of %llu chunks (%llu bytes) reused\n", reused, nchunk, reused_bytes);
+  fprintf(fp_ofreport, "%llu of %llu chunks (%llu bytes) reused from chunk cache\n", reused, nchunk, reused_bytes);
   return 0;
 }
 
 // USN Sort & Deduplication
 int UsnJrnl::PreProcess() {
-  uint64_t usn_num = usn_set.size();
+  uint64_t usn_num = found_num > 0 ? found_num : usn_set.size();
+  if(runs != NULL)
+    MergeRuns();
 
-  printf("%8lu corrupt records skipped\n", corrupt_offset_set.size());
-  printf("%8llu records found\n", usn_num);
+  console("%8lu corrupt records skipped\n", corrupt_offset_set.size());
+  console("%8llu records found\n", usn_num);
   fprintf(fp_ofreport, "%8lu corrupt records skipped\n", corrupt_offset_set.size());
+  if (filter != NULL) {
+    console("%8llu records skipped by filter in scan\n", filtered_scan);
+    fprintf(fp_ofreport, "Filter:%s\n", filter->description.c_str());
+    fprintf(fp_ofreport, "%8llu records skipped by filter in scan\n", filtered_scan);
+  }
   fprintf(fp_ofreport, "%8llu records\n", usn_num);   
 
-  // USN Sort & Deduplication
-  sort(usn_set.begin(), usn_set.end());
-  usn_set.erase(std::unique(usn_set.begin(), usn_set.end()), usn_set.end());
+  // USN Sort & Deduplication (multi-source: per record in GetAllUsnOffsetMulti)
+  if(fp_srcs.empty()) {
+    sort(usn_set.begin(), usn_set.end());
+    usn_set.erase(std::unique(usn_set.begin(), usn_set.end()), usn_set.end());
+  }
   
-  if (usn_num != usn_set.size()) {
-    printf("%8llu duplicate records found\n", usn_num - usn_set.size()); 
-    printf("%8lu unique records found\n", usn_set.size()); 
-    fprintf(fp_ofreport, "%8llu duplicate records\n", usn_num - usn_set.size()); 
-    fprintf(fp_ofreport, "%8lu unique records\n", usn_set.size()); 
+  if (usn_num != UsnNum()) {
+    console("%8llu duplicate records found\n", usn_num - UsnNum()); 
+    console("%8llu unique records found\n", UsnNum()); 
+    fprintf(fp_ofreport, "%8llu duplicate records\n", usn_num - UsnNum()); 
+    fprintf(fp_ofreport, "%8llu unique records\n", UsnNum()); 
   }
   
   return 0;
 }
 
+// Count a file name in votes[0..*num), slots beyond *num keep their buffers
+static void vote_name(vector<pair<string, uint16_t> > *votes, size_t *num, const string &name) {
+  for(size_t k=0; k < *num; k++) {
+    if((*votes)[k].first == name) {
+      (*votes)[k].second++;
+      return;
+    }
+  }
+  if(*num == votes->size())
+    votes->emplace_back();
+  (*votes)[*num].first = name;
+  (*votes)[*num].second = 1;
+  (*num)++;
+}
+
 // Pack a bunch of records then store usnmain_set
 int UsnJrnl::CheckRecords() {
   
   uint64_t i,j;
   uint16_t rec_cnt;
   double time_taken;
-  uint64_t progress = usn_set.size() / 20;
+  uint64_t usn_num = UsnNum();
+  uint64_t progress = usn_num / 20;
   uint64_t rel_ts; // relative timestamp
   vector<uint64_t> skip_set;
-  for(i=0; i+1 < usn_set.size(); i++) {
+  // decoders and file name votes are reused for every record
+  UsnRecord* ur_base = NewRecord();
+  UsnRecord* ur_next = NewRecord();
+  vector<pair<string, uint16_t> > filename_vote;
+  size_t vote_num;
+  bool zone; // ur_next is in the pack zone of ur_base
+  // zones keep filtered rows equal to unfiltered ones, without a filter records pack across them
+  auto in_zone = [this](uint64_t usn_a, uint64_t ts_a, uint64_t usn_b, uint64_t ts_b) {
+    return filter == NULL || same_pack_zone(usn_a, ts_a, usn_b, ts_b);
+  };
+  // the last record has no next one to pack with and is left, unless records
+  // after it were dropped by scanner, they are in another pack zone
+  bool tail = usn_num > 0 && filtered_usn > UsnAt(usn_num-1);
+  for(i=0; i+1 < usn_num || (tail && i < usn_num); i++) {
     
     if (i+1 > progress) {
-  	  printf(".");
-      progress += usn_set.size() / 20;
+  	  console(".");
+      progress += usn_num / 20;
     }
+    if (status != NULL && (i & PROGRESS_MASK) == 0)
+      status->records.store(i, memory_order_relaxed);
 
     // if current record already processed then skip
     if (find(skip_set.begin(), skip_set.end(), i) != skip_set.end()) {
@@ -118,17 +570,13 @@ int UsnJrnl::CheckRecords() {
       continue;
     }
 
-    UsnRecord* ur_base = new UsnRecord(fp_in);    
-    ur_base->ReadParseRecord(usn_table[usn_set[i]]);
+    ur_base->ReadParseRecord(OffsetAt(i));
     rec_cnt = 1;
     time_taken = 0;
     
     // DELETE|CLOSE or DELETE|TRANSACT|CLOSE - don't pack
     if (ur_base->usn_record.Reason == (DELETE|CLOSE) || ur_base->usn_record.Reason == (DELETE|TRANSACT|CLOSE)) { 
-      UsnMain* um = new UsnMain();
-      um->StoreRecord(ur_base, rec_cnt, time_taken);
-      usnmain_set.push_back(*um);
-      delete um, ur_base;
+      PushMain(ur_base, rec_cnt, time_taken);
       continue;
     }
 
@@ -137,32 +585,38 @@ int UsnJrnl::CheckRecords() {
     while(find(skip_set.begin(), skip_set.end(), i+j) != skip_set.end())
       j++;
     
-    UsnRecord* ur_next = new UsnRecord(fp_in);    
-	  ur_next->ReadParseRecord(usn_table[usn_set[i+j]]);
+    // records of another pack zone are never packed with this one (filter windows)
+    zone = false;
+    if (i+j < usn_num) {
+      ur_next->ReadParseRecord(OffsetAt(i+j));
+      zone = in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, ur_next->usn_record.Usn, ur_next->usn_record.TimeStamp);
+    }
 
     // SECURITY -> SECURITY|CLOSE - finish packing
-    if ((ur_base->usn_record.Reason == SECURITY) && (ur_next->usn_record.Reason == (SECURITY|CLOSE))) {
+    if (zone && (ur_base->usn_record.Reason == SECURITY) && (ur_next->usn_record.Reason == (SECURITY|CLOSE))) {
       rec_cnt++;
       time_taken += double(ur_next->usn_record.TimeStamp - ur_base->usn_record.TimeStamp) / 10000000; // 1s
       ur_base->usn_record.Reason |= ur_next->usn_record.Reason;
       ur_base->usn_record.FileAttributes |= ur_next->usn_record.FileAttributes;
-      UsnMain* um = new UsnMain();
-      um->StoreRecord(ur_base, rec_cnt, time_taken);
-      usnmain_set.push_back(*um);
+      PushMain(ur_base, rec_cnt, time_taken);
       skip_set.push_back(i+j);
-      delete um, ur_next, ur_base;
       continue;
     }
 
     // OLDNAME -> NEWNAME - determine RENAME or MOVE and finish packing
-    if ((ur_base->usn_record.Reason & OLDNAME) && (ur_next->usn_record.Reason & NEWNAME)) {
+    if (zone && (ur_base->usn_record.Reason & OLDNAME) && (ur_next->usn_record.Reason & NEWNAME)) {
       if (ur_base->file_name == ur_next->file_name) {
         ur_base->usn_record.Reason = MOVE;
-        ur_base->file_name += " (" + to_string(ur_base->pid) + " -> " + to_string(ur_next->pid) + ")";
+        ur_base->file_name += " (";
+        ur_base->file_name += to_string(ur_base->pid);
+        ur_base->file_name += " -> ";
+        ur_base->file_name += to_string(ur_next->pid);
+        ur_base->file_name += ")";
       }
       else {
         ur_base->usn_record.Reason = RENAME;
-        ur_base->file_name += " -> " + ur_next->file_name;
+        ur_base->file_name += " -> ";
+        ur_base->file_name += ur_next->file_name;
       }
       rec_cnt++;
       time_taken += double(ur_next->usn_record.TimeStamp - ur_base->usn_record.TimeStamp) / 10000000;
@@ -170,32 +624,27 @@ int UsnJrnl::CheckRecords() {
       skip_set.push_back(i+j);
       // OLDNAME -> NEWNAME -> NEWNAME|CLOSE - also pack
       rel_ts = ur_next->usn_record.TimeStamp;
-      ur_next->ReadParseRecord(usn_table[usn_set[i+j+1]]);
-      if (ur_next->usn_record.Reason == (NEWNAME|CLOSE)) {
+      ur_next->ReadParseRecord(OffsetAt(i+j+1));
+      if (ur_next->usn_record.Reason == (NEWNAME|CLOSE)
+        && in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, ur_next->usn_record.Usn, ur_next->usn_record.TimeStamp)) {
         ur_base->usn_record.FileAttributes |= ur_next->usn_record.FileAttributes;
         rec_cnt++;
         time_taken += double(ur_next->usn_record.TimeStamp - rel_ts) / 10000000;
         skip_set.push_back(i+j+1);
       }    
-      UsnMain* um = new UsnMain();
-      um->StoreRecord(ur_base, rec_cnt, time_taken);
-      usnmain_set.push_back(*um);
-      delete um, ur_next, ur_base;
+      PushMain(ur_base, rec_cnt, time_taken);
       continue;
     }
     
     rel_ts = ur_base->usn_record.TimeStamp;
-    map<string, uint16_t> filename_vote;
-    filename_vote[ur_base->file_name] = 1;
+    vote_num = 0;
+    vote_name(&filename_vote, &vote_num, ur_base->file_name);
     
     // main pack process
-    while(ur_next->usn_record.TimeStamp - rel_ts < 10000000) { // 1s
+    while(zone && ur_next->usn_record.TimeStamp - rel_ts < 10000000) { // 1s
       if(ur_base->cid == ur_next->cid) { // check if next record is the same id and packable
         // count filename because of garbage exclusion
-        if(filename_vote.find(ur_next->file_name) == filename_vote.end())
-          filename_vote[ur_next->file_name] = 1;
-        else 
-          filename_vote[ur_next->file_name]++;
+        vote_name(&filename_vote, &vote_num, ur_next->file_name);
         if (ur_next->usn_record.Reason & (OLDNAME|NEWNAME)) // stop if next operation includes RENAME 
           break;
         rec_cnt++;
@@ -208,94 +657,161 @@ int UsnJrnl::CheckRecords() {
           break;
       } // skip checking procedure when it doesn't exist relevant record for faster processing
       else if (usnmain_set.size() > 0 && rec_cnt == usnmain_set.back().rec_cnt && ur_base->pid == usnmain_set.back().pid
-        && ur_base->usn_record.Reason == usnmain_set.back().reasons_i && ur_base->usn_record.FileAttributes == usnmain_set.back().attrs_i) {
+        && ur_base->usn_record.Reason == usnmain_set.back().reasons_i && ur_base->usn_record.FileAttributes == usnmain_set.back().attrs_i
+        && in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, usnmain_set.back().usn, usnmain_set.back().timestamp_i)) {
         if (rec_cnt == usnmain_set[usnmain_set.size()-2].rec_cnt && usnmain_set[usnmain_set.size()-2].pid == ur_base->pid
-          && ur_base->usn_record.Reason == usnmain_set[usnmain_set.size()-2].reasons_i  && ur_base->usn_record.FileAttributes == usnmain_set[usnmain_set.size()-2].attrs_i) {
+          && ur_base->usn_record.Reason == usnmain_set[usnmain_set.size()-2].reasons_i  && ur_base->usn_record.FileAttributes == usnmain_set[usnmain_set.size()-2].attrs_i
+          && in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, usnmain_set[usnmain_set.size()-2].usn, usnmain_set[usnmain_set.size()-2].timestamp_i)) {
           break;
         }
       }
       j++;
       while(find(skip_set.begin(), skip_set.end(), i+j) != skip_set.end())
         j++;
-      ur_next->ReadParseRecord(usn_table[usn_set[i+j]]);
+      ur_next->ReadParseRecord(OffsetAt(i+j));
+      zone = in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, ur_next->usn_record.Usn, ur_next->usn_record.TimeStamp);
     }
 
-    int c=0;
-    for(auto x: filename_vote) {
-      if(x.second > c) {
-        ur_base->file_name = x.first;
-        c = x.second;
-      }
+    // most voted, the smallest name among ties
+    size_t v=0;
+    for(size_t k=1; k < vote_num; k++) {
+      if(filename_vote[k].second > filename_vote[v].second
+        || (filename_vote[k].second == filename_vote[v].second && filename_vote[k].first < filename_vote[v].first))
+        v = k;
     }
+    ur_base->file_name = filename_vote[v].first;
     // current record is the same pattern as previous record then update last record
-    if(usnmain_set.size() > 0 && ur_base->cid == usnmain_set.back().cid && ur_base->pid == usnmain_set.back().pid 
-      && ur_base->usn_record.Reason == usnmain_set.back().reasons_i && ur_base->usn_record.FileAttributes == usnmain_set.back().attrs_i) {
+    // (not a checkpoint tail row before main_begin, it was written by previous run)
+    if(usnmain_set.size() > main_begin && ur_base->cid == usnmain_set.back().cid && ur_base->pid == usnmain_set.back().pid 
+      && ur_base->usn_record.Reason == usnmain_set.back().reasons_i && ur_base->usn_record.FileAttributes == usnmain_set.back().attrs_i
+      && in_zone(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, usnmain_set.back().usn, usnmain_set.back().timestamp_i)) {
       usnmain_set.back().rec_cnt += rec_cnt;
       usnmain_set.back().time_taken = double(ur_base->usn_record.TimeStamp - usnmain_set.back().timestamp_i) / 10000000 + time_taken;
+      if(filter != NULL && !filter->Match(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, ur_base->usn_record.Reason, ur_base->file_name))
+        continue;
+      burst_detector.Feed(ur_base->usn_record.Usn, ur_base->usn_record.TimeStamp, ur_base->pid, ur_base->usn_record.Reason, ur_base->file_name);
+      slot_sketch.Count(ur_base->usn_record.Usn, ur_base->cid, ur_base->pid, rec_cnt, ur_base->file_name);
     } else { // not the same then push
-      UsnMain* um = new UsnMain();
-      um->StoreRecord(ur_base, rec_cnt, time_taken);
-      usnmain_set.push_back(*um);
-      delete um, ur_next, ur_base;
+      PushMain(ur_base, rec_cnt, time_taken);
     }
   }
+  delete ur_base;
+  delete ur_next;
   // Todo: should process last record even if it's isolated 
-  printf("Done\n");
+  // every record before the last one is packed, the last one only if it was merged (or tail)
+  if(usn_num >= 2) {
+    uint64_t k = usn_num - 2;
+    if(tail || find(skip_set.begin(), skip_set.end(), usn_num-1) != skip_set.end())
+      k = usn_num - 1;
+    packed_usn = UsnAt(k);
+    packed_offset = OffsetAt(k);
+  }
+  // follow pass keeps open bursts/slot for records still to come
+  if(!following) {
+    burst_detector.Finish();
+    slot_sketch.Finish();
+  }
+  console("Done\n");
   return 0;
 }
   
-// Create dir_table/path_table and store file_path value in usnmain_set
-int UsnJrnl::GetAllDirName() {
+// Store a packed record and feed it to streaming detectors
+// The record is built in place at the end of usnmain_set, no temporary copy
+void UsnJrnl::PushMain(UsnRecord *ur, uint16_t rec_cnt, double time_taken) {
+  // packed records and directory tables share half of memory budget (scan hits the other)
+  if(memory_budget > 0 && main_memory + dir_memory >= memory_budget / 2)
+    SpillMain();
+  usnmain_set.emplace_back();
+  UsnMain *um = &usnmain_set.back();
+  um->StoreRecord(ur, rec_cnt, time_taken);
+  if(memory_budget > 0)
+    main_memory += sizeof(UsnMain) + heap_size(um->file_name);
+  USN_PROBE3(pack__bundle, um->usn, um->rec_cnt, um->cid);
+  // records outside filter are kept until directories are built, but not detected
+  if(filter != NULL && !filter->Match(um->usn, um->timestamp_i, um->reasons_i, um->file_name))
+    return;
+  burst_detector.Feed(um->usn, um->timestamp_i, um->pid, um->reasons_i, um->file_name);
+  slot_sketch.Feed(um->usn, um->timestamp_i, um->cid, um->pid, um->rec_cnt, um->file_name);
+}
 
+// Add directory of a packed record to dir_table (and dir_tree)
+void UsnJrnl::AddDirRow(const UsnMain &x) {
   historical_dir hdir;
-  uint32_t pid;
-  
-  // root directory
-  hdir.name = "\\";
-  hdir.pid = 0;
-  hdir.usn = 0;
-  path_table.insert(make_pair(5, hdir));
-
-  // directory table
-  for(UsnMain x: usnmain_set) {
-    if (x.attrs_i & FOLDER) {
-      if (x.file_name.size() == 0)
-        continue;
-      if (x.file_name.find("\\", x.file_name.size()-1) == string::npos) // filename doesn't end with "\"
-        continue;
-      if (x.file_name == "<Can't Convert>")
-        continue;
-      if (x.cid == x.pid) // ignore unusual pattern
-        continue;
-      hdir.name = x.file_name;
-      hdir.pid = x.pid;
-      hdir.usn = x.usn;
-      dir_table.insert(make_pair(x.cid, hdir));
-      // hard coding
+  size_t dir_num = dir_table.size();
+
+  if (x.attrs_i & FOLDER) {
+    if (dir_tree != NULL)
+      UpdateDirTree(x);
+    if (x.file_name.size() == 0)
+      return;
+    if (x.file_name.find("\\", x.file_name.size()-1) == string::npos) // filename doesn't end with "\"
+      return;
+    if (x.file_name == "<Can't Convert>")
+      return;
+    if (x.cid == x.pid) // ignore unusual pattern
+      return;
+    hdir.name = x.file_name;
+    hdir.pid = x.pid;
+    hdir.pid_seq = x.pid_seq;
+    hdir.usn = x.usn;
+    dir_table.insert(make_pair(x.cid, hdir));
+    // hard coding, not needed when $MFT tells real parents
+    if (mft == NULL) {
       if (hdir.name == "Public") {
         hdir.name = "Users";
         hdir.pid = 5;
+        hdir.pid_seq = 5;
         hdir.usn = 0;
         dir_table.insert(make_pair(x.cid, hdir));
       } else if (hdir.name == "Default") {
         hdir.name = "Users";
         hdir.pid = 5;
+        hdir.pid_seq = 5;
         hdir.usn = 0;
         dir_table.insert(make_pair(x.cid, hdir));
       } else if (hdir.name == "System32") {
         hdir.name = "Windows";
         hdir.pid = 5;
+        hdir.pid_seq = 5;
         hdir.usn = 0;
         dir_table.insert(make_pair(x.cid, hdir));
       } else if (hdir.name == "Prefetch") {
         hdir.name = "Windows";
         hdir.pid = 5;
+        hdir.pid_seq = 5;
         hdir.usn = 0;
         dir_table.insert(make_pair(x.cid, hdir));
       }
-      //fprintf(fp_ofexecuted, "%lld, %s, %lld, %lld\n", x.cid, hdir.name.c_str(), hdir.pid, hdir.usn);
     }
+    //fprintf(fp_ofexecuted, "%lld, %s, %lld, %lld\n", x.cid, hdir.name.c_str(), hdir.pid, hdir.usn);
   }
+  // path_table gets an entry of each, with a longer name
+  if (memory_budget > 0)
+    dir_memory += (dir_table.size() - dir_num) * 2 * (DIR_ENTRY_MEMORY + heap_size(x.file_name));
+}
+
+// Create dir_table/path_table and store file_path value in usnmain_set
+int UsnJrnl::GetAllDirName() {
+
+  historical_dir hdir;
+  uint32_t pid;
+  
+  if (metrics != NULL)
+    metrics->Begin("directory_build", MainNum());
+
+  // root directory
+  hdir.name = "\\";
+  hdir.pid = 0;
+  hdir.pid_seq = 0;
+  hdir.usn = 0;
+  path_table.insert(make_pair(5, hdir));
+  // $MFT is the state after the last record, a version of every directory in it
+  mft_usn = usnmain_set.size() > 0 ? usnmain_set.back().usn + 1 : 0;
+
+  // directory table (entries of records before main_begin come from checkpoint,
+  // of spilled records from SpillMain)
+  for(uint64_t k=main_begin; k < usnmain_set.size(); k++)
+    AddDirRow(usnmain_set[k]);
   uint32_t dir_table_size = dir_table.size();
 
   uint64_t i=1;
@@ -304,7 +820,7 @@ int UsnJrnl::GetAllDirName() {
   // fullpath table
   for(auto x : dir_table) {  // x.first is cid, x.second is hdir
     if (i >= progress) {
-  	  printf(".");
+  	  console(".");
       progress += dir_table_size / 10;
     }
     ++i;
@@ -314,42 +830,107 @@ int UsnJrnl::GetAllDirName() {
     //fprintf(fp_ofopened, "%lld, %s, %lld, %lld\n", x.first, hdir.name.c_str(), hdir.pid, hdir.usn);
   }
 
+  if (metrics != NULL)
+    metrics->End(path_table.size());
+  if (filter != NULL)
+    FilterMain();
+  if (metrics != NULL)
+    metrics->Begin("path_resolution", MainNum());
+  // spilled records are resolved when they are read back
+  main_paths = true;
+
   uint64_t usnmain_set_size = usnmain_set.size();
   progress = usnmain_set_size / 10;
   
   // store into file_path with usnmain_set
-  for(i=0; i+1 < usnmain_set_size; i++) {
+  for(i=main_begin; i < usnmain_set_size; i++) {
     if (i >= progress) {
-  	  printf(".");
+  	  console(".");
       progress += usnmain_set_size / 10;
     }
-    // examine correct path
-    size_t count;
-    count = path_table.count(usnmain_set[i].pid);
-    if (count == 0) {
-      usnmain_set[i].file_path = "";
-    }
-    else if (count == 1) {
-      auto itr = path_table.find(usnmain_set[i].pid);   
-      usnmain_set[i].file_path = itr->second.name;
+    usnmain_set[i].file_path = GetPathName(usnmain_set[i].pid, usnmain_set[i].pid_seq, usnmain_set[i].usn);
+    if (status != NULL && (i & PROGRESS_MASK) == 0)
+      status->records.store(i - main_begin, memory_order_relaxed);
+  }
+  if (metrics != NULL)
+    metrics->End(MainNum());
+  
+  console("Done\n");
+  return 0;
+}
+
+// Record a directory change in dir_tree, a rename gives the new name, a move the new parent
+void UsnJrnl::UpdateDirTree(const UsnMain &x) {
+  string name = x.file_name;
+  uint32_t pid = x.pid;
+  if (x.reasons_i & MOVE) { // "name\ (pid -> pid)"
+    size_t pos = name.rfind(" -> ");
+    size_t open = name.rfind(" (");
+    if (pos == string::npos || open == string::npos || open > pos)
+      return;
+    pid = strtoul(name.c_str() + pos + 4, NULL, 10);
+    name.resize(open);
+  } else if (x.reasons_i & RENAME) { // "old\ -> new\"
+    size_t pos = name.find(" -> ");
+    if (pos != string::npos)
+      name.erase(0, pos + 4);
+  }
+  if (name.size() == 0 || name[name.size()-1] != '\\' || name == "<Can't Convert>")
+    return;
+  if (x.cid == pid) // ignore unusual pattern
+    return;
+  dir_tree->Set(x.usn, x.timestamp_i, x.cid, name, pid, (x.reasons_i & DELETE) != 0);
+}
+
+// Drop packed records outside filter, they were needed for packing and directories only
+void UsnJrnl::FilterMain() {
+  uint64_t k = main_begin;
+  for(uint64_t i=main_begin; i < usnmain_set.size(); i++) {
+    UsnMain &x = usnmain_set[i];
+    if(!filter->Match(x.usn, x.timestamp_i, x.reasons_i, x.file_name))
+      continue;
+    if(k != i)
+      usnmain_set[k] = move(x);
+    k++;
+  }
+  filtered_pack += usnmain_set.size() - k;
+  usnmain_set.resize(k);
+}
+
+// Examine correct path of directory id at usn from path_table
+// With $MFT its path is one more version at mft_usn, used only if the record
+// still is directory pid_seq (< 0: sequence unknown, any)
+string UsnJrnl::GetPathName(uint32_t pid, int32_t pid_seq, uint64_t usn) {
+  size_t count;
+  string pname;
+  string mft_path;
+  bool in_mft = mft != NULL && (pid_seq < 0 ? mft->GetPath(pid, &mft_path) : mft->GetPath(pid, uint16_t(pid_seq), &mft_path));
+  count = path_table.count(pid);
+  if (count == 0) {
+    if (in_mft)
+      pname = mft_path;
+  }
+  else if (count == 1 && !in_mft) {
+    auto itr = path_table.find(pid);   
+    pname = itr->second.name;
+  }
+  else {
+    int64_t diff = INT64_MAX;
+    if (in_mft) {
+      diff = abs(int64_t(usn - mft_usn));
+      pname = mft_path;
     }
-    else {
-      int64_t diff = INT64_MAX;
-      string pname;
-      auto itr = path_table.equal_range(usnmain_set[i].pid);
-      for (auto iterator = itr.first; iterator != itr.second; iterator++) {
-      //  if (usn_record.Usn - iterator->second.usn > 0) {
-        if (abs(int64_t(usnmain_set[i].usn - iterator->second.usn)) < diff) {
-          diff = usnmain_set[i].usn - iterator->second.usn;
-          pname = iterator->second.name;
-        }
+    auto itr = path_table.equal_range(pid);
+    for (auto iterator = itr.first; iterator != itr.second; iterator++) {
+    //  if (usn_record.Usn - iterator->second.usn > 0) {
+      if (abs(int64_t(usn - iterator->second.usn)) < diff) {
+        diff = usn - iterator->second.usn;
+        pname = iterator->second.name;
       }
-      usnmain_set[i].file_path = pname;
     }
   }
-  
-  printf("Done\n");
-  return 0;
+  USN_PROBE3(dir__lookup, pid, usn, count);
+  return pname;
 }
 
 // Search directory structure and return path for creating fullpath table
@@ -363,21 +944,30 @@ historical_dir UsnJrnl::GetHistoricalFileName(historical_dir hdir, uint8_t i) {
     hdir.name = "\\" + hdir.name;
     return hdir;
   }
-  else if (count == 0) { // parent directory not found
-    hdir.name = hdir.name;
+  // current path from $MFT, if the record still is the same directory
+  string path;
+  bool in_mft = mft != NULL && mft->GetPath(hdir.pid, hdir.pid_seq, &path);
+  if (count == 0) { // parent directory not found
+    if (in_mft) {
+      hdir.name = path + hdir.name;
+      hdir.pid = MFT_ROOT;
+    }
     return hdir;
   }
-  else if (count == 1) { // unique parent directory found
+  else if (count == 1 && !in_mft) { // unique parent directory found
     auto itr = dir_table.find(hdir.pid);    
     hdir.name = itr->second.name + hdir.name;
     hdir.pid = itr->second.pid;
+    hdir.pid_seq = itr->second.pid_seq;
     i++;
     return GetHistoricalFileName(hdir, i);
   } 
-  else { // multiple parent directory found
-    int64_t diff = INT64_MAX;
+  else { // multiple parent directory found ($MFT is one of them)
+    int64_t diff = in_mft ? abs(int64_t(hdir.usn - mft_usn)) : INT64_MAX;
     uint32_t pid = 0;
+    uint16_t pid_seq = 0;
     string pname = "";
+    bool from_mft = in_mft;
     auto itr = dir_table.equal_range(hdir.pid);
     for (auto iterator = itr.first; iterator != itr.second; iterator++) {
 //      if (hdir.usn - iterator->second.usn > 0) {
@@ -385,10 +975,18 @@ historical_dir UsnJrnl::GetHistoricalFileName(historical_dir hdir, uint8_t i) {
           diff = hdir.usn - iterator->second.usn;
           pname = iterator->second.name;
           pid = iterator->second.pid;          
+          pid_seq = iterator->second.pid_seq;
+          from_mft = false;
         }         
     }
+    if (from_mft) { // $MFT is closest
+      hdir.name = path + hdir.name;
+      hdir.pid = MFT_ROOT;
+      return hdir;
+    }
     hdir.name = pname + hdir.name;
     hdir.pid = pid;
+    hdir.pid_seq = pid_seq;
     i++;
     return GetHistoricalFileName(hdir, i);
   }  
@@ -400,35 +998,90 @@ int UsnJrnl::PostProcess(){
   // store usnmain_set file_path value
   GetAllDirName();
 
-  printf("%8lu records after packing\n", usnmain_set.size());       
-  fprintf(fp_ofreport, "%8lu records after packing\n", usnmain_set.size()); 
-  string timestamp_begin, timestamp_end;
-  
-  timestamp_begin = usnmain_set[0].timestamp_s;
-  timestamp_end = usnmain_set[usnmain_set.size()-1].timestamp_s;
-  
+  // records before main_begin were written by previous run
+  uint64_t main_num = MainNum();
+  if (filter != NULL) {
+    console("%8llu records dropped by filter after packing\n", filtered_pack);
+    fprintf(fp_ofreport, "%8llu records dropped by filter after packing\n", filtered_pack);
+  }
+  console("%8lu records after packing\n", main_num);       
+  fprintf(fp_ofreport, "%8lu records after packing\n", main_num); 
+  if (main_num == 0)
+    return 0;
+  if (metrics != NULL)
+    metrics->Begin("usn_range", main_num);
+
+  // USN range, Time slot Breakdown (one pass, whole range is written first)
+  string ranges;
+  string timestamp_begin, timestamp_first;
+  uint64_t usn_begin = 0, usn_first = 0, usn_prev = 0, ts_prev = 0;
+  uint64_t i = 0, j = 0;
+  char line[128];
+  ForEachMain([&](UsnMain &x, bool) -> bool {
+    if (i == 0) {
+      usn_first = usn_begin = x.usn;
+      timestamp_first = timestamp_begin = parse_datetimemicro(x.timestamp_i, lt);
+    } else if (x.usn - usn_prev > 1048576) {
+      snprintf(line, sizeof(line), "%8d |", int(i-j));
+      ranges += line;
+      ranges += " " + timestamp_begin + " - " + parse_datetimemicro(ts_prev, lt) + " |";
+      snprintf(line, sizeof(line), "%13llu - %13llu |\n", usn_begin, usn_prev);
+      ranges += line;
+      j = i;
+      usn_begin = x.usn;
+      timestamp_begin = parse_datetimemicro(x.timestamp_i, lt);
+    }
+    usn_prev = x.usn;
+    ts_prev = x.timestamp_i;
+    i++;
+    return true;
+  });
+  string timestamp_end = parse_datetimemicro(ts_prev, lt);
+  snprintf(line, sizeof(line), "%8d |", int(i-j));
+  ranges += line;
+  ranges += " " + timestamp_begin + " - " + timestamp_end + " |";
+  snprintf(line, sizeof(line), "%13llu - %13llu |\n", usn_begin, usn_prev);
+  ranges += line;
+
   fprintf(fp_ofreport, " Records |                         DateTime                        |             USN              |\n");
-  fprintf(fp_ofreport, "%8lu | %s - %s |%13llu - %13llu |\n", usnmain_set.size(), timestamp_begin.c_str(), timestamp_end.c_str(), usnmain_set[0].usn, usnmain_set[usnmain_set.size()-1].usn); 
+  fprintf(fp_ofreport, "%8lu | %s - %s |%13llu - %13llu |\n", main_num, timestamp_first.c_str(), timestamp_end.c_str(), usn_first, usn_prev); 
   fprintf(fp_ofreport, "===================================================================================================\n");
+  fputs(ranges.c_str(), fp_ofreport);
 
-  // USN range, Time slot Breakdown
-  uint64_t usn_begin;
-  usn_begin = usnmain_set[0].usn;
-  int j=0;
-  for(int i=1; i <= usnmain_set.size(); ++i) {
-    if(usnmain_set[i].usn - usnmain_set[i-1].usn > 1048576) {
-      timestamp_end = usnmain_set[i-1].timestamp_s;
-      fprintf(fp_ofreport, "%8d |", i-j);
-      fprintf(fp_ofreport, " %s - %s |", timestamp_begin.c_str(), timestamp_end.c_str());
-      fprintf(fp_ofreport, "%13llu - %13llu |\n", usn_begin, usnmain_set[i-1].usn);
-      j = i;
-      if(i == usnmain_set.size())
-        break;
-      usn_begin = usnmain_set[i].usn;
-      timestamp_begin = usnmain_set[i].timestamp_s;
+  WriteSlotSummary();
+  if (metrics != NULL)
+    metrics->End(slot_sketch.slots.size());
+  return 0;
+}
+
+// Write heavy hitters and distinct files per USN range/time slot
+void UsnJrnl::WriteSlotSummary() {
+  vector<slot_summary> &slots = slot_sketch.slots;
+
+  fprintf(fp_ofreport, "\n[Time Slot Summary] %lu slots (records, name/path, id)\n", slots.size());
+  for(uint64_t i=0; i < slots.size(); i++) {
+    fprintf(fp_ofreport, "#%llu %s - %s |%13llu - %13llu | %llu records, ~%llu files\n", i+1,
+      parse_datetimemicro(slots[i].ts_begin, lt).c_str(), parse_datetimemicro(slots[i].ts_end, lt).c_str(),
+      slots[i].usn_begin, slots[i].usn_end, slots[i].records, slots[i].distinct_files);
+    for(auto x: slots[i].top_files)
+      fprintf(fp_ofreport, "  file %8llu, %s, %llu\n", x.count, x.name.c_str(), x.key);
+    for(auto x: slots[i].top_dirs) {
+      string dir_s = GetPathName(uint32_t(x.key), -1, x.usn);
+      fprintf(fp_ofreport, "  dir  %8llu, %s, %llu\n", x.count, dir_s.c_str(), x.key);
     }
   }
-  return 0;
+}
+
+// Open output csv and write header, existing file is appended on resume/follow
+// return: NULL on error
+FILE *UsnJrnl::OpenCsv(string fname, int (UsnJrnl::*header)(FILE*, bool), bool lt) {
+  FILE *fp;
+  if((fp = fopen(fname.c_str(), append ? "a" : "w")) == NULL)
+    return NULL;
+  fseeko64(fp, 0, SEEK_END);
+  if(ftello64(fp) == 0)
+    (this->*header)(fp, lt);
+  return fp;
 }
 
 // for main output header
@@ -451,37 +1104,100 @@ int UsnJrnl::WriteBundledHeader(FILE *fp, bool lt) {
 }
 
 // Write bundled records 
+// stage 1 (this thread): format records into chunks
+// stage 2 (writer thread): write chunks to files
 int UsnJrnl::WriteBundledRecords(char *odname, bool lt) {
 
-  uint64_t usnmain_set_size = usnmain_set.size();
+  uint64_t main_num = MainNum();
   uint64_t split_size = 1000000;
-  uint64_t progress = usnmain_set_size / 10;
+  uint64_t progress = main_num / 10;
 
-  FILE *fp_ofmain;
+  FILE *fp_ofmain = NULL;
   string ofmain;
-  
-  for(uint64_t i=0; i < usnmain_set_size;) {
+  SpscRing<write_chunk> write_queue(WRITE_QUEUE);
+
+  thread writer([&]() {
+    write_chunk c;
+    while(write_queue.Pop(c)) {
+      USN_PROBE2(shard__flush__begin, c.data.size(), c.last);
+      fwrite(c.data.data(), 1, c.data.size(), c.fp);
+      if(c.last)
+        fclose(c.fp);
+      USN_PROBE2(shard__flush__end, c.data.size(), c.last);
+    }
+  });
+  write_chunk c;
+  // an output or spill error leaves while writer is running, queued chunks
+  // are still written and the current file is closed
+  StageGuard writer_guard(writer, [&]() {
+    if(fp_ofmain != NULL && !c.last) {
+      c.last = true;
+      write_queue.Push(c);
+    }
+    write_queue.Close();
+  });
+
+  uint32_t hfile = 0;
+  uint64_t hoffset = 0;
+  uint64_t i = 0;
+  uint64_t &j = bundled_rows;
+  ForEachMain([&](UsnMain &x, bool) -> bool {
+    if(fp_ofmain == NULL || j >= split_size) {
+      if(fp_ofmain != NULL) {
+        c.last = true;
+        write_queue.Push(c);
+        c.data.clear();
+      }
+      // a follow pass continues the file of previous pass until it is full
+      if(bundled_fname.empty() || j >= split_size) {
+        bundled_fname = string(odname) + SEP + "usn_analytics_records-" + parse_datetime_iso8601(x.timestamp_i, lt) + ".csv";
+        j = 0;
+      }
+      ofmain = bundled_fname;
 
-    ofmain = string(odname) + SEP + "usn_analytics_records-" + parse_datetime_iso8601(usnmain_set[i].timestamp_i, lt) + ".csv";
+      if((fp_ofmain = OpenCsv(ofmain, &UsnJrnl::WriteBundledHeader, lt)) == NULL)
+        fatal("Output Records File Error", USN_ANALYTICS_E_OUTPUT);
 
-    if((fp_ofmain = fopen(ofmain.c_str(), "w")) == NULL) {
-      perror("Output Records File Error");
-      exit(EXIT_FAILURE);
-    }
-    WriteBundledHeader(fp_ofmain, lt);
-    for(uint64_t j=0; i < usnmain_set_size && j < split_size; i++, j++) {    
-      usnmain_set[i].WriteBundledRecord(fp_ofmain);
-      if (i > progress) {
-        printf(".");
-        progress += usnmain_set_size / 10;
+      if(history != NULL) {
+        hfile = history->AddFile(ofmain);
+        hoffset = ftello64(fp_ofmain);
       }
+      c.fp = fp_ofmain;
+      c.last = false;
     }
-    fclose(fp_ofmain);
 
+    size_t row_begin = c.data.size();
+    x.FormatBundledRecord(&(c.data));
+    if(history != NULL) {
+      uint32_t len = c.data.size() - row_begin;
+      history->AddRow(hfile, hoffset, len, x.cid | uint64_t(x.cid_seq) << 48, x.file_name);
+      hoffset += len;
+    }
+    if(c.data.size() >= WRITE_CHUNK_SIZE) {
+      write_queue.Push(c);
+      c.data.clear();
+      c.fp = fp_ofmain;
+      c.last = false;
+    }
+    if (i > progress) {
+      console(".");
+      progress += main_num / 10;
+    }
+    if (status != NULL && (i & PROGRESS_MASK) == 0)
+      status->records.store(i, memory_order_relaxed);
+    i++;
+    j++;
+    return true;
+  });
+  if(fp_ofmain != NULL) {
+    c.last = true;
+    write_queue.Push(c);
   }
+  write_queue.Close();
+  writer.join();
   
-  printf("Done\n");
-  return 0;
+  console("Done\n");
+  return main_num;
 }
 
 // for executed output header
@@ -506,26 +1222,24 @@ int UsnJrnl::WriteExecutedHeader(FILE *fp, bool lt) {
 int UsnJrnl::WriteExecutedRecords(char *odname, bool lt) {
 
   vector<UsnExecuted> usnexecuted_set;  
+  deque<UsnMain> spilled_set; // copies of spilled records in usnexecuted_set
 
   // create usnexecuted_set
-  for(int i=0; i < usnmain_set.size(); i++) { 
-    if (usnmain_set[i].file_name.size() >= 16 
-      && usnmain_set[i].file_name.find(".pf", usnmain_set[i].file_name.size()-3) != string::npos
-      && usnmain_set[i].file_name.rfind("-", usnmain_set[i].file_name.size()-12) != string::npos) {
-      if (usnmain_set[i].reasons_i & CREATE || usnmain_set[i].reasons_i & EXTEND) {
-        // calculate run count based on prefetch file name
-        uint16_t exe_count=1;
-        for(int j=0; j < usnexecuted_set.size(); j++) {
-          if(usnmain_set[i].file_name == usnexecuted_set[j].file_name)
-            exe_count++;
-        }
-        UsnExecuted* ue = new UsnExecuted();
-        ue->StoreRecord(&usnmain_set[i], exe_count);
-        usnexecuted_set.push_back(*ue);
-        delete ue;
+  ForEachMain([&](UsnMain &x, bool spilled) -> bool {
+    if (x.file_name.size() >= 16 
+      && x.file_name.find(".pf", x.file_name.size()-3) != string::npos
+      && x.file_name.rfind("-", x.file_name.size()-12) != string::npos) {
+      if (x.reasons_i & CREATE || x.reasons_i & EXTEND) {
+        // calculate run count based on prefetch file name (kept across resumed runs)
+        uint16_t exe_count = ++prefetch_count[x.file_name];
+        if (spilled)
+          spilled_set.push_back(x);
+        usnexecuted_set.emplace_back();
+        usnexecuted_set.back().StoreRecord(spilled ? &spilled_set.back() : &x, exe_count);
       }
     }
-  }
+    return true;
+  });
 
   map<string, uint16_t> exe_name_table; // exe_name, exe_cnt
 
@@ -546,19 +1260,16 @@ int UsnJrnl::WriteExecutedRecords(char *odname, bool lt) {
   string ofexecuted;
   ofexecuted = string(odname) + SEP + "usn_analytics_executed.csv";
 
-  if((fp_ofexecuted = fopen(ofexecuted.c_str(), "w")) == NULL) {
-    perror("Output Records File Error");
-    exit(EXIT_FAILURE);
+  if((fp_ofexecuted = OpenCsv(ofexecuted, &UsnJrnl::WriteExecutedHeader, lt)) == NULL) {
+    fatal("Output Records File Error", USN_ANALYTICS_E_OUTPUT);
   } 
 
-  WriteExecutedHeader(fp_ofexecuted, lt);
-
   for(int i=0; i < usnexecuted_set.size(); i++)
     usnexecuted_set[i].WriteExecutedRecord(fp_ofexecuted);
     
-  printf("...Done\n");
+  console("...Done\n");
   fclose(fp_ofexecuted);
-  return 0;
+  return usnexecuted_set.size();
 }
 
 // for opened output header
@@ -583,32 +1294,34 @@ int UsnJrnl::WriteOpenedHeader(FILE *fp, bool lt) {
 int UsnJrnl::WriteOpenedRecords(char *odname, bool lt) {
   
   vector<UsnOpened> usnopened_set;
-
-  // create usnexecuted_set
-  for(int i=0; i < usnmain_set.size(); i++) { 
-    if (usnmain_set[i].file_name.size() >= 4 && usnmain_set[i].file_name.find(".lnk", usnmain_set[i].file_name.size()-4) != string::npos) {
-      if(usnmain_set[i].reasons_i != (SECURITY|CLOSE) && !(usnmain_set[i].reasons_i & DELETE)) {
-        UsnOpened* uo = new UsnOpened();
-        uo->StoreRecord(&usnmain_set[i]);
-        usnopened_set.push_back(*uo);
-        delete uo;
-      }
-    } else if (usnmain_set[i].reasons_i & (OBJECTID) && !(usnmain_set[i].reasons_i & DELETE)) {
-      UsnOpened* uo = new UsnOpened();
-      uo->StoreRecord(&usnmain_set[i]);
-      usnopened_set.push_back(*uo);
-      delete uo;
+  deque<UsnMain> spilled_set; // copies of spilled records in usnopened_set
+
+  // create usnopened_set
+  ForEachMain([&](UsnMain &x, bool spilled) -> bool {
+    bool opened = false;
+    if (x.file_name.size() >= 4 && x.file_name.find(".lnk", x.file_name.size()-4) != string::npos) {
+      if(x.reasons_i != (SECURITY|CLOSE) && !(x.reasons_i & DELETE))
+        opened = true;
+    } else if (x.reasons_i & (OBJECTID) && !(x.reasons_i & DELETE)) {
+      opened = true;
     }
-  }
+    if (opened) {
+      if (spilled)
+        spilled_set.push_back(x);
+      usnopened_set.emplace_back();
+      usnopened_set.back().StoreRecord(spilled ? &spilled_set.back() : &x);
+    }
+    return true;
+  });
 
   map<string, uint16_t> open_name_table; // open_name, open_cnt
 
   // create open_name table (open_name, open_cnt)
   for(int i=0; i < usnopened_set.size(); i++)
-    if(open_name_table.find(usnopened_set[i].file_name) == open_name_table.end())
-      open_name_table[usnopened_set[i].file_name] = 1;
+    if(open_name_table.find(usnopened_set[i].um->file_name) == open_name_table.end())
+      open_name_table[usnopened_set[i].um->file_name] = 1;
     else
-      open_name_table[usnopened_set[i].file_name]++;
+      open_name_table[usnopened_set[i].um->file_name]++;
 
   // write to report  
   int i=0;
@@ -626,78 +1339,147 @@ int UsnJrnl::WriteOpenedRecords(char *odname, bool lt) {
   string ofopened;
   ofopened = string(odname) + SEP + "usn_analytics_opened.csv";
 
-  if((fp_ofopened = fopen(ofopened.c_str(), "w")) == NULL) {
-    perror("Output Records File Error");
-    exit(EXIT_FAILURE);
+  if((fp_ofopened = OpenCsv(ofopened, &UsnJrnl::WriteOpenedHeader, lt)) == NULL) {
+    fatal("Output Records File Error", USN_ANALYTICS_E_OUTPUT);
   } 
-  
-  WriteOpenedHeader(fp_ofopened, lt);
+
   // write to file
   for(int i=0; i < usnopened_set.size(); i++)
     usnopened_set[i].WriteOpenedRecord(fp_ofopened);
 
-  printf("...Done\n");
+  console("...Done\n");
   fclose(fp_ofopened);
+  return usnopened_set.size();
+}
+
+// Compile IOC rules from file, or built-in rules if fname is NULL
+int UsnJrnl::LoadIocRules(char *fname) {
+  int result;
+
+  if (fname == NULL)
+    result = ioc_matcher.LoadDefaultRules();
+  else
+    result = ioc_matcher.LoadRuleFile(fname);
+  if (result < 0)
+    return -1;
+
+  console("%8lu IOC rules loaded (%s)\n", ioc_matcher.rules.size(), fname ? fname : "built-in");
+  fprintf(fp_ofreport, "%8lu IOC rules (%s)\n", ioc_matcher.rules.size(), fname ? fname : "built-in");
   return 0;
 }
 
-// Write Suspicious Info
-int UsnJrnl::WriteSuspiciousInfo() {
-  map<string, uint16_t> job_table, exe_table, dll_table, scr_table, ps1_table, vb_table, bat_table, tck_table;
-  map<string, string> psexec_table;  // timestamp, filename
-  //map<string, uint16_t> stream_table, ea_table;
-  int i;
-  
-  for(i=0; i < usnmain_set.size(); i++) {
-    if (usnmain_set[i].file_name.size() < 5 )
-      continue;
-    if (usnmain_set[i].reasons_i == (SECURITY|CLOSE))
-      continue;
-      
-    FindInsertCount(&(usnmain_set[i].file_name), ".job", &job_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".exe", &exe_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".dll", &dll_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".scr", &scr_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".vba", &vb_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".vbe", &vb_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".vbs", &vb_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".ps1", &ps1_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".bat", &bat_table);
-    FindInsertCount(&(usnmain_set[i].file_name), ".tck", &tck_table);
-
-#ifdef _WIN32
-    if (stricmp(usnmain_set[i].file_name.c_str(), "PSEXESVC.exe") == 0)      
-       psexec_table[usnmain_set[i].timestamp_s] = usnmain_set[i].file_name;
-#else
-    if (strcasecmp(usnmain_set[i].file_name.c_str(), "PSEXESVC.exe") == 0)      
-       psexec_table[usnmain_set[i].timestamp_s] = usnmain_set[i].file_name;    
-#endif
-        
-  }
-  
-  WriteFileNameList("job", &job_table);
-  WriteFileNameList("exe", &exe_table);
-  WriteFileNameList("dll", &dll_table);
-  WriteFileNameList("scr", &scr_table);
-  WriteFileNameList("ps1", &ps1_table);
-  WriteFileNameList("vbe/vbs", &vb_table);
-  WriteFileNameList("bat", &bat_table);
-  WriteFileNameList("tck", &tck_table);
-
-  fprintf(fp_ofreport, "\n[PSEXESVC] %lu files (timestamp, name)\n", psexec_table.size());
-  i=0;
-  for(auto x: psexec_table) {
-    fprintf(fp_ofreport, "%s, %s\n", x.first.c_str(), x.second.c_str());
+// for suspicious output header
+int UsnJrnl::WriteSuspiciousHeader(FILE *fp, bool lt) {
+  string tzstr;
+  tzstr = get_timezone_str(lt);
+
+  fprintf(fp, "\"Usn\"\t");
+  fprintf(fp, "\"TimeStamp(%s)\"\t", tzstr.c_str());
+  fprintf(fp, "\"Group\"\t");
+  fprintf(fp, "\"Kind\"\t");
+  fprintf(fp, "\"Pattern\"\t");
+  fprintf(fp, "\"FileName\"\t");
+  fprintf(fp, "\"Path\"\t");
+  fprintf(fp, "\"Reason\"\t");
+  fprintf(fp, "\"FileID\"\t");
+  fprintf(fp, "\"ParentID\"");
+  fprintf(fp, "\n");
+  return 0;
+}
+
+// Write Suspicious Info (IOC rule matches)
+int UsnJrnl::WriteSuspiciousInfo(char *odname, bool lt) {
+  const char *kind_s[] = {"name", "ext", "substr", "path"};
+  char timestamp_s[32];
+  vector<map<string, uint16_t> > group_table(ioc_matcher.groups.size()); // per group: name, count
+  vector<uint64_t> group_counted(ioc_matcher.groups.size(), 0); // per group: number of last record counted (from 1)
+  vector<uint32_t> hits;
+  uint64_t matched = 0;
+
+  FILE *fp_ofsuspicious;
+  string ofsuspicious;
+  ofsuspicious = string(odname) + SEP + "usn_analytics_suspicious.csv";
+
+  if((fp_ofsuspicious = OpenCsv(ofsuspicious, &UsnJrnl::WriteSuspiciousHeader, lt)) == NULL)
+    fatal("Output Records File Error", USN_ANALYTICS_E_OUTPUT);
+
+  uint64_t i = 0;
+  ForEachMain([&](UsnMain &x, bool) -> bool {
     i++;
-    if(i > 1024) {
-      fprintf(fp_ofreport, "reached 1024 files...skip the rest\n");
+    if (x.file_name.size() == 0)
+      return true;
+    if (x.reasons_i == (SECURITY|CLOSE))
+      return true;
+    if (ioc_matcher.Match(x.file_name, x.file_path, &hits) == 0)
+      return true;
+
+    matched++;
+    for(uint32_t r: hits) {
+      const ioc_rule &rule = ioc_matcher.rules[r];
+      // a record counts once per group however many of its rules match
+      uint32_t g = ioc_matcher.rule_group[r];
+      if(group_counted[g] != i) {
+        group_counted[g] = i;
+        group_table[g][x.file_name]++;
+      }
+      fprintf(fp_ofsuspicious, "\"%llu\"\t", x.usn);
+      format_datetimemicro(x.timestamp_i, lt, timestamp_s);
+      fprintf(fp_ofsuspicious, "\"%s\"\t", timestamp_s);
+      fprintf(fp_ofsuspicious, "\"%s\"\t", rule.group.c_str());
+      fprintf(fp_ofsuspicious, "\"%s\"\t", kind_s[rule.kind]);
+      fprintf(fp_ofsuspicious, "\"%s\"\t", rule.pattern.c_str());
+      fprintf(fp_ofsuspicious, "\"%s\"\t", x.file_name.c_str());
+      fprintf(fp_ofsuspicious, "\"%s\"\t", x.file_path.c_str());
+      fprintf(fp_ofsuspicious, "\"%s\"\t", reason_name(x.reasons_i).c_str());
+      fprintf(fp_ofsuspicious, "\"%u\"\t", x.cid);
+      fprintf(fp_ofsuspicious, "\"%u\"", x.pid);
+      fprintf(fp_ofsuspicious, "\n");
+    }
+    return true;
+  });
+  fclose(fp_ofsuspicious);
+
+  // write to report, groups without any match are omitted
+  fprintf(fp_ofreport, "\n[IOC] %llu records matched (%lu rules, %lu groups)\n",
+    matched, ioc_matcher.rules.size(), ioc_matcher.groups.size());
+  for(uint32_t g=0; g < group_table.size(); g++)
+    if(group_table[g].size() > 0)
+      WriteFileNameList(ioc_matcher.groups[g], &group_table[g]);
+
+  console("...Done\n");
+
+  return matched;
+}
+
+// Write mass-modification bursts found while packing
+int UsnJrnl::WriteBurstInfo(bool lt) {
+  const char *kind_s[] = {"RENAME", "EXTCHANGE", "OVERWRITE", "DELETE"};
+  vector<burst_info> &bursts = burst_detector.bursts;
+
+  fprintf(fp_ofreport, "\n[Mass Modification] %lu bursts (%llus window, %u per directory, %u per volume)\n",
+    bursts.size(), burst_detector.window_ts / 10000000, burst_detector.dir_threshold, burst_detector.global_threshold);
+  if (bursts.size() > 0)
+    fprintf(fp_ofreport, "kind, directory, begin - end, usn begin - usn end, records, peak in window\n");
+  for(uint64_t i=0; i < bursts.size(); i++) {
+    string dir_s;
+    if (bursts[i].pid == BURST_GLOBAL)
+      dir_s = "(volume)";
+    else {
+      dir_s = GetPathName(bursts[i].pid, -1, bursts[i].start_usn);
+      if (dir_s.size() == 0)
+        dir_s = to_string(bursts[i].pid);
+    }
+    fprintf(fp_ofreport, "%s, %s, %s - %s, %llu - %llu, %llu, %llu\n", kind_s[bursts[i].kind], dir_s.c_str(),
+      parse_datetimemicro(bursts[i].start_ts, lt).c_str(), parse_datetimemicro(bursts[i].end_ts, lt).c_str(),
+      bursts[i].start_usn, bursts[i].end_usn, bursts[i].count, bursts[i].peak);
+    if(i >= 1024) {
+      fprintf(fp_ofreport, "reached 1024 bursts...skip the rest\n");
       break;
-    }      
+    }
   }
 
-  printf("...Done\n");  
-
-  return 0;
+  console("...Done\n");
+  return bursts.size();
 }
 
 // for -r option output header
@@ -726,25 +1508,6 @@ int UsnJrnl::WriteAllHeader(FILE *fp, bool lt) {
   return 0;
 }
 
-void UsnJrnl::FindInsertCount(string *name, string ext, map<string, uint16_t> *table) {
-  
-  uint8_t start = (*name).size()-ext.size();
-
-#ifdef _WIN32
-  if (stricmp((*name).substr(start, ext.size()).c_str(), ext.c_str()) == 0) {
-#else
-  if (strcasecmp((*name).substr(start, ext.size()).c_str(), ext.c_str()) == 0) {  
-#endif
-//  if((*name).find(ext, (*name).size()-strlen(ext)) != string::npos) {
-    if((*table).find(*name) == (*table).end())
-      (*table).insert(make_pair((*name), 1));
-    else
-      (*table)[*(name)]++;
-    return;
-  }
-  return;
-}
-
 void UsnJrnl::WriteFileNameList(string name, map<string, uint16_t> *table){
   fprintf(fp_ofreport, "\n[%s] %lu files (name, count)\n", name.c_str(), (*table).size());
   int i=0;
@@ -767,46 +1530,41 @@ int UsnJrnl::WriteAllRecords(char *odname, bool lt) {
   ofraw = string(odname) + SEP + "usn_parse_all.csv";
 
   if((fp_ofraw = fopen(ofraw.c_str(), "w")) == NULL) {
-    perror("Output All Raw File Error");
-    exit(EXIT_FAILURE);
+    fatal("Output All Raw File Error", USN_ANALYTICS_E_OUTPUT);
   } 
 
-  uint64_t usn_num = usn_set.size();
-  printf("%8lu corrupt records skipped\n", corrupt_offset_set.size());
-  printf("%8llu records found\n", usn_num);
-  fprintf(fp_ofreport, "%8lu corrupt records skipped\n", corrupt_offset_set.size());
-  fprintf(fp_ofreport, "%8llu records\n", usn_num);   
-
-  // USN Sort & Deduplication
-  sort(usn_set.begin(), usn_set.end());
-  usn_set.erase(std::unique(usn_set.begin(), usn_set.end()), usn_set.end());
-  if (usn_num != usn_set.size()) {
-    printf("%8llu duplicate records found\n", usn_num - usn_set.size()); 
-    printf("%8lu unique records found\n", usn_set.size()); 
-    fprintf(fp_ofreport, "%8llu duplicate records\n", usn_num - usn_set.size()); 
-    fprintf(fp_ofreport, "%8lu unique records\n", usn_set.size()); 
-  }
+  PreProcess();
 
   WriteAllHeader(fp_ofraw, lt);
-  printf("Write all records");
+  console("Write all records");
 
-  uint64_t usn_set_size = usn_set.size();
+  uint64_t usn_set_size = UsnNum();
   uint64_t i=1;
   uint64_t progress = usn_set_size / 10;
 
   UsnRecord* ur = 0;
-  ur = new UsnRecord(fp_in);
+  ur = NewRecord();
 
-  for(uint64_t x: usn_set) {
-    ur->ReadParseWriteRecord(fp_ofraw, usn_table[x]);
+  for(uint64_t k=0; k < usn_set_size; k++) {
+    ur->ReadParseRecord(OffsetAt(k));
+    if (filter == NULL || filter->Match(ur->usn_record.Usn, ur->usn_record.TimeStamp, ur->usn_record.Reason, ur->file_name))
+      ur->WriteRecord(fp_ofraw);
+    else
+      filtered_pack++;
     if (i >= progress) {
-  	  printf(".");
+  	  console(".");
       progress += usn_set_size / 10;
     }
+    if (status != NULL && (i & PROGRESS_MASK) == 0)
+      status->records.store(i, memory_order_relaxed);
     ++i;
   }
   
-  printf("Done\n");
+  console("Done\n");
+  if (filter != NULL) {
+    console("%8llu records dropped by filter\n", filtered_pack);
+    fprintf(fp_ofreport, "%8llu records dropped by filter\n", filtered_pack);
+  }
   delete ur;
   fclose(fp_ofraw);
   return 0;
@@ -11,6 +11,13 @@ using namespace std;
 
 UsnRecord::UsnRecord(FILE* fp) {
   fp_in = fp;
+  fp_srcs = NULL;
+}
+
+// Read records of several inputs, offsets carry source index
+UsnRecord::UsnRecord(vector<FILE*> *fps) {
+  fp_in = (*fps)[0];
+  fp_srcs = fps;
 }
 
 #ifdef __APPLE__
@@ -23,6 +30,22 @@ UsnRecord::UsnRecord(FILE* fp) {
 int UsnRecord::IsValidRecord(uint64_t _offset) {
 
   UsnRecord::ReadRecord(_offset);
+  return UsnRecord::CheckRecord();
+}
+
+// Check memory read by scanner starts from USN_RECORD
+// [in] p: at least sizeof(USN_RECORD_V2) bytes, _offset: offset of p in input
+// return: USN_RECORD_TYPE
+int UsnRecord::IsValidRecord(const unsigned char *p, uint64_t _offset) {
+
+  offset = _offset;
+  memcpy(&(usn_record), p, sizeof(USN_RECORD_V2));
+  return UsnRecord::CheckRecord();
+}
+
+// Validate usn_record member
+// return: USN_RECORD_TYPE
+int UsnRecord::CheckRecord() {
 
   // validation check
   if(usn_record.RecordLength < 64 || usn_record.RecordLength > 576 || usn_record.RecordLength % 8 != 0)
@@ -50,20 +73,20 @@ int UsnRecord::IsValidRecord(uint64_t _offset) {
 
 // Read as USN_RECORD_V2 at offset and store usn_record member 
 int UsnRecord::ReadRecord(uint64_t _offset) {
+  unsigned char buf[sizeof(USN_RECORD_V2)];
   
+  if (fp_srcs != NULL) {
+    fp_in = (*fp_srcs)[_offset >> SOURCE_SHIFT];
+    _offset &= SOURCE_OFFSET_MASK;
+  }
   offset = _offset;
-  data = (unsigned char*)malloc(sizeof(USN_RECORD_V2));
 
   fseeko64(fp_in, offset, SEEK_SET);
 
-  if(fread(data, 1, sizeof(USN_RECORD_V2), fp_in) != sizeof(USN_RECORD_V2)) {
-    free(data);
+  if(fread(buf, 1, sizeof(USN_RECORD_V2), fp_in) != sizeof(USN_RECORD_V2))
     return -1;
-  }
 
-  memcpy(&(usn_record), data, sizeof(USN_RECORD_V2));
-    
-  free(data);
+  memcpy(&(usn_record), buf, sizeof(USN_RECORD_V2));
   return 0;
 }
 
@@ -80,16 +103,17 @@ int UsnRecord::ParseRecord() {
 }
 
 // Read file name and Convert UTF16 to UTF8
+// name buffer and file_name keep their capacity, so a decoder reused for
+// many records doesn't allocate once they have grown to the longest name
 int UsnRecord::GetFileName() {
 
-  data = (unsigned char*)malloc(usn_record.FileNameLength);
+  if (data.size() < usn_record.FileNameLength)
+    data.resize(usn_record.FileNameLength);
   fseeko64(fp_in, offset + usn_record.FileNameOffset, SEEK_SET);
-  if(fread(data, 1, usn_record.FileNameLength, fp_in) != usn_record.FileNameLength) {
-    free(data);
+  if(fread(data.data(), 1, usn_record.FileNameLength, fp_in) != usn_record.FileNameLength)
     return -1;
-  }
 
-  file_name = UTF16toUTF8((char16_t*)(data), usn_record.FileNameLength/2);
+  UTF16toUTF8((const char16_t*)(data.data()), usn_record.FileNameLength/2, &file_name);
 
   // remove illegal characer
   size_t pos;
@@ -99,7 +123,6 @@ int UsnRecord::GetFileName() {
   if (usn_record.FileAttributes & FOLDER)
     file_name += "\\";
   
-  free(data);
   return 0;
 }
 
@@ -111,7 +134,7 @@ int UsnRecord::ReadParseRecord(uint64_t offset) {
 
 // Write a record with all fields
 int UsnRecord::WriteRecord(FILE *fp) {
-  string reasons_s, attrs_s, timestamp_s;
+  char timestamp_s[32];
   fprintf(fp, "\"%llu\"\t", offset);
   fprintf(fp, "\"%u\"\t", usn_record.RecordLength);
   fprintf(fp, "\"%hu\"\t", usn_record.MajorVersion);
@@ -121,14 +144,12 @@ int UsnRecord::WriteRecord(FILE *fp) {
   fprintf(fp, "\"%u\"\t", pid);
   fprintf(fp, "\"%hu\"\t", pid_seq);
   fprintf(fp, "\"%llu\"\t", usn_record.Usn);
-  timestamp_s = parse_datetimemicro(usn_record.TimeStamp, lt);
-  fprintf(fp, "\"%s\"\t", timestamp_s.c_str());
-  parse_reason(usn_record.Reason, &(reasons_s));
-  fprintf(fp, "\"%s(%08x)\"\t", reasons_s.c_str(), usn_record.Reason);
+  format_datetimemicro(usn_record.TimeStamp, lt, timestamp_s);
+  fprintf(fp, "\"%s\"\t", timestamp_s);
+  fprintf(fp, "\"%s(%08x)\"\t", reason_name(usn_record.Reason).c_str(), usn_record.Reason);
   fprintf(fp, "\"%u\"\t", usn_record.SourceInfo);
   fprintf(fp, "\"%u\"\t", usn_record.SecurityId);
-  parse_file_attr(usn_record.FileAttributes, &(attrs_s));
-  fprintf(fp, "\"%s(%04x)\"\t", attrs_s.c_str(), usn_record.FileAttributes);
+  fprintf(fp, "\"%s(%04x)\"\t", file_attr_name(usn_record.FileAttributes).c_str(), usn_record.FileAttributes);
   fprintf(fp, "\"%hu\"\t", usn_record.FileNameLength);
   fprintf(fp, "\"%hu\"\t", usn_record.FileNameOffset);  
   fprintf(fp, "\"%s\"", file_name.c_str());
@@ -149,77 +170,121 @@ UsnMain::UsnMain() {
 int UsnMain::StoreRecord(UsnRecord* ur) {
   usn = ur->usn_record.Usn;
   timestamp_i = ur->usn_record.TimeStamp;
-  timestamp_s = parse_datetimemicro(ur->usn_record.TimeStamp, lt);
   file_name = ur->file_name;
   reasons_i = ur->usn_record.Reason;
-  parse_reason(ur->usn_record.Reason, &(reasons_s));
   attrs_i = ur->usn_record.FileAttributes;
-  parse_file_attr(ur->usn_record.FileAttributes, &(attrs_s)); 
   cid = ur->cid;
+  cid_seq = ur->cid_seq;
   pid = ur->pid;
+  pid_seq = ur->pid_seq;
   return 0;
 }
 
 int UsnMain::StoreRecord(UsnRecord* ur, uint16_t _rec_cnt, double _time_taken) {
-  usn = ur->usn_record.Usn;
+  UsnMain::StoreRecord(ur);
   rec_cnt = _rec_cnt;
-  timestamp_i = ur->usn_record.TimeStamp;
-  timestamp_s = parse_datetimemicro(ur->usn_record.TimeStamp, lt);
   time_taken = _time_taken;
-  file_name = ur->file_name;
-  reasons_i = ur->usn_record.Reason;
-  parse_reason(ur->usn_record.Reason, &(reasons_s));
-  attrs_i = ur->usn_record.FileAttributes;
-  parse_file_attr(ur->usn_record.FileAttributes, &(attrs_s)); 
-  cid = ur->cid;
-  pid = ur->pid;
   return 0;
 }
 
 // Write a record with primary fields
 int UsnMain::WriteBundledRecord(FILE *fp) {
-  fprintf(fp, "\"%llu\"\t", usn);
-  fprintf(fp, "\"%u\"\t", rec_cnt);
-  fprintf(fp, "\"%s\"\t", timestamp_s.c_str());
-  fprintf(fp, "\"%f\"\t", time_taken);
-  fprintf(fp, "\"%s\"\t", file_name.c_str());
-  fprintf(fp, "\"%s\"\t", reasons_s.c_str());
-  fprintf(fp, "\"%s\"\t", attrs_s.c_str());
-  fprintf(fp, "\"%u\"\t", cid);
-  fprintf(fp, "\"%u\"\t", pid);
-  fprintf(fp, "\"%s\"\t", file_path.c_str());
-  fprintf(fp, "\n");
+  string line;
+  FormatBundledRecord(&line);
+  fputs(line.c_str(), fp);
+  return 0;
+}
+
+// Append a record with primary fields to out (same format as WriteBundledRecord)
+int UsnMain::FormatBundledRecord(string *out) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "\"%llu\"\t\"%u\"\t\"", usn, rec_cnt);
+  *out += buf;
+  format_datetimemicro(timestamp_i, lt, buf);
+  *out += buf;
+  snprintf(buf, sizeof(buf), "\"\t\"%f\"\t\"", time_taken);
+  *out += buf;
+  *out += file_name;
+  *out += "\"\t\"";
+  *out += reason_name(reasons_i);
+  *out += "\"\t\"";
+  *out += file_attr_name(attrs_i);
+  snprintf(buf, sizeof(buf), "\"\t\"%u\"\t\"%u\"\t\"", cid, pid);
+  *out += buf;
+  *out += file_path;
+  *out += "\"\t\n";
   return 0;
 }
 
+static void write_double(FILE *fp, double v) {
+  uint64_t u;
+  memcpy(&u, &v, sizeof(u));
+  write_u64(fp, u);
+}
+
+static double read_double(FILE *fp) {
+  uint64_t u = read_u64(fp);
+  double v;
+  memcpy(&v, &u, sizeof(v));
+  return v;
+}
+
+// Write all fields (checkpoint tail, spilled rows of memory budget mode)
+void UsnMain::Save(FILE *fp) const {
+  write_u64(fp, usn);
+  write_u64(fp, rec_cnt);
+  write_u64(fp, timestamp_i);
+  write_double(fp, time_taken);
+  write_str(fp, file_name);
+  write_u64(fp, reasons_i);
+  write_u64(fp, attrs_i);
+  write_u64(fp, cid);
+  write_u64(fp, cid_seq);
+  write_u64(fp, pid);
+  write_u64(fp, pid_seq);
+  write_str(fp, file_path);
+}
+
+// Read fields written by Save
+void UsnMain::Load(FILE *fp) {
+  usn = read_u64(fp);
+  rec_cnt = read_u64(fp);
+  timestamp_i = read_u64(fp);
+  time_taken = read_double(fp);
+  file_name = read_str(fp);
+  reasons_i = read_u64(fp);
+  attrs_i = read_u64(fp);
+  cid = read_u64(fp);
+  cid_seq = read_u64(fp);
+  pid = read_u64(fp);
+  pid_seq = read_u64(fp);
+  file_path = read_str(fp);
+}
+
 UsnExecuted::UsnExecuted() {
 }
 
-int UsnExecuted::StoreRecord(UsnMain* um, uint16_t _exe_cnt) {
-  usn = um->usn;
-  timestamp_s = um->timestamp_s;
-  file_name = um->file_name;
-  exe_name = file_name.substr(0, file_name.size()-12); // "-XXXXXXXX.pf" length 
+int UsnExecuted::StoreRecord(const UsnMain* _um, uint16_t _exe_cnt) {
+  um = _um;
+  exe_name = um->file_name.substr(0, um->file_name.size()-12); // "-XXXXXXXX.pf" length 
   transform(exe_name.begin(), exe_name.end(), exe_name.begin(), ::tolower);  
   exe_cnt = _exe_cnt;
-  rec_cnt = um->rec_cnt;
-  reasons_s = um->reasons_s;  
-  time_taken = um->time_taken;
-  cid = um->cid;
   return 0;
 }
 
 // Write a record for prefetch file record
 int UsnExecuted::WriteExecutedRecord(FILE *fp) {
-  fprintf(fp, "\"%llu\"\t", usn);
-  fprintf(fp, "\"%s\"\t", timestamp_s.c_str());
+  char ts[32];
+  format_datetimemicro(um->timestamp_i, lt, ts);
+  fprintf(fp, "\"%llu\"\t", um->usn);
+  fprintf(fp, "\"%s\"\t", ts);
   fprintf(fp, "\"%s\"\t", exe_name.c_str());
   fprintf(fp, "\"%u\"\t", exe_cnt);
-  fprintf(fp, "\"%s\"\t", file_name.c_str());
-  fprintf(fp, "\"%s\"\t", reasons_s.c_str());
-  fprintf(fp, "\"%u\"\t", rec_cnt);
-  fprintf(fp, "\"%f\"\t", time_taken);
-  fprintf(fp, "\"%u\"\t", cid);
+  fprintf(fp, "\"%s\"\t", um->file_name.c_str());
+  fprintf(fp, "\"%s\"\t", reason_name(um->reasons_i).c_str());
+  fprintf(fp, "\"%u\"\t", um->rec_cnt);
+  fprintf(fp, "\"%f\"\t", um->time_taken);
+  fprintf(fp, "\"%u\"\t", um->cid);
   fprintf(fp, "\n");
   return 0;
 }
@@ -227,31 +292,24 @@ int UsnExecuted::WriteExecutedRecord(FILE *fp) {
 UsnOpened::UsnOpened() {
 }
 
-int UsnOpened::StoreRecord(UsnMain* um) {
-  usn = um->usn;
-  timestamp_s = um->timestamp_s;
-  file_path = um->file_path;
-  file_name = um->file_name;
-  reasons_s = um->reasons_s;  
-  rec_cnt = um->rec_cnt;
-  time_taken = um->time_taken;
-  cid = um->cid;
-  pid = um->pid;
+int UsnOpened::StoreRecord(const UsnMain* _um) {
+  um = _um;
   return 0;
 }
 
 // Write a record for lnk/objectid file
 int UsnOpened::WriteOpenedRecord(FILE *fp) {
-  fprintf(fp, "\"%llu\"\t", usn);
-  fprintf(fp, "\"%s\"\t", timestamp_s.c_str());
-  fprintf(fp, "\"%s\"\t", file_path.c_str());
-  fprintf(fp, "\"%s\"\t", file_name.c_str());
-  fprintf(fp, "\"%s\"\t", reasons_s.c_str());
-  fprintf(fp, "\"%u\"\t", rec_cnt);
-  fprintf(fp, "\"%f\"\t", time_taken);
-  fprintf(fp, "\"%u\"\t", cid);
-  fprintf(fp, "\"%u\"\t", pid);
+  char ts[32];
+  format_datetimemicro(um->timestamp_i, lt, ts);
+  fprintf(fp, "\"%llu\"\t", um->usn);
+  fprintf(fp, "\"%s\"\t", ts);
+  fprintf(fp, "\"%s\"\t", um->file_path.c_str());
+  fprintf(fp, "\"%s\"\t", um->file_name.c_str());
+  fprintf(fp, "\"%s\"\t", reason_name(um->reasons_i).c_str());
+  fprintf(fp, "\"%u\"\t", um->rec_cnt);
+  fprintf(fp, "\"%f\"\t", um->time_taken);
+  fprintf(fp, "\"%u\"\t", um->cid);
+  fprintf(fp, "\"%u\"\t", um->pid);
   fprintf(fp, "\n");
   return 0;
 }
-
@@ -4,7 +4,10 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstdarg>
+#include <cerrno>
 #include <vector>
+#include <algorithm>
 #include <ctype.h>
 #include <ctime>
 #include <stdint.h>
@@ -15,6 +18,18 @@
 
 using namespace std;
 
+// global variables shared by the command line and the library
+bool lt = true; // localtime or UTC
+bool raw = false; // output all of raw records
+bool resume = false; // continue from checkpoint of previous run
+bool quiet = false; // suppress progress output
+thread_local int fatal_throw = 0;
+
+#ifdef _WIN32
+  char SEP = '\\';
+#else // unix
+ char SEP = '/';
+#endif
 
 // To handle processing time
 timer::timer() {
@@ -30,6 +45,50 @@ timer::~timer() {
   printf("Processed Time: %ld(s)\n", (t_end-t_start));
 }
 
+// Print progress/status to stdout unless quiet
+void console(const char *fmt, ...) {
+  va_list ap;
+  if (quiet)
+    return;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  fflush(stdout);
+}
+
+// perror(what) and exit, or throw to the library API call on this thread
+void fatal(const char *what, int code) {
+  if (fatal_throw > 0) {
+    fatal_error e;
+    e.code = code;
+    e.message = what;
+    if (errno != 0)
+      e.message += string(": ") + strerror(errno);
+    throw e;
+  }
+  if (errno != 0)
+    perror(what);
+  else
+    fprintf(stderr, "%s\n", what);
+  exit(EXIT_FAILURE);
+}
+
+// Thread safe localtime/gmtime
+static struct tm *get_tm(time_t *epoch, bool lt, struct tm *result) {
+#ifdef _WIN32
+  if (lt)
+    localtime_s(result, epoch);
+  else
+    gmtime_s(result, epoch);
+#else
+  if (lt)
+    localtime_r(epoch, result);
+  else
+    gmtime_r(epoch, result);
+#endif
+  return result;
+}
+
 // Check specified directory is empty
 bool is_empty_dir(const char *out_dname){
   DIR *pdir;
@@ -50,6 +109,65 @@ bool is_empty_dir(const char *out_dname){
   return true;
 }
 
+// Check specified path is directory
+bool is_dir(const char *dname) {
+  struct stat st;
+  if (stat(dname, &st) != 0)
+    return false;
+  return S_ISDIR(st.st_mode);
+}
+
+// List regular files in directory (not recursive), sorted by name
+vector<string> list_dir_files(const char *dname) {
+  vector<string> files;
+  DIR *pdir;
+  struct dirent *pent;
+  struct stat st;
+
+  if((pdir = opendir(dname)) == NULL)
+    return files;
+  for(pent = readdir(pdir); pent != NULL; pent = readdir(pdir)) {
+    string path = string(dname) + SEP + pent->d_name;
+    if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.push_back(path);
+  }
+  closedir(pdir);
+  sort(files.begin(), files.end());
+  return files;
+}
+
+// Subdirectories of dname in name order
+vector<string> list_dir_subdirs(const char *dname) {
+  vector<string> dirs;
+  DIR *pdir;
+  struct dirent *pent;
+  struct stat st;
+
+  if((pdir = opendir(dname)) == NULL)
+    return dirs;
+  for(pent = readdir(pdir); pent != NULL; pent = readdir(pdir)) {
+    if(strcmp(pent->d_name, ".") == 0 || strcmp(pent->d_name, "..") == 0)
+      continue;
+    string path = string(dname) + SEP + pent->d_name;
+    if(stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      dirs.push_back(path);
+  }
+  closedir(pdir);
+  sort(dirs.begin(), dirs.end());
+  return dirs;
+}
+
+// Last component of path
+string get_base_name(const string &path) {
+  string name = path;
+  while(name.size() > 1 && (name.back() == '/' || name.back() == '\\'))
+    name.pop_back();
+  size_t pos = name.find_last_of("/\\");
+  if(pos != string::npos)
+    name = name.substr(pos+1);
+  return name;
+}
+
 // Get file size specified with *in_fname 
 uint64_t get_file_size(const char *in_fname) {
   FILE *fp;
@@ -105,19 +223,45 @@ bool is_valid_ts(uint64_t value) {
     return true;  
 }
 
+// Binary helpers for sidecar files (native byte order)
+void write_u64(FILE *fp, uint64_t value) {
+  fwrite(&value, sizeof(value), 1, fp);
+}
+
+// return: 0 at end of file
+uint64_t read_u64(FILE *fp) {
+  uint64_t value = 0;
+  if (fread(&value, sizeof(value), 1, fp) != 1)
+    return 0;
+  return value;
+}
+
+void write_str(FILE *fp, const string &s) {
+  write_u64(fp, s.size());
+  fwrite(s.data(), 1, s.size(), fp);
+}
+
+string read_str(FILE *fp) {
+  uint64_t len = read_u64(fp);
+  string s;
+  if (len > (1 << 20)) // longer than any name or path
+    return s;
+  s.resize(len);
+  if (len > 0 && fread(&s[0], 1, len, fp) != len)
+    s.clear();
+  return s;
+}
+
 // Convert a specified value as FILETIME to human readable string (s)
 string parse_datetime(uint64_t _time, bool lt) {
   char buf[32];
-  struct tm *tm_info;
+  struct tm *tm_info, tm_buf;
   time_t epoch;
 
   // 11644473600 seconds from 1601/01/01 to 1970/01/01
   epoch = _time/(10*1000*1000) - 11644473600L;
 
-  if(lt)
-    tm_info = localtime(&epoch);
-  else
-    tm_info = gmtime(&epoch);
+  tm_info = get_tm(&epoch, lt, &tm_buf);
 
   strftime(buf, 20, "%Y/%m/%d %H:%M:%S", tm_info);
   
@@ -127,16 +271,13 @@ string parse_datetime(uint64_t _time, bool lt) {
 // Convert a specified value as FILETIME to human readable string (s)
 string parse_datetime_iso8601(uint64_t _time, bool lt) {
   char buf[32];
-  struct tm *tm_info;
+  struct tm *tm_info, tm_buf;
   time_t epoch;
 
   // 11644473600 seconds from 1601/01/01 to 1970/01/01
   epoch = _time/(10*1000*1000) - 11644473600L;
 
-  if(lt)
-    tm_info = localtime(&epoch);
-  else
-    tm_info = gmtime(&epoch);
+  tm_info = get_tm(&epoch, lt, &tm_buf);
 
   strftime(buf, 16, "%Y%m%dT%H%M%S", tm_info);
   
@@ -145,26 +286,26 @@ string parse_datetime_iso8601(uint64_t _time, bool lt) {
 
 // Convert a specified value as FILETIME to human readable string (us)
 string parse_datetimemicro(uint64_t _time, bool lt) {  
-  char buf1[32], buf2[7];
-  struct tm *tm_info;
+  char buf[32];
+  format_datetimemicro(_time, lt, buf);
+  return string(buf);
+}
+
+// Same as parse_datetimemicro, written to buf without allocation
+// [out] buf: at least 32 bytes
+void format_datetimemicro(uint64_t _time, bool lt, char *buf) {
+  struct tm *tm_info, tm_buf;
   int microseconds;
   time_t epoch;
-  string time_str;
  
   // 11644473600.0 seconds from 1601/01/01 to 1970/01/01
   epoch = _time/(10*1000*1000) - 11644473600L;
   microseconds = (_time%(10*1000*1000))/10;
  
-  if(lt)
-    tm_info = localtime(&epoch);
-  else
-    tm_info = gmtime(&epoch);
+  tm_info = get_tm(&epoch, lt, &tm_buf);
  
-  strftime(buf1, 20, "%Y/%m/%d %H:%M:%S", tm_info);
-  sprintf(buf2, "%06d", microseconds);  
-  time_str = string(buf1) + "." + string(buf2);
-  
-  return time_str;
+  size_t n = strftime(buf, 20, "%Y/%m/%d %H:%M:%S", tm_info);
+  sprintf(buf+n, ".%06d", microseconds);
 }
 
 // Multiple string list join up with delimiter to one string
@@ -289,19 +430,50 @@ uint16_t parse_reason(uint32_t flags, string *reasons_str) {
   return reason_str.size();
 }
 
+// Human readable USN_REASON/FILE_ATTRIBUTE of a flag value, cached per thread
+// Flag combinations seen in a journal are few, so packed records keep only the
+// values and output reuses these strings.
+const string& reason_name(uint32_t flags) {
+  static thread_local unordered_map<uint32_t, string> names;
+  auto itr = names.find(flags);
+  if (itr == names.end()) {
+    itr = names.insert(make_pair(flags, string())).first;
+    parse_reason(flags, &itr->second);
+  }
+  return itr->second;
+}
+
+const string& file_attr_name(uint32_t flags) {
+  static thread_local unordered_map<uint32_t, string> names;
+  auto itr = names.find(flags);
+  if (itr == names.end()) {
+    itr = names.insert(make_pair(flags, string())).first;
+    parse_file_attr(flags, &itr->second);
+  }
+  return itr->second;
+}
+
 // Convert UTF16 to UTF8
 // [in] s: UTF16 string, n: size
 // return: UTF8 string
 // ref: ntfs-3g, unistr.c
 string UTF16toUTF8(char16_t *s, int n) {
-  int half = 0;
-  char *out = (char*)malloc(6);
   string res;
+  UTF16toUTF8(s, n, &res);
+  return res;
+}
 
+// Same as above, written to res so that its buffer is reused
+// return: 0, -1 if it can't be converted (res is "<Can't Convert>")
+int UTF16toUTF8(const char16_t *s, int n, string *res) {
+  int half = 0;
+  char out[7];
+
+  res->clear();
   for (int i = 0; i < n; ++i) {
     uint16_t c = s[i];
     char *t = out;
-    memset(t, 0, 6);
+    memset(t, 0, sizeof(out));
     if (half) {
       if ((c >= 0xdc00) && (c < 0xe000)) {
         *t++ = 0xf0 + (((half + 64) >> 8) & 7);
@@ -310,7 +482,8 @@ string UTF16toUTF8(char16_t *s, int n) {
         *t++ = 0x80 + (c & 63);
         half = 0;
       } else {
-        return "<Can't Convert>";
+        *res = "<Can't Convert>";
+        return -1;
       }
     } else if (c < 0x80) {
       *t++ = c;
@@ -329,13 +502,13 @@ string UTF16toUTF8(char16_t *s, int n) {
         *t++ = 0x80 | ((c >> 6) & 0x3f);
         *t++ = 0x80 | (c & 0x3f);
       } else {
-        return "<Can't Convert>";
+        *res = "<Can't Convert>";
+        return -1;
       }
     }
-    res += string(out);
+    *res += out;
   }
-  free(out);
-  return res;
+  return 0;
 }
 
 
@@ -345,15 +518,15 @@ string get_timezone_str(bool lt) {
   if (lt) {
     time_t t1, t2;
     time(&t1);
-    struct tm *tm_info;
+    struct tm *tm_info, tm_buf;
     int tz_hour, tz_min;
     char tzstr[16];
 
-    tm_info = localtime(&t1);
+    tm_info = get_tm(&t1, true, &tm_buf);
     tz_hour = tm_info->tm_hour;
     tz_min = tm_info->tm_min;	
 
-    tm_info = gmtime(&t1);
+    tm_info = get_tm(&t1, false, &tm_buf);
     tz_hour -= tm_info->tm_hour;
     tz_min -= tm_info->tm_min;
 
@@ -378,4 +551,71 @@ string get_timezone_str(bool lt) {
     return "+00:00";
 }
 
+// Escape a string for JSON output
+string json_str(const string &s) {
+  string r = "\"";
+  char buf[8];
+  for (unsigned char c: s) {
+    if (c == '"' || c == '\\') {
+      r += '\\';
+      r += c;
+    } else if (c < 0x20) {
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      r += buf;
+    } else
+      r += c;
+  }
+  return r + "\"";
+}
+
+// Parse size with K/M/G/T suffix (1024 based)
+uint64_t parse_size(const char *s) {
+  char *end;
+  uint64_t v = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'T': case 't': v <<= 10; // fall through
+    case 'G': case 'g': v <<= 10; // fall through
+    case 'M': case 'm': v <<= 10; // fall through
+    case 'K': case 'k': v <<= 10;
+  }
+  return v;
+}
 
+// Bytes a string holds outside itself (none while it fits in its own buffer)
+uint64_t heap_size(const string &s) {
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+// Parse "YYYY-MM-DD[ HH:MM[:SS]]" ('/' and 'T' are also accepted) in local time or UTC
+// out: ts (FILETIME of its beginning), unit (FILETIME ticks of its precision)
+int parse_time(const char *s, bool lt, uint64_t *ts, uint64_t *unit) {
+  struct tm tm_info;
+  int n;
+  time_t epoch;
+
+  memset(&tm_info, 0, sizeof(tm_info));
+  n = sscanf(s, "%d%*[-/]%d%*[-/]%d%*[ T]%d:%d:%d", &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday,
+    &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec);
+  if (n != 3 && n != 5 && n != 6)
+    return -1;
+  if (tm_info.tm_mon < 1 || tm_info.tm_mon > 12 || tm_info.tm_mday < 1 || tm_info.tm_mday > 31
+    || tm_info.tm_hour > 23 || tm_info.tm_min > 59 || tm_info.tm_sec > 59)
+    return -1;
+  tm_info.tm_year -= 1900;
+  tm_info.tm_mon -= 1;
+  tm_info.tm_isdst = -1;
+  if (lt)
+    epoch = mktime(&tm_info);
+  else
+#ifdef _WIN32
+    epoch = _mkgmtime(&tm_info);
+#else
+    epoch = timegm(&tm_info);
+#endif
+  if (epoch == (time_t)-1)
+    return -1;
+  // 11644473600 seconds from 1601/01/01 to 1970/01/01
+  *ts = (uint64_t(epoch) + 11644473600ULL) * 10000000;
+  *unit = (n == 3 ? 86400ULL : n == 5 ? 60ULL : 1ULL) * 10000000;
+  return 0;
+}
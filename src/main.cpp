@@ -1,125 +1,897 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <cerrno>
 #include <ctime>
+#include <new>
 #include <getopt.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <set>
 #include <sys/stat.h> // handle file/directory 
 #ifdef _WIN32
   #include <direct.h> // directory creation
 #endif
 
+// before usnjrnl.h, which leaves pack(1) on
+#include "ntfsimage.h"
+#include "timelinemerge.h"
 #include "usnjrnl.h"
 #include "utils.h"
+#include "compressedinput.h"
 
 using namespace std;
 
-// global variables
-bool lt = true; // localtime or UTC
-bool raw = false; // output all of raw records
-
-#ifdef _WIN32
-  char SEP = '\\';
-#else // unix
- char SEP = '/';
-#endif
+// global variables (lt, raw, resume, quiet and SEP are in lib/utils.cpp)
+char *iocfname = NULL; // IOC rule file, built-in rules if NULL
+uint32_t burst_window = 60; // seconds
+uint32_t burst_threshold = 100; // records in window
+bool batch = false; // process each input into its own subdirectory
+char *cdcfname = NULL; // chunk cache sidecar, not used if NULL
+char *idxfname = NULL; // scan index of previous run, not used if NULL
+char *mftfname = NULL; // $MFT of the volume, not used if NULL
+bool follow = false; // keep processing records appended to input
+bool multi = false; // every input is a journal of the same volume, one output
+vector<string> sources; // inputs of multi-source mode
+uint32_t follow_latency = 2; // seconds
+uint32_t threads = 0; // 0: number of cores
+WorkStealingPool *pool = NULL;
+PerfCounters *perf = NULL; // hardware counters per stage, not used if NULL
+Progress *progress = NULL; // JSON lines progress channel, not used if NULL
+uint32_t progress_interval = 1000; // milliseconds
+uint64_t memory_budget = 0; // bytes per input, 0: no limit
+RecordFilter filter; // --from/--to/--usn-range/--reason-mask/--name, used if Active()
+bool history_index = false; // write usn_analytics.hidx for the query subcommand
+bool dir_tree = false; // write usn_analytics.dtree for the query subcommand
+bool ntfs_image = false; // input is an NTFS volume image, $UsnJrnl:$J is read through $MFT
 
 void usage(void) {
 	printf("USN Analytics (https://www.kazamiya.net/usn_analytics/) v.201801\n\n");
-	printf("Usage  : usn_analytics.exe [-ru] -o output input\n\n");
+	printf("Usage  : usn_analytics.exe [-ru] [-i rules] [--burst-window sec] [--burst-threshold n] -o output input\n");
+	printf("         usn_analytics.exe -b [-t threads] [options] -o output input|dir...\n");
+	printf("         usn_analytics.exe --resume [options] -o output input\n");
+	printf("         usn_analytics.exe -m [options] -o output live_input vss_input...\n");
+	printf("         usn_analytics.exe query [--id n]... [--name name]... output\n");
+	printf("         usn_analytics.exe query [-u] [--tree] [--path id]... [--at-usn n|--at time] output\n");
+	printf("         usn_analytics.exe merge [-u] [-o file] [source=]output...\n\n");
 	printf("     -r: parse all of USN_RECORD and write to all.csv with raw style\n");
+	printf("     -i: load IOC rules (kind<TAB>pattern[<TAB>group] per line,\n");
+	printf("         kind is name/ext/substr/path) instead of built-in rules\n");
 	printf("     -u: treat a timestamp as UTC (default: Local Time)\n");
+	printf("  --burst-window sec : window for mass-modification detection (default: 60)\n");
+	printf("  --burst-threshold n: records in window to report a burst (default: 100)\n");
+	printf("     -b: batch mode, process every input (or file in dir) into out/<name>/\n");
+	printf("         and write out/usn_analytics_batch_report.txt\n");
+	printf("     -t: number of worker threads (default: number of cores)\n");
+	printf("     -m: multi-source mode, deduplicate records of the same volume (live $J\n");
+	printf("         and $J of shadow copies) across inputs into one output\n");
+	printf("  --chunk-cache file: reuse scan results of unchanged regions of a previous\n");
+	printf("                      acquisition stored in file, and update it\n");
+	printf("  --mft file: resolve directory paths with $MFT of the same volume\n");
+	printf("  --index file: skip scanning if file (usn_analytics.usnidx written by a\n");
+	printf("                previous run) was made from the same input\n");
+	printf("  --follow: keep tailing input and append records as it grows (Ctrl-C to stop)\n");
+	printf("  --follow-latency sec: write records when input is idle this long (default: 2)\n");
+	printf("  --perf-counters: add cycles, instructions, cache/branch misses per stage\n");
+	printf("                   to report and metrics.json (Linux)\n");
+	printf("  --progress fd|socket: write progress as JSON lines to file descriptor fd\n");
+	printf("                        or Unix domain socket (stage, counts, rate, ETA)\n");
+	printf("  --progress-interval ms: interval of progress lines (default: 1000)\n");
+	printf("  --memory-budget n[KMG]: spill scanned records to sorted runs in output\n");
+	printf("                          directory and merge them from disk when records\n");
+	printf("                          exceed n/2, and packed records when they and the\n");
+	printf("                          directory tables (kept in memory) exceed n/2\n");
+	printf("                          (scan is sequential, no scan index)\n");
+	printf("  --from time, --to time: packed records in the time window (yyyy-mm-dd[ hh:mm:ss])\n");
+	printf("  --usn-range from-to: packed records in the usn range (either side may be omitted)\n");
+	printf("  --reason-mask reasons: packed records with any of reasons (names joined with '|')\n");
+	printf("  --name glob: packed records with a matching name (* and ?, may be repeated)\n");
+	printf("               with a filter, packing never spans an hour or 16MB of usn, so\n");
+	printf("               rows do not depend on where the window ends (a chain across\n");
+	printf("               such a boundary is split, without a filter it is one row)\n");
+	printf("  --history-index: write usn_analytics.hidx, an index of records by FileID and\n");
+	printf("                   file name for the query subcommand\n");
+	printf("  --dir-tree: write usn_analytics.dtree, every version of the directory tree,\n");
+	printf("              for the query subcommand\n");
+	printf("  --ntfs-image: input is a raw NTFS volume image, read only the allocated\n");
+	printf("                extents of $Extend\\$UsnJrnl:$J and resolve paths with its $MFT\n");
+	printf("  --resume: continue previous run in output directory with a grown input,\n");
+	printf("            only records after its checkpoint are processed and appended\n");
 	printf(" -o out: specify a output directory\n");
-	printf("     in: specify a bunch of data including USN_RECORD\n\n");
+	printf("     in: specify a bunch of data including USN_RECORD, may be compressed\n");
+	printf("         with gzip or zstd (seekable format)\n\n");
+	printf("  query: print records of files from an output directory written with\n");
+	printf("         --history-index, in usn order\n");
+	printf("  --id n     : records of FileID n, or of one file if n is a file reference\n");
+	printf("               with sequence number (FileID | sequence << 48)\n");
+	printf("  --name name: whole history of every file that ever had this file name\n");
+	printf("               (case-insensitive)\n");
+	printf("  --tree     : every directory (needs --dir-tree)\n");
+	printf("  --path id  : full path of directory id\n");
+	printf("  --at-usn n : as it was after record n (default: latest)\n");
+	printf("  --at time  : as it was at time (YYYY-MM-DD[ HH:MM[:SS]])\n\n");
+	printf("  merge: one timeline of the records of several output directories (e.g.\n");
+	printf("         one per host) ordered by TimeStamp with a Source column, records of\n");
+	printf("         a source stay in usn order; an output directory of -b stands for\n");
+	printf("         all of its inputs\n");
+	printf("  -o file   : write timeline to file (default: stdout)\n");
+	printf("  source=out: name of source in Source column (default: directory name)\n\n");
+}
+
+// Result of one input, for batch report
+struct process_result {
+  string ifname;
+  string error; // empty: processed
+  uint64_t bytes;
+  uint64_t records;
+  uint64_t corrupt;
+  uint64_t packed;
+  double seconds;
+};
+
+// Give up the current input after its error was printed, a batch worker
+// (fatal throws on it) reports it in the batch result instead of exiting
+// while other inputs are still processed
+static void fail_input(const char *what, int code) {
+  if (fatal_throw > 0) {
+    errno = 0;
+    fatal(what, code);
+  }
+  exit(EXIT_FAILURE);
 }
 
-void process(char *ifname, char *odname) {
+// Unregister a progress task when process() returns or throws
+struct progress_remove {
+  progress_task *task;
+  progress_remove() : task(NULL) {}
+  ~progress_remove() {
+    if (task != NULL)
+      progress->Remove(task);
+  }
+};
+
+// Pipeline stages and barriers
+//   read -> validate/decode : overlapped, GetAllUsnOffset (bounded block queue)
+//   sort/dedup              : barrier, needs every USN before packing
+//   pack -> detect          : inline, detectors are fed as records are packed
+//   path construction       : barrier, needs the complete directory table
+//   format -> write         : overlapped, WriteBundledRecords (bounded chunk queue)
+process_result process(char *ifname, char *odname) {
+  process_result result;
+  chrono::steady_clock::time_point t_start = chrono::steady_clock::now();
+
+  // registered before the journal opens it
+  NtfsImage *image = NULL;
+  if (ntfs_image) {
+    console("Load NTFS image");
+    if ((image = open_ntfs_image(ifname)) == NULL)
+      fail_input("NTFS Image Error", USN_ANALYTICS_E_INPUT);
+    console("...Done\n");
+  }
     
   UsnJrnl usnjrnl = UsnJrnl(ifname, odname);
+  Metrics metrics;
+  metrics.perf = perf;
+  usnjrnl.pool = pool;
+  usnjrnl.metrics = &metrics;
+  usnjrnl.memory_budget = memory_budget;
+  if (filter.Active())
+    usnjrnl.filter = &filter;
+  HistoryIndex history;
+  if (history_index)
+    usnjrnl.history = &history;
+  DirTree dtree;
+  if (dir_tree)
+    usnjrnl.dir_tree = &dtree;
+  progress_remove status;
+  if (progress != NULL)
+    usnjrnl.status = metrics.status = status.task = progress->Add(ifname, usnjrnl.file_size);
+  for (size_t i = 0; multi && i < sources.size(); i++)
+    usnjrnl.AddSource(&sources[i][0]);
+  // cached/indexed scan results of a filtered scan are not complete
+  if (cdcfname != NULL && !batch && !multi && memory_budget == 0 && usnjrnl.filter == NULL)
+    usnjrnl.chunk_cache_fname = cdcfname;
+
+  if (raw == false && usnjrnl.LoadIocRules(iocfname) < 0)
+    fail_input("IOC Rule File Error", USN_ANALYTICS_E_ARG);
+  if (image != NULL) {
+    console("%8llu MFT records (%llu directories)\n", image->mft.records, image->mft.directories);
+    console("%8llu bytes of $J allocated from offset %llu\n", image->allocated, image->data_begin);
+    fprintf(usnjrnl.fp_ofreport, "%8llu MFT records (%llu directories) loaded from NTFS image\n", image->mft.records, image->mft.directories);
+    fprintf(usnjrnl.fp_ofreport, "%8llu bytes of $J allocated from offset %llu\n", image->allocated, image->data_begin);
+    // the sparse head of $J has no records
+    usnjrnl.scan_begin = usnjrnl.data_begin = image->data_begin;
+    if (!raw)
+      usnjrnl.mft = &image->mft;
+  }
+  MftIndex mft;
+  if (mftfname != NULL && !batch && !raw) {
+    console("Load $MFT");
+    metrics.Begin("load_mft", 0);
+    if (mft.Load(mftfname) < 0)
+      fail_input("MFT File Error", USN_ANALYTICS_E_INPUT);
+    metrics.End(mft.records);
+    console("...Done\n%8llu MFT records (%llu directories)\n", mft.records, mft.directories);
+    fprintf(usnjrnl.fp_ofreport, "%8llu MFT records (%llu directories) loaded from %s\n", mft.records, mft.directories, mftfname);
+    usnjrnl.mft = &mft;
+  }
+  usnjrnl.burst_detector.window_ts = uint64_t(burst_window) * 10000000;
+  usnjrnl.burst_detector.dir_threshold = burst_threshold;
+  usnjrnl.burst_detector.global_threshold = burst_threshold;
+  if (resume) {
+    metrics.Begin("load_checkpoint", 0);
+    if (usnjrnl.LoadCheckpoint(odname) < 0)
+      fail_input("Checkpoint File Error", USN_ANALYTICS_E_INPUT);
+    metrics.End(usnjrnl.usnmain_set.size());
+  }
 
-  printf("Search USNRECORD");
-  usnjrnl.GetAllUsnOffset();
+  // scan stage includes loading the scan index
+  metrics.Begin("scan", 0);
+  if (multi) {
+    console("Search USNRECORD");
+    usnjrnl.GetAllUsnOffsetMulti();
+  } else if (idxfname != NULL && !resume && memory_budget == 0 && usnjrnl.filter == NULL && usnjrnl.LoadScanIndex(idxfname) == 0)
+    console("Scan index loaded\n");
+  else {
+    console("Search USNRECORD");
+    usnjrnl.GetAllUsnOffset();
+  }
+  metrics.End(usnjrnl.found_num > 0 ? usnjrnl.found_num : usnjrnl.usn_set.size());
+  // offsets of multi-source mode are not offsets of one input, spilled ones are on disk
+  if (!resume && !multi && usnjrnl.runs == NULL && usnjrnl.filter == NULL) {
+    metrics.Begin("save_index", usnjrnl.usn_set.size());
+    usnjrnl.SaveScanIndex(odname);
+    metrics.End(usnjrnl.usn_set.size());
+  }
   if (raw == true) {
+    metrics.Begin("write_all", usnjrnl.found_num > 0 ? usnjrnl.found_num : usnjrnl.usn_set.size());
     usnjrnl.WriteAllRecords(odname, lt);
+    metrics.End(usnjrnl.UsnNum());
   } else {
+    metrics.Begin("sort_dedup", usnjrnl.found_num > 0 ? usnjrnl.found_num : usnjrnl.usn_set.size());
     usnjrnl.PreProcess();
-    printf("Check records");
+    metrics.End(usnjrnl.UsnNum());
+    console("Check records");
+    usnjrnl.following = follow;
+    metrics.Begin("pack", usnjrnl.UsnNum());
     usnjrnl.CheckRecords();
-    printf("Path construction");
+    metrics.End(usnjrnl.MainNum());
+    console("Path construction");
     usnjrnl.PostProcess();
-    printf("Write records");
-    usnjrnl.WriteBundledRecords(odname, lt);
-    printf("Check executed trace");
-    usnjrnl.WriteExecutedRecords(odname, lt);
-    printf("Check opened trace");
-    usnjrnl.WriteOpenedRecords(odname, lt);
-    printf("Check suspicious trace");
-    usnjrnl.WriteSuspiciousInfo();
+    uint64_t packed = usnjrnl.MainNum();
+    if (usnjrnl.dir_tree != NULL) {
+      metrics.Begin("dir_tree", packed);
+      if (dtree.Write(odname) < 0)
+        fail_input("Directory Tree File Error", USN_ANALYTICS_E_OUTPUT);
+      metrics.End(packed);
+    }
+    console("Write records");
+    metrics.Begin("write_bundled", packed);
+    metrics.End(usnjrnl.WriteBundledRecords(odname, lt));
+    if (usnjrnl.history != NULL) {
+      console("Write history index");
+      metrics.Begin("history_index", packed);
+      if (history.Write(odname) < 0)
+        fail_input("History Index File Error", USN_ANALYTICS_E_OUTPUT);
+      metrics.End(packed);
+      console("...Done\n");
+    }
+    console("Check executed trace");
+    metrics.Begin("write_executed", packed);
+    metrics.End(usnjrnl.WriteExecutedRecords(odname, lt));
+    console("Check opened trace");
+    metrics.Begin("write_opened", packed);
+    metrics.End(usnjrnl.WriteOpenedRecords(odname, lt));
+    console("Check suspicious trace");
+    metrics.Begin("write_suspicious", packed);
+    metrics.End(usnjrnl.WriteSuspiciousInfo(odname, lt));
+    console("Check mass modification");
+    metrics.Begin("write_burst", packed);
+    metrics.End(usnjrnl.WriteBurstInfo(lt));
+  }
+  // follow passes are not measured, metrics describe the initial run
+  usnjrnl.metrics = NULL;
+  metrics.Write(odname, ifname, usnjrnl.file_size, pool != NULL ? pool->Size() : 1);
+  if (perf != NULL)
+    metrics.WriteReport(usnjrnl.fp_ofreport);
+  if (raw == false) {
+    if (follow && usnjrnl.status != NULL)
+      progress->Stage(usnjrnl.status, "follow", 0);
+    if (follow)
+      usnjrnl.Follow(odname, follow_latency);
+    else if (!multi)
+      usnjrnl.SaveCheckpoint(odname);
+  }
+
+  result.ifname = ifname;
+  result.bytes = usnjrnl.file_size;
+  result.records = usnjrnl.UsnNum();
+  result.corrupt = usnjrnl.corrupt_offset_set.size();
+  result.packed = usnjrnl.main_begin + usnjrnl.MainNum();
+  result.seconds = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+  return result;
+}
+
+// Create output directory, it must be new or empty
+void create_output_dir(const char *odname) {
+  struct stat st;
+  if (is_empty_dir(odname) == false) {
+    if (stat(odname, &st) == 0) {
+      std::cout << odname << " already exist" << std::endl;
+      std::cout << "Please specify a empty directory or new directory" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    int dresult;
+    // try to create directory
+#ifdef _WIN32
+    dresult = _mkdir(odname);
+#else
+    dresult = mkdir(odname, 0775);
+#endif
+
+    if(dresult != 0) {
+      std::cout << "unable to create " << odname << std::endl;
+      std::cout << "Please check existence of parent directory and/or permissions" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  } 
+}
+
+// Process inputs concurrently on the pool, each into odname/<name>/
+// Large inputs are submitted first and also split internally by GetAllUsnOffset.
+// return: -1 if an input failed, the others are processed anyway
+int process_batch(vector<string> &inputs, char *odname) {
+  vector<process_result> results(inputs.size());
+  vector<string> subdirs(inputs.size());
+  vector<uint64_t> sizes(inputs.size());
+  vector<size_t> order(inputs.size());
+  map<string, uint32_t> used_names;
+  TaskGroup group;
+  chrono::steady_clock::time_point t_start = chrono::steady_clock::now();
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    string name = get_base_name(inputs[i]);
+    if (used_names[name]++ > 0)
+      name += "-" + to_string(used_names[name]);
+    subdirs[i] = string(odname) + SEP + name;
+    create_output_dir(subdirs[i].c_str());
+    sizes[i] = get_file_size(inputs[i].c_str());
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+  printf("%lu inputs, %u threads\n", inputs.size(), pool->Size());
+  for (size_t i: order) {
+    pool->Submit(&group, [&results, &inputs, &subdirs, &sizes, i]() {
+      // an error of one input is reported here, fatal throws on this worker
+      fatal_throw++;
+      try {
+        results[i] = process(&inputs[i][0], &subdirs[i][0]);
+      } catch (fatal_error &e) {
+        results[i].error = e.message;
+      } catch (bad_alloc&) {
+        results[i].error = "Out of memory";
+      }
+      fatal_throw--;
+      if (results[i].error.empty()) {
+        printf("%8llu records %8.1f(s) %s\n", results[i].records, results[i].seconds, inputs[i].c_str());
+        return;
+      }
+      results[i].ifname = inputs[i];
+      results[i].bytes = sizes[i];
+      results[i].records = results[i].corrupt = results[i].packed = 0;
+      results[i].seconds = 0;
+      fprintf(stderr, "FAILED %s: %s\n", inputs[i].c_str(), results[i].error.c_str());
+    });
+  }
+  pool->Wait(&group);
+
+  string ofbatch = string(odname) + SEP + "usn_analytics_batch_report.txt";
+  FILE *fp_ofbatch;
+  if ((fp_ofbatch = fopen(ofbatch.c_str(), "w")) == NULL) {
+    perror("Output File Error");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t total_bytes = 0, total_records = 0, total_packed = 0, failed = 0;
+  fprintf(fp_ofbatch, "%lu inputs, %u threads\n", inputs.size(), pool->Size());
+  fprintf(fp_ofbatch, " Records |  Packed  | Corrupt  |        Bytes |  Time(s) | Host (Input)\n");
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!results[i].error.empty()) {
+      fprintf(fp_ofbatch, "  FAILED |          |          | %12llu |          | %s (%s): %s\n", results[i].bytes,
+        get_base_name(subdirs[i]).c_str(), inputs[i].c_str(), results[i].error.c_str());
+      failed++;
+      continue;
+    }
+    fprintf(fp_ofbatch, "%8llu | %8llu | %8llu | %12llu | %8.1f | %s (%s)\n", results[i].records, results[i].packed,
+      results[i].corrupt, results[i].bytes, results[i].seconds, get_base_name(subdirs[i]).c_str(), inputs[i].c_str());
+    total_bytes += results[i].bytes;
+    total_records += results[i].records;
+    total_packed += results[i].packed;
+  }
+  fprintf(fp_ofbatch, "===================================================================================================\n");
+  fprintf(fp_ofbatch, "%8llu | %8llu |          | %12llu | %8.1f | total\n", total_records, total_packed, total_bytes,
+    chrono::duration<double>(chrono::steady_clock::now() - t_start).count());
+  if (failed > 0) {
+    fprintf(fp_ofbatch, "%llu inputs failed\n", failed);
+    printf("%llu inputs failed\n", failed);
+  }
+  fclose(fp_ofbatch);
+  return failed > 0 ? -1 : 0;
+}
+
+// Print records csv rows of files found in usn_analytics.hidx
+// ids are FileIDs (every sequence) or file references (with sequence)
+void query_history(const string &odname, const vector<uint64_t> &ids, const vector<string> &names) {
+  HistoryIndex history;
+  if (history.Open((odname + SEP + HIDX_NAME).c_str()) < 0)
+    exit(EXIT_FAILURE);
+
+  // a name stands for every file (file reference) it was given to
+  vector<uint32_t> rows;
+  vector<uint64_t> refs;
+  for (auto &name: names) {
+    vector<uint32_t> name_rows;
+    history.FindName(name, &name_rows);
+    for (uint32_t r: name_rows)
+      refs.push_back(history.Row(r).id);
+  }
+  sort(refs.begin(), refs.end());
+  refs.erase(unique(refs.begin(), refs.end()), refs.end());
+  for (uint64_t id: refs)
+    history.FindId(id, &rows);
+  for (uint64_t id: ids) {
+    if (id >> 48 == 0)
+      history.FindFileId(id, &rows);
+    else
+      history.FindId(id, &rows);
+  }
+  sort(rows.begin(), rows.end());
+  rows.erase(unique(rows.begin(), rows.end()), rows.end());
+
+  map<uint32_t, FILE*> csv_files;
+  string line;
+  set<uint64_t> files;
+  for (size_t i = 0; i < rows.size(); i++) {
+    const hidx_row &r = history.Row(rows[i]);
+    files.insert(r.id);
+    FILE *&fp = csv_files[r.file];
+    if (fp == NULL && (fp = fopen((odname + SEP + history.FileName(r.file)).c_str(), "rb")) == NULL) {
+      perror("Records File Error");
+      exit(EXIT_FAILURE);
+    }
+    // header of the first csv
+    if (i == 0) {
+      char buf[1024];
+      if (fgets(buf, sizeof(buf), fp) != NULL)
+        fputs(buf, stdout);
+    }
+    line.resize(r.len);
+    fseeko64(fp, r.offset, SEEK_SET);
+    if (fread(&line[0], 1, r.len, fp) != r.len) {
+      fprintf(stderr, "Records File Error: %s is shorter than its index\n", history.FileName(r.file).c_str());
+      exit(EXIT_FAILURE);
+    }
+    fwrite(line.data(), 1, line.size(), stdout);
+  }
+  for (auto &x: csv_files)
+    fclose(x.second);
+  fprintf(stderr, "%8lu records of %lu files\n", rows.size(), files.size());
+}
+
+// Print directories of usn_analytics.dtree as they were at a usn or time
+// (all of them with tree, else the given ids), latest state if neither is given
+void query_dir_tree(const string &odname, const vector<uint32_t> &paths, bool tree, uint64_t at_usn, const char *at_time) {
+  DirTree dtree;
+  if (dtree.Open((odname + SEP + DTREE_NAME).c_str()) < 0)
+    exit(EXIT_FAILURE);
+
+  int64_t v = dtree.Versions() - 1;
+  if (at_time != NULL) {
+    uint64_t ts, unit;
+    if (parse_time(at_time, lt, &ts, &unit) < 0) {
+      fprintf(stderr, "invalid time: %s\n", at_time);
+      exit(EXIT_FAILURE);
+    }
+    v = dtree.FindTime(ts);
+  } else if (at_usn != UINT64_MAX)
+    v = dtree.FindUsn(at_usn);
+
+  printf("\"FileID\"\t\"ParentID\"\t\"Usn\"\t\"State\"\t\"Path\"\n");
+  if (v < 0) {
+    fprintf(stderr, "No directory change recorded before that point\n");
+    return;
+  }
+  uint64_t n = 0;
+  auto print = [&dtree, &n, v](const dtree_node &x) {
+    printf("\"%u\"\t\"%u\"\t\"%llu\"\t\"%s\"\t\"%s\"\n", x.id, x.pid, x.usn,
+      (x.flags & DTREE_DELETED) ? "DELETED" : "", dtree.Path(v, x.id).c_str());
+    n++;
+  };
+  if (tree) {
+    dtree.Walk(v, [&print](const dtree_node &x) {
+      if (!(x.flags & DTREE_DELETED))
+        print(x);
+    });
+  }
+  for (uint32_t id: paths) {
+    const dtree_node *x = dtree.Get(v, id);
+    if (x != NULL)
+      print(*x);
+  }
+  fprintf(stderr, "%8llu directories at USN %llu (%s)\n", n, dtree.Version(v).usn,
+    parse_datetimemicro(dtree.Version(v).ts, lt).c_str());
+}
+
+// query subcommand, reads output directory of a previous run
+int query(int argc, char **argv) {
+  vector<uint64_t> ids;
+  vector<string> names;
+  vector<uint32_t> paths;
+  bool tree = false;
+  uint64_t at_usn = UINT64_MAX;
+  char *at_time = NULL;
+  int opt;
+  int longindex;
+
+  struct option longopts[] = {
+    {"utc", no_argument, NULL, 'u'},
+    {"id", required_argument, NULL, 1},
+    {"name", required_argument, NULL, 2},
+    {"path", required_argument, NULL, 3},
+    {"tree", no_argument, NULL, 4},
+    {"at-usn", required_argument, NULL, 5},
+    {"at", required_argument, NULL, 6},
+    {0, 0, 0, 0},
+  };
+
+  while((opt = getopt_long(argc, argv, "u", longopts, &longindex)) != -1) {
+    switch(opt) {
+      case 'u':
+        lt = false;
+        break;
+      case 1:
+        ids.push_back(strtoull(optarg, NULL, 0));
+        break;
+      case 2:
+        names.push_back(optarg);
+        break;
+      case 3:
+        paths.push_back(strtoul(optarg, NULL, 0));
+        break;
+      case 4:
+        tree = true;
+        break;
+      case 5:
+        at_usn = strtoull(optarg, NULL, 0);
+        break;
+      case 6:
+        at_time = optarg;
+        break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  bool history = !ids.empty() || !names.empty();
+  bool dirs = !paths.empty() || tree;
+  if (optind != argc - 1 || history == dirs) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  string odname = argv[optind];
+
+  if (history)
+    query_history(odname, ids, names);
+  else
+    query_dir_tree(odname, paths, tree, at_usn, at_time);
+  return 0;
+}
+
+// merge subcommand, streams records csv files of output directories of previous runs
+int merge(int argc, char **argv) {
+  char *ofname = NULL;
+  int opt;
+  int longindex;
+
+  struct option longopts[] = {
+    {"utc", no_argument, NULL, 'u'},
+    {0, 0, 0, 0},
+  };
+
+  while((opt = getopt_long(argc, argv, "o:u", longopts, &longindex)) != -1) {
+    switch(opt) {
+      case 'o':
+        ofname = optarg;
+        break;
+      case 'u':
+        lt = false;
+        break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  TimelineMerge timeline;
+  for (int i = optind; i < argc; i++) {
+    string dname = argv[i];
+    string name;
+    size_t pos = dname.find('=');
+    if (pos != string::npos && !is_dir(argv[i])) {
+      name = dname.substr(0, pos);
+      dname = dname.substr(pos + 1);
+    }
+    if (!is_dir(dname.c_str())) {
+      fprintf(stderr, "%s is not a directory\n", dname.c_str());
+      exit(EXIT_FAILURE);
+    }
+    if (timeline.AddSource(name.empty() ? get_base_name(dname) : name, dname) > 0)
+      continue;
+    // output directory of -b, a source per input
+    int added = 0;
+    for (auto &sub: list_dir_subdirs(dname.c_str()))
+      added += timeline.AddSource((name.empty() ? "" : name + "/") + get_base_name(sub), sub) > 0;
+    if (added == 0) {
+      fprintf(stderr, "No records csv in %s\n", dname.c_str());
+      exit(EXIT_FAILURE);
+    }
   }
+
+  FILE *fp = stdout;
+  if (ofname != NULL && (fp = fopen(ofname, "w")) == NULL) {
+    perror("Output File Error");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t n = timeline.Write(fp, lt);
+  if (fp != stdout)
+    fclose(fp);
+  fprintf(stderr, "%8llu records of %lu sources\n", n, timeline.Sources());
+  return 0;
 }
 
 int main(int argc, char **argv) {
     
+  // before the timer, query output is only the records
+  if (argc > 1 && strcmp(argv[1], "query") == 0)
+    return query(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "merge") == 0)
+    return merge(argc - 1, argv + 1);
+
   char *ifname = NULL;
   char *odname = NULL;
+  char *progress_target = NULL;
+  char *ts_from = NULL;
+  char *ts_to = NULL;
+  vector<string> inputs;
   timer measure_time;
 
   int opt;
   int longindex;
   
   struct option longopts[] = {
+    {"batch", no_argument, NULL, 'b'},
     {"help", no_argument, NULL, 'h'},
+    {"ioc", required_argument, NULL, 'i'},
     {"output", required_argument, NULL, 'o'},
     {"raw", no_argument, NULL, 'r'}, 
+    {"threads", required_argument, NULL, 't'},
     {"utc", no_argument, NULL, 'u'}, 
+    {"burst-window", required_argument, NULL, 1},
+    {"burst-threshold", required_argument, NULL, 2},
+    {"resume", no_argument, NULL, 3},
+    {"chunk-cache", required_argument, NULL, 4},
+    {"index", required_argument, NULL, 5},
+    {"mft", required_argument, NULL, 6},
+    {"multi", no_argument, NULL, 'm'},
+    {"follow", no_argument, NULL, 7},
+    {"follow-latency", required_argument, NULL, 8},
+    {"perf-counters", no_argument, NULL, 9},
+    {"progress", required_argument, NULL, 10},
+    {"progress-interval", required_argument, NULL, 11},
+    {"memory-budget", required_argument, NULL, 12},
+    {"from", required_argument, NULL, 13},
+    {"to", required_argument, NULL, 14},
+    {"usn-range", required_argument, NULL, 15},
+    {"reason-mask", required_argument, NULL, 16},
+    {"name", required_argument, NULL, 17},
+    {"history-index", no_argument, NULL, 18},
+    {"dir-tree", no_argument, NULL, 19},
+    {"ntfs-image", no_argument, NULL, 20},
     {0, 0, 0, 0},
   };
 
-  while((opt = getopt_long(argc, argv, "ho:ru", longopts, &longindex)) != -1) {
+  while((opt = getopt_long(argc, argv, "bhi:mo:rt:u", longopts, &longindex)) != -1) {
     switch(opt) {     
+      case 'b':
+        batch = true;
+        break;
       case 'h':
         usage();
         exit(EXIT_FAILURE);
+      case 'i':
+        iocfname = optarg;
+        break;
+      case 'm':
+        multi = true;
+        break;
       case 'o':
         odname = optarg;
         break;
       case 'r':
         raw = true;
         break;
+      case 't':
+        threads = strtoul(optarg, NULL, 10);
+        break;
       case 'u':
         lt = false;
         break;
+      case 1:
+        burst_window = strtoul(optarg, NULL, 10);
+        break;
+      case 2:
+        burst_threshold = strtoul(optarg, NULL, 10);
+        break;
+      case 3:
+        resume = true;
+        break;
+      case 4:
+        cdcfname = optarg;
+        break;
+      case 5:
+        idxfname = optarg;
+        break;
+      case 6:
+        mftfname = optarg;
+        break;
+      case 7:
+        follow = true;
+        break;
+      case 8:
+        follow_latency = strtoul(optarg, NULL, 10);
+        break;
+      case 9:
+        perf = new PerfCounters();
+        break;
+      case 10:
+        progress_target = optarg;
+        break;
+      case 11:
+        progress_interval = strtoul(optarg, NULL, 10);
+        break;
+      case 12:
+        memory_budget = parse_size(optarg);
+        break;
+      case 13:
+        ts_from = optarg;
+        break;
+      case 14:
+        ts_to = optarg;
+        break;
+      case 15:
+        if (filter.SetUsnRange(optarg) < 0) {
+          printf("invalid usn range: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 16:
+        if (filter.SetReasonMask(optarg) < 0) {
+          printf("invalid reason mask: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 17:
+        filter.AddName(optarg);
+        break;
+      case 18:
+        history_index = true;
+        break;
+      case 19:
+        dir_tree = true;
+        break;
+      case 20:
+        ntfs_image = true;
+        break;
     }
   }
-  for (int i = optind; i < argc; i++)
+  for (int i = optind; i < argc; i++) {
     ifname = argv[i];
+    if (batch && is_dir(argv[i])) {
+      vector<string> files = list_dir_files(argv[i]);
+      inputs.insert(inputs.end(), files.begin(), files.end());
+    } else
+      inputs.push_back(argv[i]);
+  }
 
   if (!ifname || !odname) {
     usage();
     exit(EXIT_FAILURE);
   }
   
-  struct stat st;
-  if (is_empty_dir(odname) == false) {
-    if (stat(odname, &st) == 0) {
-      std::cout << odname << " already exist" << std::endl;
-      std::cout << "Please specify a empty directory or new directory" << std::endl;
+  if (multi) {
+    if (batch || resume || follow) {
+      printf("-m can not be used with -b, --resume or --follow\n");
       exit(EXIT_FAILURE);
     }
-    int dresult;
-    // try to create directory
-#ifdef _WIN32
-    dresult = _mkdir(odname);
-#else
-    dresult = mkdir(odname, 0775);
-#endif
-
-    if(dresult != 0) {
-      std::cout << "unable to create " << odname << std::endl;
-      std::cout << "Please check existence of parent directory and/or permissions" << std::endl;
+    sources = inputs;
+    ifname = &sources[0][0];
+  }
+  // time zone of -u is known after all options
+  if (ts_from != NULL && filter.SetFrom(ts_from, lt) < 0) {
+    printf("invalid time: %s\n", ts_from);
+    exit(EXIT_FAILURE);
+  }
+  if (ts_to != NULL && filter.SetTo(ts_to, lt) < 0) {
+    printf("invalid time: %s\n", ts_to);
+    exit(EXIT_FAILURE);
+  }
+  if (filter.Active() && (resume || follow)) {
+    printf("--from, --to, --usn-range, --reason-mask and --name can not be used with --resume or --follow\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((history_index || dir_tree) && (raw || resume || follow)) {
+    printf("--history-index and --dir-tree can not be used with -r, --resume or --follow\n");
+    exit(EXIT_FAILURE);
+  }
+  // no packing, header predicates are exact
+  filter.margin = !raw;
+  if (memory_budget > 0 && (multi || resume || follow)) {
+    printf("--memory-budget can not be used with -m, --resume or --follow\n");
+    exit(EXIT_FAILURE);
+  }
+  if (follow && (raw || batch)) {
+    printf("--follow can not be used with -r or -b\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ntfs_image && (batch || multi || resume || follow)) {
+    printf("--ntfs-image can not be used with -b, -m, --resume or --follow\n");
+    exit(EXIT_FAILURE);
+  }
+  // a compressed input does not grow in place
+  if (follow && input_format(ifname) != PLAIN_INPUT) {
+    printf("--follow can not be used with a compressed input\n");
+    exit(EXIT_FAILURE);
+  }
+  if (resume) {
+    if (raw || batch) {
+      printf("--resume can not be used with -r or -b\n");
       exit(EXIT_FAILURE);
     }
-  } 
+    if (!is_dir(odname)) {
+      printf("%s does not exist\n", odname);
+      exit(EXIT_FAILURE);
+    }
+  } else
+    create_output_dir(odname);
 
-  process(ifname, odname);
-  return 0;
+  // before the pool, counters are inherited by threads created after opening
+  if (perf != NULL && !perf->Open())
+    printf("Performance counters not available (%s), continue without them\n", perf->error.c_str());
+  if (threads == 0)
+    threads = thread::hardware_concurrency();
+  pool = new WorkStealingPool(threads);
+  if (progress_target != NULL) {
+    progress = new Progress();
+    if (progress->Open(progress_target, progress_interval) < 0)
+      exit(EXIT_FAILURE);
+  }
+
+  int ret = 0;
+  if (batch) {
+    quiet = true;
+    ret = process_batch(inputs, odname);
+  } else
+    process(ifname, odname);
+  if (progress != NULL) {
+    progress->Close();
+    delete progress;
+  }
+  delete pool;
+  return ret < 0 ? EXIT_FAILURE : 0;
 }